@@ -12,9 +12,7 @@
 
 #include <sys/wait.h>
 #include <sys/time.h>
-#ifndef USEMMAP
-  #include <sys/shm.h>
-#endif
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -383,12 +381,59 @@ static float timeout_fbck_is_interesting(feedback_t *feedback,
 
 }
 
+#if defined(USEMMAP) || defined(USEMEMFD)
+/* AFL++ targets attach __AFL_SHM_ID with shmat(), they know nothing of the
+ * shm_open paths or memfds of the other shmem backends. So the trace map stays
+ * a SysV segment, whatever backend the lib was built with. */
+static u8 *trace_map_init_sysv(afl_shmem_t *shm, size_t map_size) {
+
+  int shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600);
+  if (shm_id < 0) { return NULL; }
+
+  u8 *map = shmat(shm_id, NULL, 0);
+  if (map == (void *)-1) {
+
+    shmctl(shm_id, IPC_RMID, NULL);
+    return NULL;
+
+  }
+
+  afl_shmem_deinit(shm);
+  shm->map = map;
+  shm->map_size = map_size;
+  shm->mapped_size = map_size;
+  shm->g_shm_fd = -1;
+  snprintf(shm->shm_str, sizeof(shm->shm_str), "%d", shm_id);
+  return map;
+
+}
+
+/* Removes the trace map again, before the channel gets deleted */
+static void trace_map_deinit_sysv(afl_shmem_t *shm) {
+
+  shmdt(shm->map);
+  shmctl(atoi(shm->shm_str), IPC_RMID, NULL);
+  shm->map = NULL;
+
+}
+
+#endif
+
 engine_t *initialize_engine_instance(char *target_path, char *in_dir,
                                      char **target_args) {
 
   /* Let's now create a simple map-based observation channel */
   map_based_channel_t *trace_bits_channel =
       afl_map_channel_create(MAP_SIZE, MAP_CHANNEL_ID);
+  if (!trace_bits_channel) { FATAL("Error initializing trace map channel"); }
+#if defined(USEMMAP) || defined(USEMEMFD)
+  if (!trace_map_init_sysv(&trace_bits_channel->shared_map, MAP_SIZE)) {
+
+    PFATAL("Could not create the trace map");
+
+  }
+
+#endif
 
   /* Another timing based observation channel */
   timeout_obs_channel_t *timeout_channel =
@@ -414,10 +459,7 @@ engine_t *initialize_engine_instance(char *target_path, char *in_dir,
                                            &trace_bits_channel->base);
   fsrv->base.funcs.add_observation_channel(&fsrv->base, &timeout_channel->base);
 
-  char shm_str[256];
-  snprintf(shm_str, sizeof(shm_str), "%d",
-           trace_bits_channel->shared_map.shm_id);
-  setenv("__AFL_SHM_ID", (char *)shm_str, 1);
+  setenv("__AFL_SHM_ID", trace_bits_channel->shared_map.shm_str, 1);
   fsrv->trace_bits = trace_bits_channel->shared_map.map;
 
   /* We create a simple feedback queue for coverage here*/
@@ -537,6 +579,9 @@ void thread_run_instance(llmp_client_state_t *client, void *data) {
    * initialized using the deleted functions provided */
 
   afl_executor_delete(&fsrv->base);
+#if defined(USEMMAP) || defined(USEMEMFD)
+  trace_map_deinit_sysv(&trace_bits_channel->shared_map);
+#endif
   afl_map_channel_delete(trace_bits_channel);
   afl_observation_channel_delete(&timeout_channel->base);
   afl_scheduled_mutator_delete(mutators_havoc);
@@ -3,6 +3,10 @@ Example main for llmp.
 */
 
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include "aflpp.h"
 #include "debug.h"
@@ -13,6 +17,28 @@ Example main for llmp.
 /* Just a u32 in a msg, for testing purposes */
 #define LLMP_TAG_RANDOM_U32_V1 (0x344D011)
 
+/* A u64 timestamp (in ns) in a msg, for the latency benchmark */
+#define LLMP_TAG_TIMESTAMP_V1 (0x71AE57)
+
+/* How many msgs the latency benchmark measures */
+#define LLMP_BENCH_SAMPLES (2000)
+
+/* How many msgs the forwarding benchmark pushes through the broker, in total */
+#define LLMP_BENCH_FORWARD_MSGS (1 << 19)
+/* How many msgs each client posts before the broker runs once */
+#define LLMP_BENCH_FORWARD_BURST (32)
+/* Payload size of each msg in the forwarding benchmark */
+#define LLMP_BENCH_FORWARD_LEN (64)
+
+/* How many msgs the polling benchmark publishes */
+#define LLMP_BENCH_POLL_MSGS (1 << 22)
+/* The most readers the polling benchmark polls with */
+#define LLMP_BENCH_POLL_MAX_READERS (64)
+
+/* Where the broker of the connect benchmark listens */
+#define LLMP_BENCH_CONNECT_PORT (0xAF2)
+#define LLMP_BENCH_CONNECT_PATH "/tmp/llmp_bench_connect.sock"
+
 /* A client that randomly produces messages */
 void llmp_clientloop_rand_u32(llmp_client_state_t *client, void *data) {
 
@@ -22,6 +48,9 @@ void llmp_clientloop_rand_u32(llmp_client_state_t *client, void *data) {
 
   if (afl_rand_init(&rnd) != AFL_RET_SUCCESS) { FATAL("Error creating rnd"); }
 
+  /* We only send, don't keep broadcast pages around for us */
+  llmp_client_ignore_broadcasts(client);
+
   while (1) {
 
     llmp_message_t *msg = llmp_client_alloc_next(client, sizeof(u32));
@@ -57,12 +86,476 @@ void llmp_clientloop_print_u32(llmp_client_state_t *client_state, void *data) {
 
       }
 
-      printf("Got a random int from the queue: %d\n", ((u32 *)message->buf)[0]);
+      if (message->sender & LLMP_SENDER_BRIDGED) {
+
+        printf("Got a random int from node %u: %d\n",
+               LLMP_SENDER_ORIGIN(message->sender), ((u32 *)message->buf)[0]);
+
+      } else {
+
+        printf("Got a random int from the queue: %d\n",
+               ((u32 *)message->buf)[0]);
+
+      }
+
+    }
+
+  }
+
+}
+
+/* Current (monotonic) time in nanoseconds */
+static u64 bench_time_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+
+  u64 x = *(const u64 *)a;
+  u64 y = *(const u64 *)b;
+  return x < y ? -1 : x > y;
+
+}
+
+/* A client that sends a timestamp every ms, so the broker goes idle in between
+ */
+void llmp_clientloop_send_timestamps(llmp_client_state_t *client, void *data) {
+
+  (void)data;
+
+  llmp_client_ignore_broadcasts(client);
+
+  while (1) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(client, sizeof(u64));
+    msg->tag = LLMP_TAG_TIMESTAMP_V1;
+    ((u64 *)msg->buf)[0] = bench_time_ns();
+    llmp_client_send(client, msg);
+    usleep(1000);
+
+  }
+
+}
+
+/* A client measuring the time it took the timestamps to reach it through the
+ * broker. Prints the results and exits. */
+void llmp_clientloop_measure_latency(llmp_client_state_t *client, void *data) {
+
+  (void)data;
+
+  u64 *  latencies = calloc(LLMP_BENCH_SAMPLES, sizeof(u64));
+  u64    total = 0;
+  size_t count = 0;
+
+  if (!latencies) { FATAL("Could not allocate mem for samples"); }
+
+  while (count < LLMP_BENCH_SAMPLES) {
+
+    llmp_message_t *message = llmp_client_recv_blocking(client);
+    if (message->tag != LLMP_TAG_TIMESTAMP_V1) { continue; }
+
+    latencies[count] = bench_time_ns() - ((u64 *)message->buf)[0];
+    total += latencies[count];
+    count++;
+
+  }
+
+  qsort(latencies, count, sizeof(u64), bench_cmp_u64);
+
+  OKF("Forwarding latency over %ld msgs (us): min %.1f, median %.1f, p99 "
+      "%.1f, max %.1f, avg %.1f",
+      count, latencies[0] / 1000.0, latencies[count / 2] / 1000.0,
+      latencies[count * 99 / 100] / 1000.0, latencies[count - 1] / 1000.0,
+      total / 1000.0 / count);
+
+  exit(0);
+
+}
+
+/* Measures the broker's forwarding throughput: each client posts a burst of
+ * msgs, then the broker forwards all of them at once. Prints msgs/s and exits.
+ * The clients are driven from here, not as threads, so only the broker gets
+ * timed. */
+static void bench_forward(int client_count) {
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  int                  i, j;
+
+  if (!broker) { FATAL("Could not create broker"); }
+
+  for (i = 0; i < client_count; i++) {
+
+    if (!llmp_broker_register_threaded_clientloop(broker, NULL, NULL)) {
+
+      FATAL("error adding threaded client");
+
+    }
+
+    /* Nobody reads, old broadcast pages can go */
+    llmp_client_ignore_broadcasts(broker->llmp_clients[i].client_state);
+
+  }
+
+  u64 forwarded = 0;
+  u64 spent_ns = 0;
+
+  while (forwarded < LLMP_BENCH_FORWARD_MSGS) {
+
+    for (i = 0; i < client_count; i++) {
+
+      llmp_client_state_t *client = broker->llmp_clients[i].client_state;
+
+      for (j = 0; j < LLMP_BENCH_FORWARD_BURST; j++) {
+
+        llmp_message_t *msg =
+            llmp_client_alloc_next(client, LLMP_BENCH_FORWARD_LEN);
+        if (!msg) { FATAL("Could not alloc msg"); }
+        msg->tag = LLMP_TAG_RANDOM_U32_V1;
+        memset(msg->buf, j, LLMP_BENCH_FORWARD_LEN);
+        llmp_client_send(client, msg);
+
+      }
+
+    }
+
+    u64 start = bench_time_ns();
+    llmp_broker_once(broker);
+    spent_ns += bench_time_ns() - start;
+
+    forwarded += client_count * LLMP_BENCH_FORWARD_BURST;
+
+  }
+
+  OKF("Forwarded %llu msgs of %d bytes from %d clients in %.1f ms: %.2f M "
+      "msgs/s, %ld MB shm in use",
+      forwarded, LLMP_BENCH_FORWARD_LEN, client_count, spent_ns / 1000000.0,
+      forwarded * 1000.0 / spent_ns, llmp_broker_shm_usage(broker) >> 20);
+
+  llmp_broker_destroy(broker);
+  exit(0);
+
+}
+
+/* A client process of the connect benchmark: connects, sends its pid and
+ * exits once it got it back from the broker */
+static void bench_connect_client(bool use_unix) {
+
+  llmp_client_state_t *client;
+
+  if (use_unix) {
+
+    client = llmp_client_new_unix(LLMP_BENCH_CONNECT_PATH);
+
+  } else {
+
+    client = llmp_client_new(LLMP_BENCH_CONNECT_PORT);
+
+  }
+
+  if (!client) { PFATAL("Could not connect to the broker"); }
+
+  u32             me = getpid();
+  llmp_message_t *msg = llmp_client_alloc_next(client, sizeof(u32));
+  if (!msg) { FATAL("Could not alloc msg"); }
+  msg->tag = LLMP_TAG_RANDOM_U32_V1;
+  ((u32 *)msg->buf)[0] = me;
+  llmp_client_send(client, msg);
+
+  while ((msg = llmp_client_recv_blocking(client))) {
+
+    if (msg->tag == LLMP_TAG_RANDOM_U32_V1 && ((u32 *)msg->buf)[0] == me) {
+
+      _exit(0);
 
     }
 
   }
 
+  _exit(1);
+
+}
+
+/* Starts client_count client processes at once, returns the ns it took until
+ * all of them were up and got a msg through the broker */
+static u64 bench_connect_run(int client_count, bool use_unix) {
+
+  u64 start = bench_time_ns();
+  int i;
+
+  for (i = 0; i < client_count; i++) {
+
+    pid_t pid = fork();
+    if (pid < 0) { PFATAL("fork failed"); }
+    if (!pid) { bench_connect_client(use_unix); }
+
+  }
+
+  for (i = 0; i < client_count; i++) {
+
+    int status;
+    if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+
+      FATAL("A client of the connect benchmark failed");
+
+    }
+
+  }
+
+  return bench_time_ns() - start;
+
+}
+
+/* Compares the startup of client_count client processes, connecting over tcp
+ * or the unix socket */
+static void bench_connect(int client_count) {
+
+  pid_t broker_pid = fork();
+  if (broker_pid < 0) { PFATAL("fork failed"); }
+
+  if (!broker_pid) {
+
+    llmp_broker_state_t *broker = llmp_broker_new();
+    if (!broker ||
+        !llmp_broker_register_local_server(broker, LLMP_BENCH_CONNECT_PORT) ||
+        !llmp_broker_register_unix_server(broker, LLMP_BENCH_CONNECT_PATH)) {
+
+      FATAL("Could not set up the broker");
+
+    }
+
+    llmp_broker_run(broker);
+
+  }
+
+  /* Let the servers come up */
+  usleep(200 * 1000);
+
+  u64 tcp_ns = bench_connect_run(client_count, false);
+  u64 unix_ns = bench_connect_run(client_count, true);
+
+  OKF("%d clients up over tcp in %.1f ms, over the unix socket in %.1f ms",
+      client_count, tcp_ns / 1000000.0, unix_ns / 1000000.0);
+
+  kill(broker_pid, SIGKILL);
+  waitpid(broker_pid, NULL, 0);
+  unlink(LLMP_BENCH_CONNECT_PATH);
+
+  exit(0);
+
+}
+
+/* The page header fields of the old, packed llmp page layout (v1), to compare
+ * the current layout against */
+typedef struct bench_page_v1 {
+
+  u32             sender;
+  u32             generation;
+  volatile u32    save_to_unmap;
+  volatile size_t current_msg_id;
+  size_t          size_total;
+  size_t          size_used;
+  size_t          max_alloc_size;
+
+} __attribute__((__packed__)) bench_page_v1_t;
+
+/* The header fields touched on each send and receive, in either layout */
+typedef struct bench_poll_fields {
+
+  volatile size_t *current_msg_id;
+  size_t *         size_used;
+  size_t *         max_alloc_size;
+  volatile u32 *   save_to_unmap;
+
+} bench_poll_fields_t;
+
+/* The fields of a page header of the given type. By offset, as the packed v1
+ * fields may be unaligned. */
+#define BENCH_POLL_FIELDS(page, type)                                 \
+  {(volatile size_t *)((u8 *)(page) + offsetof(type, current_msg_id)), \
+   (size_t *)((u8 *)(page) + offsetof(type, size_used)),               \
+   (size_t *)((u8 *)(page) + offsetof(type, max_alloc_size)),          \
+   (volatile u32 *)((u8 *)(page) + offsetof(type, save_to_unmap))}
+
+/* A receiver: polls current_msg_id until the last msg got published and
+ * flags the page save_to_unmap on the first msg, as llmp clients do. */
+static void *bench_poll_reader(void *data) {
+
+  bench_poll_fields_t *fields = (bench_poll_fields_t *)data;
+  size_t               last_msg_id = 0;
+
+  while (last_msg_id < LLMP_BENCH_POLL_MSGS) {
+
+    size_t msg_id = __atomic_load_n(fields->current_msg_id, __ATOMIC_ACQUIRE);
+    if (msg_id != last_msg_id) {
+
+      if (!last_msg_id) { *fields->save_to_unmap = 1; }
+      last_msg_id = msg_id;
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+/* Times a sender doing the header updates of an alloc and a send per msg,
+ * while reader_count receivers poll the same header. Returns M msgs/s. */
+static double bench_poll_layout(bench_poll_fields_t *fields, int reader_count) {
+
+  pthread_t readers[LLMP_BENCH_POLL_MAX_READERS];
+  int       i;
+
+  for (i = 0; i < reader_count; i++) {
+
+    if (pthread_create(&readers[i], NULL, bench_poll_reader, fields)) {
+
+      PFATAL("Could not create reader thread");
+
+    }
+
+  }
+
+  u64    start = bench_time_ns();
+  size_t msg_id;
+  for (msg_id = 1; msg_id <= LLMP_BENCH_POLL_MSGS; msg_id++) {
+
+    /* llmp_alloc_next */
+    *fields->size_used += 96;
+    *fields->max_alloc_size = MAX(*fields->max_alloc_size, msg_id & 0xFF);
+    /* llmp_send */
+    __atomic_store_n(fields->current_msg_id, msg_id, __ATOMIC_RELEASE);
+
+  }
+
+  u64 spent_ns = bench_time_ns() - start;
+
+  for (i = 0; i < reader_count; i++) {
+
+    pthread_join(readers[i], NULL);
+
+  }
+
+  return LLMP_BENCH_POLL_MSGS * 1000.0 / spent_ns;
+
+}
+
+/* Compares the false sharing between one sender and many polling receivers
+ * in the old, packed page layout and in the current one. Prints msgs/s of
+ * the sender for both and exits. */
+static void bench_poll(int reader_count) {
+
+  if (reader_count < 1 || reader_count > LLMP_BENCH_POLL_MAX_READERS) {
+
+    FATAL("Reader count must be between 1 and %d",
+          LLMP_BENCH_POLL_MAX_READERS);
+
+  }
+
+  /* Cache line aligned, as page headers are */
+  bench_page_v1_t *v1 = aligned_alloc(LLMP_CACHE_LINE_SIZE,
+                                      2 * LLMP_CACHE_LINE_SIZE);
+  llmp_page_t *    v2 = aligned_alloc(LLMP_CACHE_LINE_SIZE, sizeof(llmp_page_t));
+  if (!v1 || !v2) { FATAL("Could not allocate mem for page headers"); }
+  memset(v1, 0, 2 * LLMP_CACHE_LINE_SIZE);
+  memset(v2, 0, sizeof(llmp_page_t));
+
+  bench_poll_fields_t v1_fields = BENCH_POLL_FIELDS(v1, bench_page_v1_t);
+  bench_poll_fields_t v2_fields = BENCH_POLL_FIELDS(v2, llmp_page_t);
+
+  double v1_rate = bench_poll_layout(&v1_fields, reader_count);
+  double v2_rate = bench_poll_layout(&v2_fields, reader_count);
+
+  OKF("Sent %d msgs to %d polling readers: packed layout %.2f M msgs/s, "
+      "layout v%d %.2f M msgs/s (%.2fx)",
+      LLMP_BENCH_POLL_MSGS, reader_count, v1_rate, LLMP_LAYOUT_VERSION,
+      v2_rate, v2_rate / v1_rate);
+
+  free(v1);
+  free(v2);
+  exit(0);
+
+}
+
+/* Maps the stats page of a running broker and prints it once a second */
+static void print_stats(char *shm_str) {
+
+  afl_shmem_t        stats_map = {0};
+  llmp_stats_page_t *stats = llmp_stats_map(&stats_map, shm_str);
+  u32                i;
+
+  if (!stats) { FATAL("Could not map stats page %s", shm_str); }
+
+  while (1) {
+
+    SAYF("broadcast: %llu msgs, %llu bytes, %llu eops\n",
+         stats->msgs_broadcast, stats->bytes_broadcast, stats->eops);
+    if (stats->dedup_msgs) {
+
+      SAYF("dedup: %llu of %llu queue entries dropped (%.1f%%)\n",
+           stats->dedup_drops, stats->dedup_msgs,
+           100.0 * stats->dedup_drops / stats->dedup_msgs);
+
+    }
+
+    SAYF("%6s %12s %14s %12s %14s %10s %8s %10s\n", "client", "msgs sent",
+         "bytes sent", "msgs recvd", "bytes recvd", "lag", "eops", "dropped");
+
+    for (i = 0; i < MIN(stats->client_count, (u32)LLMP_STATS_MAX_CLIENTS);
+         i++) {
+
+      llmp_client_stats_t *client = &stats->clients[i];
+      SAYF("%6u %12llu %14llu %12llu %14llu %10llu %8llu %10llu\n", i,
+           client->msgs_sent, client->bytes_sent, client->msgs_recvd,
+           client->bytes_recvd, client->lag, client->eops, client->hook_drops);
+
+    }
+
+    SAYF("\n");
+    sleep(1);
+
+  }
+
+}
+
+/* A broker with a random int sender and printer, bridged to another node */
+static void run_bridged(int port, char *host) {
+
+  u32                  tags[] = {LLMP_TAG_RANDOM_U32_V1};
+  llmp_broker_state_t *broker = llmp_broker_new();
+
+  if (!broker) { FATAL("Could not create broker"); }
+
+  llmp_bridge_t *bridge =
+      llmp_broker_register_bridge(broker, host, port, tags, 1);
+  if (!bridge) { FATAL("Could not set up bridge on port %d", port); }
+
+  if (!llmp_broker_register_threaded_clientloop(
+          broker, llmp_clientloop_print_u32, NULL) ||
+      !llmp_broker_register_threaded_clientloop(
+          broker, llmp_clientloop_rand_u32, NULL)) {
+
+    FATAL("error adding threaded client");
+
+  }
+
+  if (host) {
+
+    OKF("Node %u bridging to %s:%d", broker->node_id, host, port);
+
+  } else {
+
+    OKF("Node %u waiting for a bridge on port %d", broker->node_id,
+        bridge->port);
+
+  }
+
+  llmp_broker_run(broker);
+
 }
 
 /* Main entry point function */
@@ -75,7 +568,68 @@ int main(int argc, char **argv) {
 
   if (argc < 2 || argc > 4) {
 
-    FATAL("Usage ./llmp_test [main|worker] <thread_count=1> <port=0xAF1>");
+    FATAL(
+        "Usage ./llmp_test [main|worker] <thread_count=1> <port=0xAF1>\n"
+        "  or  ./llmp_test bench-latency <doorbell|poll>\n"
+        "  or  ./llmp_test bench-forward <client_count=1>\n"
+        "  or  ./llmp_test bench-connect <client_count=200>\n"
+        "  or  ./llmp_test bench-poll <reader_count=4>\n"
+        "  or  ./llmp_test stats <stats_shm_str>\n"
+        "  or  ./llmp_test bridge <port> <host_to_connect_to>");
+
+  }
+
+  if (!strcmp(argv[1], "bench-forward")) {
+
+    bench_forward(argc > 2 ? atoi(argv[2]) : 1);
+
+  }
+
+  if (!strcmp(argv[1], "bench-connect")) {
+
+    bench_connect(argc > 2 ? atoi(argv[2]) : 200);
+
+  }
+
+  if (!strcmp(argv[1], "stats") && argc > 2) {
+
+    print_stats(argv[2]);
+
+  }
+
+  if (!strcmp(argv[1], "bridge") && argc > 2) {
+
+    run_bridged(atoi(argv[2]), argc > 3 ? argv[3] : NULL);
+
+  }
+
+  if (!strcmp(argv[1], "bench-poll")) {
+
+    bench_poll(argc > 2 ? atoi(argv[2]) : 4);
+
+  }
+
+  if (!strcmp(argv[1], "bench-latency")) {
+
+    /* Measure how long it takes the broker to forward a msg, when idle */
+    llmp_broker_state_t *broker = llmp_broker_new();
+
+    if (argc > 2 && !strcmp(argv[2], "poll")) {
+
+      llmp_broker_set_wakeup(broker, LLMP_WAKEUP_POLL);
+
+    }
+
+    if (!llmp_broker_register_threaded_clientloop(
+            broker, llmp_clientloop_measure_latency, NULL) ||
+        !llmp_broker_register_threaded_clientloop(
+            broker, llmp_clientloop_send_timestamps, NULL)) {
+
+      FATAL("error adding threaded client");
+
+    }
+
+    llmp_broker_run(broker);
 
   }
 
@@ -101,7 +655,7 @@ int main(int argc, char **argv) {
 
   if (argc > 3) {
 
-    port = atoi(argv[2]);
+    port = atoi(argv[3]);
     if (port <= 0 || port >= 1 << 16) { FATAL("illegal port"); }
 
   }
@@ -132,7 +686,8 @@ int main(int argc, char **argv) {
 
     }
 
-    OKF("Spawning main on port %d", port);
+    OKF("Spawning main on port %d, watch it using ./llmp_test stats %s", port,
+        llmp_broker_stats_shm_str(broker));
     llmp_broker_run(broker);
 
   } else {
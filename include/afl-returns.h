@@ -25,6 +25,8 @@ typedef enum afl_ret {
   AFL_RET_NO_FUZZ_WORKERS,
   AFL_RET_TRIM_FAIL,
   AFL_RET_ERROR_INPUT_COPY,
+  AFL_RET_MALFORMED_MSG,
+  AFL_RET_IN_USE,
 
 } afl_ret_t;
 
@@ -43,6 +45,10 @@ static inline char *afl_ret_stringify(afl_ret_t afl_ret) {
       return "Target did not behave as expected";
     case AFL_RET_ERROR_INPUT_COPY:
       return "Error creating input copy";
+    case AFL_RET_MALFORMED_MSG:
+      return "Malformed message";
+    case AFL_RET_IN_USE:
+      return "Already in use by another process";
     case AFL_RET_ALLOC:
       if (!errno) { return "Allocation failed"; }
       /* fall-through */
@@ -5,15 +5,31 @@
 
 #define AFL_SHMEM_STRLEN_MAX (20)
 
+#if defined(USEMMAP) && defined(USEMEMFD)
+  #error "USEMMAP and USEMEMFD are mutually exclusive"
+#endif
+
+/* With USEMEMFD, maps of at least AFL_SHMEM_HUGEPAGE_MIN bytes get rounded up
+ * to whole huge pages and backed by hugetlb, if the system has huge pages
+ * reserved. Otherwise, large maps are advised to use transparent huge pages. */
+#define AFL_SHMEM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#ifndef AFL_SHMEM_HUGEPAGE_MIN
+  #define AFL_SHMEM_HUGEPAGE_MIN (64 * 1024)
+#endif
+
 // A generic sharememory region to be used by any functions (queues or feedbacks
 // too.)
 
 typedef struct afl_shmem {
 
-  /* Serialized map id */
+  /* Serialized map id: the SysV shm id, the shm_open path (USEMMAP), or
+   * "pid:fd" of the creating process (USEMEMFD) */
   char shm_str[AFL_SHMEM_STRLEN_MAX];
-#ifdef USEMMAP
+#if defined(USEMMAP) || defined(USEMEMFD)
   int g_shm_fd;
+  /* The length actually mapped, at least map_size (whole huge pages for
+   * hugetlb). Only needed to munmap. */
+  size_t mapped_size;
 #else
   int shm_id;
 #endif
@@ -27,6 +43,11 @@ typedef struct afl_shmem {
 // opening inputs and stuff.
 u8 * afl_shmem_init(afl_shmem_t *sharedmem, size_t map_size);
 u8 * afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size);
+// Same as afl_shmem_by_str, but the map is mapped read-only.
+u8 *afl_shmem_by_str_readonly(afl_shmem_t *shm, char *shm_str,
+                              size_t map_size);
+// Unmaps a map from this process only, others can still use it.
+void afl_shmem_unmap(afl_shmem_t *sharedmem);
 void afl_shmem_deinit(afl_shmem_t *sharedmem);
 
 #endif                                                       /* AFL_SHMEM_H */
@@ -0,0 +1,122 @@
+/*
+   american fuzzy lop++ - fuzzer header
+   ------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This is the Library based on AFL++ which can be used to build
+   customized fuzzers for a specific target while taking advantage of
+   a lot of features that AFL++ already provides.
+
+ */
+
+#ifndef LIBCORPUS_H
+#define LIBCORPUS_H
+
+#include <stdbool.h>
+
+#include "input.h"
+#include "afl-returns.h"
+
+/*
+A corpus store keeps all testcases in one append-only file, mapped once:
+
+  [header][index: offset and len of each testcase][testcase bytes...]
+
+Inputs point right into the map (zero copy, see afl_corpus_input), so all
+processes mapping the same store share its pages in the page cache, and
+loading it again after a restart is one mmap instead of an open and read per
+testcase. The index and data regions are reserved up front, the file is sparse
+and only grows as testcases get appended, so the map never moves.
+
+One process appends to a store, any others open it read-only; they see new
+testcases as soon as the header's count covers them. Opening a store writable
+while another process has it open writable fails with AFL_RET_IN_USE.
+*/
+
+#define AFL_CORPUS_MAGIC (0xC0AF5700)
+#define AFL_CORPUS_VERSION (1)
+
+/* How many testcases a new store can hold */
+#define AFL_CORPUS_DEFAULT_MAX_ENTRIES (1 << 22)
+/* How many bytes of testcases a new store can hold (address space only) */
+#define AFL_CORPUS_DEFAULT_MAX_DATA (64ULL << 30)
+/* The file grows in steps of this many bytes */
+#define AFL_CORPUS_GROW_SIZE (16 << 20)
+
+/* Where a testcase is in the data region */
+typedef struct afl_corpus_slice {
+
+  u64 offset;
+  u64 len;
+
+} afl_corpus_slice_t;
+
+/* The first page of a store. The geometry is fixed on creation. */
+typedef struct afl_corpus_header {
+
+  u32 magic;
+  u32 version;
+  u64 max_entries;
+  u64 index_offset;
+  u64 data_offset;
+  u64 max_data;
+
+  /* Bytes used in the data region, and testcases in the index. count is
+   * stored after the testcase got written. */
+  volatile u64 data_used;
+  volatile u64 count;
+
+} afl_corpus_header_t;
+
+typedef struct afl_corpus {
+
+  int    fd;
+  bool   writable;
+  u8 *   map;
+  size_t map_size;
+  size_t file_size;
+
+  afl_corpus_header_t *header;
+  afl_corpus_slice_t * index;
+  u8 *                 data;
+
+} afl_corpus_t;
+
+/* Maps the store at path, creating it if writable and not there yet. Writable
+ * stores are locked until closed, see AFL_RET_IN_USE. */
+afl_ret_t afl_corpus_open(afl_corpus_t *corpus, char *path, bool writable);
+/* Unmaps the store. Inputs pointing into it must be gone by now. */
+void afl_corpus_close(afl_corpus_t *corpus);
+
+/* Appends a testcase, its index gets stored to id (if not NULL) */
+afl_ret_t afl_corpus_append(afl_corpus_t *corpus, u8 *bytes, size_t len,
+                            size_t *id);
+
+/* Points input at testcase id, without copying it. The input can't write to
+ * its bytes, they get copied on change (e.g. by the stages) as usual. */
+afl_ret_t afl_corpus_input(afl_corpus_t *corpus, size_t id,
+                           raw_input_t *input);
+
+/* How many testcases the store holds, including those appended by others */
+static inline size_t afl_corpus_count(afl_corpus_t *corpus) {
+
+  return __atomic_load_n(&corpus->header->count, __ATOMIC_ACQUIRE);
+
+}
+
+#endif                                                         /* LIBCORPUS_H */
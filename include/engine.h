@@ -39,6 +39,11 @@
 #include "llmp.h"
 
 #define MAX_FEEDBACKS 10
+/* How many broadcast messages the loop handles after each fuzz_one, by default
+ * (0 means: drain everything that's pending) */
+#define DEFAULT_MSG_BUDGET 1024
+/* How many messages the loop fetches from llmp at once */
+#define MSG_BATCH_SIZE 64
 
 struct engine_functions {
 
@@ -55,6 +60,7 @@ struct engine_functions {
   void (*handle_new_message)(engine_t *, llmp_message_t *);
   afl_ret_t (*load_testcases_from_dir)(
       engine_t *, char *, raw_input_t *(*custom_input_init)(u8 *buf));
+  afl_ret_t (*load_testcases_from_corpus)(engine_t *, afl_corpus_t *);
   void (*load_zero_testcase)(size_t);
 
   afl_ret_t (*loop)(engine_t *);
@@ -80,6 +86,8 @@ struct engine {
   u8 *                    buf;  // Reusable buf for realloc
   struct engine_functions funcs;
   llmp_client_state_t *   llmp_client;  // Our IPC for fuzzer communication
+  size_t msg_budget;    // Max messages handled per loop iteration, 0 for all
+  u64    last_exec_us;  // How long the last execute took
 
 };
 
@@ -97,6 +105,8 @@ void afl_set_global_queue_default(engine_t *      engine,
 u8        afl_execute_default(engine_t *, raw_input_t *);
 afl_ret_t afl_load_testcases_from_dir_default(
     engine_t *, char *, raw_input_t *(*custom_input_init)());
+/* Like load_testcases_from_dir, but all inputs point right into the store */
+afl_ret_t afl_load_testcases_from_corpus_default(engine_t *, afl_corpus_t *);
 void afl_load_zero_testcase_default(size_t);
 void afl_handle_new_message_default(engine_t *, llmp_message_t *);
 
@@ -27,6 +27,8 @@
 #ifndef LIBINPUT_H
 #define LIBINPUT_H
 
+#include <stdbool.h>
+
 #include "common.h"
 #include "afl-returns.h"
 
@@ -52,6 +54,8 @@ struct raw_input {
   u8 *   bytes;  // Raw input bytes
   size_t len;  // Length of the input field. C++ had strings, we have to make do
                // with storing the lengths :/
+  bool mapped;  // bytes point into a corpus store, they are not ours to free
+                // or write to
 
   struct raw_input_functions funcs;
 
@@ -59,6 +63,8 @@ struct raw_input {
 
 afl_ret_t afl_input_init(raw_input_t *input);
 void      afl_input_deinit(raw_input_t *input);
+/* Lets go of the bytes, freeing them unless they are mapped */
+void afl_input_release_bytes(raw_input_t *input);
 
 // Default implementations of the functions for raw input vtable
 
@@ -40,9 +40,60 @@ current map.
  \|/                \|/                \|/
 [client0]        [client1]    ...    [clientN]
 
-In the future, if we need zero copy, the current_broadcast_map could instead
-list the client_out_map ID an offset for each message. In that case, the clients
-also need to create new shmaps once their bufs are filled up.
+If zero copy is enabled (llmp_broker_set_zero_copy), the broker does not copy
+the message contents. Instead, current_broadcast_map lists the client_out_map id
+and the offset of each message. The clients then map the client_out_map
+read-only and read the message from there. As clients create new shmaps once
+their pages are filled up, a message never moves. The broker keeps old
+client_out_maps mapped for as long as broadcast messages reference them.
+
+Each client publishes the generation of the broadcast page it currently reads
+(its watermark) in the header of its client_out_map. Once all clients read
+past a broadcast page, the broker frees it. The first broadcast page stays
+around for new clients: its EOP gets pointed to the oldest page still alive.
+Clients that never read broadcasts should call llmp_client_ignore_broadcasts,
+or they pin all pages.
+
+The broker broadcasts on LLMP_LANE_COUNT lanes, each one a chain of pages as
+above. Tags get routed to lanes (llmp_broker_route_tag), by default everything
+goes to LLMP_LANE_DEFAULT. Clients subscribe to the lanes they care about
+(llmp_client_subscribe), and only map and scan those, so traffic of other lanes
+costs them nothing. Watermarks are kept per lane.
+
+Small, urgent msgs (stop, config, ...) should not wait behind megabytes of
+testcases. Clients send them on a second chain of out pages
+(llmp_client_alloc_next_priority), which the broker empties for all clients
+before it forwards any other msg, to LLMP_LANE_PRIORITY. llmp_client_recv drains
+that lane before all others.
+
+Msgs larger than LLMP_OOB_THRESHOLD don't go to the pages at all, so one huge
+testcase doesn't grow all later pages. llmp_client_alloc_next puts them in a
+shared segment of their own, out of band, and sends a small descriptor instead.
+Segments are refcounted: the descriptor holds one ref (the broker takes it over
+until the broadcast page with the descriptor is gone), each client reading the
+msg holds one until its next recv. The sender frees it once nobody does.
+
+The broker publishes how many bytes of a client's msgs it consumed in the
+client's out page. A client whose out page is full while the broker lags behind
+by more than its flow limit follows its llmp_flow_policy_t: it opens a new page
+anyway, waits for the broker, or drops the msg. Priority msgs are exempt.
+
+Brokers on different nodes can be connected by bridges
+(llmp_broker_register_bridge). A bridge is a threaded client that forwards
+broadcasts with selected tags to the bridge of the other broker over tcp, which
+sends them to its own broker. Bridged msgs keep the node id of the broker they
+originate from in their sender, so they never get sent back to it.
+
+Local client processes can connect over a unix socket instead of tcp
+(llmp_broker_register_unix_server, llmp_client_new_unix). With USEMEMFD, the
+handshake passes the fds of the first pages along (SCM_RIGHTS): the first
+broadcast page, and the first out page of the client, which the broker can map
+even if the client already died. That's all the socket is used for. All later
+maps (new pages after EOP, zero copy and out of band maps, priority maps) are
+still mapped by their "pid:fd" str, through /proc of the process that made
+them, like with tcp clients. So both ends need access to the other's
+/proc/<pid>/fd (in practice: run as the same user), and a page can't be mapped
+once the process that made it is gone.
 
 
 To use, you will have to create a broker using llmp_broker_new().
@@ -54,6 +105,7 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 #include <stdbool.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #include "afl-returns.h"
 #include "afl-shmem.h"  // for sharedmem
@@ -62,6 +114,106 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 /* We'll start of with a megabyte of maps for now(?) */
 #define LLMP_INITIAL_MAP_SIZE (1 << 20)
 
+/* How long the broker keeps spinning for new messages before it sleeps on its
+ * doorbell */
+#define LLMP_BROKER_SPIN_US (50)
+/* How long a client spins in llmp_client_recv_blocking before it sleeps */
+#define LLMP_CLIENT_SPIN_US (50)
+/* Upper bound for a sleep on a doorbell, in case a wakeup got lost */
+#define LLMP_DOORBELL_MAX_SLEEP_MS (100)
+
+/* Watermark of a client that doesn't read broadcasts (and pins no page) */
+#define LLMP_WATERMARK_NO_RECV (0xFFFFFFFF)
+
+/* Clients more broadcast pages behind than this don't keep the broker from
+ * freeing pages by default, see llmp_broker_set_gc_max_lag */
+#define LLMP_GC_DEFAULT_MAX_LAG (256)
+
+/* How many pages each page pool keeps around for reuse */
+#define LLMP_PAGE_POOL_SIZE (4)
+
+/* Version of the page and message layout. Peers refuse pages of another
+ * layout, so bump this on every change to llmp_page_t or llmp_message_t. */
+#define LLMP_LAYOUT_VERSION (10)
+/* Pages store the version together with this magic, so pages of the old
+ * (unversioned) layout don't pass as ours by chance */
+#define LLMP_LAYOUT_MAGIC (0x4C4D0000)
+/* Header fields written by different parties live on their own cache line */
+#define LLMP_CACHE_LINE_SIZE (64)
+/* Messages (and thereby their payloads) start at multiples of this */
+#define LLMP_MSG_ALIGNMENT (16)
+
+/* Msgs with a larger payload go out of band, to a shared segment of their
+ * own */
+#define LLMP_OOB_THRESHOLD (LLMP_INITIAL_MAP_SIZE / 4)
+
+/* How many bytes of a client's msgs the broker may lag behind by default,
+ * see llmp_client_set_flow_control */
+#define LLMP_FLOW_DEFAULT_LIMIT (4 * LLMP_INITIAL_MAP_SIZE)
+/* How long a client blocked by LLMP_FLOW_BLOCK sleeps between checks */
+#define LLMP_FLOW_BLOCK_SLEEP_US (100)
+
+/* Default size of the set of payload hashes of llmp_broker_enable_dedup */
+#define LLMP_DEDUP_DEFAULT_SLOTS (1 << 16)
+/* Slots tried per hash before the set forgets one of them */
+#define LLMP_DEDUP_PROBES (8)
+
+/* Threads running the async msg hooks, see llmp_broker_add_async_message_hook
+ */
+#define LLMP_HOOK_WORKERS (2)
+/* Jobs queued per worker before the broker waits. Power of 2. */
+#define LLMP_HOOK_RING_SIZE (256)
+/* Max number of async msg hooks */
+#define LLMP_ASYNC_HOOKS_MAX (8)
+
+/* Default file size of llmp_broker_enable_journal */
+#define LLMP_JOURNAL_DEFAULT_SIZE (64 * 1024 * 1024)
+/* How often the broker syncs the journal to disk */
+#define LLMP_JOURNAL_SYNC_US (1000 * 1000)
+
+/* How many clients the stats page has room for. Later clients go uncounted. */
+#define LLMP_STATS_MAX_CLIENTS (256)
+/* How often the broker refreshes the receive side of the stats page */
+#define LLMP_STATS_INTERVAL_US (100 * 1000)
+
+/* How many broadcast lanes the broker has. Each lane is a chain of broadcast
+ * pages of its own, clients only read the lanes they subscribed to. */
+#define LLMP_LANE_COUNT (4)
+/* The lane of all tags not routed elsewhere, see llmp_broker_route_tag */
+#define LLMP_LANE_DEFAULT (0)
+/* The lane of priority msgs, drained first by llmp_client_recv. Tags routed
+ * here (llmp_broker_route_tag) skip the queue on the receiving end, too. */
+#define LLMP_LANE_PRIORITY (LLMP_LANE_COUNT - 1)
+/* Lane masks, for llmp_client_subscribe */
+#define LLMP_LANE_MASK(lane) (1U << (lane))
+#define LLMP_LANE_MASK_ALL ((1U << LLMP_LANE_COUNT) - 1)
+
+/* Bridged msgs (see llmp_broker_register_bridge) carry this flag in their
+ * sender, together with the hops they took and the node id they came from */
+#define LLMP_SENDER_BRIDGED (0x80000000)
+#define LLMP_SENDER_HOPS(sender) (((sender) >> 24) & 0x7F)
+#define LLMP_SENDER_ORIGIN(sender) ((sender)&LLMP_NODE_ID_MASK)
+/* Node ids of brokers are 24 bit wide */
+#define LLMP_NODE_ID_MASK (0xFFFFFF)
+
+/* Bridges don't forward msgs that crossed this many bridges, so msgs die out
+ * if bridges form a cycle */
+#define LLMP_BRIDGE_MAX_HOPS (8)
+/* How many msgs a bridge packs into one tcp frame, at most */
+#define LLMP_BRIDGE_BATCH (64)
+/* Bridges don't forward larger msgs, and hang up on peers that do. Testcases
+ * are capped at 1 MB (MAX_FILE) anyway. */
+#define LLMP_BRIDGE_MAX_MSG_LEN (1 << 20)
+/* The largest tcp frame a bridge sends or accepts, so a peer can't make us
+ * buffer more than this. Batches that don't fit get split. */
+#define LLMP_BRIDGE_MAX_FRAME_LEN (4 << 20)
+/* How long a bridge waits for tcp data, if no broadcast came in either */
+#define LLMP_BRIDGE_POLL_MS (1)
+/* How long a bridge waits before it tries to reconnect */
+#define LLMP_BRIDGE_RECONNECT_MS (100)
+/* How long the unix server waits for a connect, before it checks for stop */
+#define LLMP_UNIX_POLL_MS (100)
+
 /* llmp tags */
 #define LLMP_TAG_NEW_QUEUE_ENTRY (0xA1B2C3D)
 
@@ -81,10 +233,11 @@ typedef struct llmp_message {
 
   /* the length of the payload */
   size_t buf_len;
-  /* the actual content (syntax needs c99) */
-  u8 buf[];
+  /* the actual content (syntax needs c99), aligned for aligned loads. The next
+   * message starts after buf_len, rounded up to LLMP_MSG_ALIGNMENT. */
+  u8 buf[] __attribute__((aligned(LLMP_MSG_ALIGNMENT)));
 
-} __attribute__((packed)) llmp_message_t;
+} llmp_message_t;
 
 /* A sharedmap page, used for unidirectional data flow.
    After a new message is added, current_msg_id should be set to the messages'
@@ -98,44 +251,257 @@ typedef struct llmp_message {
 
 typedef struct llmp_broker_state llmp_broker_state_t;
 
+/* Where to find the first page of a chain: a broadcast lane, or the priority
+ * out maps of a client */
+typedef struct llmp_lane_info {
+
+  size_t map_size;
+  char   shm_str[AFL_SHMEM_STRLEN_MAX];
+
+} llmp_lane_info_t;
+
+/* A (futex based) doorbell in shared memory.
+Waiters register in waiters, so ringing stays free of syscalls as long as
+nobody sleeps. */
+typedef struct llmp_doorbell {
+
+  /* Incremented on each ring, the futex word */
+  volatile u32 seq;
+  /* Number of sleepers */
+  volatile u32 waiters;
+
+} llmp_doorbell_t;
+
 typedef struct llmp_page {
 
+  /* Set up once by the sender, read-only after that. */
+
+  /* LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION of the sender */
+  u32 layout_version;
   /* who sends messages to this page */
   u32 sender;
-  /* The only variable that may be written to by the _receiver_:
-  On first message receive, save_to_unmap is set to 1. This means that
-  the sender can unmap this page after EOP, on exit, ...
-  Using u32 for a bool as it feels more aligned. */
-  volatile u32 save_to_unmap;
-  /* The id of the last finished message */
-  volatile size_t current_msg_id;
+  /* Counts up for each new page of this sender. Used to detect stale
+   * references to a page. */
+  u32 generation;
   /* Total size of the page */
   size_t size_total;
+
+  /* Written by the sender on each send, polled by all receivers. */
+
+  /* The id of the last finished message */
+  volatile size_t current_msg_id
+      __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  /* Rung by llmp_send, receivers in llmp_client_recv_blocking sleep on it. */
+  llmp_doorbell_t new_msg_doorbell;
+
+  /* Written by the sender on each alloc, never read by receivers. */
+
   /* How much of the page we already used */
-  size_t size_used;
+  size_t size_used __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
   /* The largest allocated element so far */
   size_t max_alloc_size;
+
+  /* The only variable that may be written to by the _receiver_:
+  On first message receive, save_to_unmap is set to 1. This means that
+  the sender can unmap this page after EOP, on exit, ...
+  Using u32 for a bool as it feels more aligned. */
+  volatile u32 save_to_unmap __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  /* Only used on client pages: payload bytes (incl. msg headers) of all msgs
+   * the broker read from this client so far. Written to the page it reads. */
+  volatile u64 bytes_consumed;
+
+  /* Rarely written, read by the other side on EOP and gc only. */
+
+  /* Only used on client pages: generation of the broadcast page the client
+   * reads, per lane, or LLMP_WATERMARK_NO_RECV. Carried over to each new
+   * page. */
+  volatile u32 watermarks[LLMP_LANE_COUNT]
+      __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  /* The process that set up the page. On client pages, the broker leaves
+   * watermarks of clients that are gone out of gc. */
+  pid_t pid;
+  /* Only used on the first broadcast page: odd while the broker points its
+   * EOP to a different page. */
+  volatile u32 link_seq;
+  /* Only used on client pages: the first page of the client's priority out
+   * chain, map_size 0 until it has one. Carried over to each new page. */
+  llmp_lane_info_t priority_map;
+
+  /* The broker sleeps on the broker_doorbell of its first broadcast page,
+   * clients ring it on send. */
+  llmp_doorbell_t broker_doorbell
+      __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  /* Only used on the first page of lane 0: the broker rings it on each
+   * broadcast, clients reading more than one lane sleep on it. */
+  llmp_doorbell_t lanes_doorbell;
+
+  /* Only used on client pages: written by the client on each recv, read by
+   * the broker for its stats. Carried over to each new page. */
+
+  /* Broadcast msgs (and their payload bytes) the client received */
+  volatile u64 msgs_recvd __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  volatile u64 bytes_recvd;
+  /* Generation of the broadcast page and id of the last msg received, per
+   * lane */
+  volatile u32 recv_generations[LLMP_LANE_COUNT];
+  volatile u32 recv_msg_ids[LLMP_LANE_COUNT];
+  /* How often the client ran into backpressure, per llmp_flow_policy_t */
+  volatile u32 flow_grows;
+  volatile u32 flow_stalls;
+  volatile u32 flow_drops;
+
+  /* Only used on the first page of lane 0, set up once by the broker: the
+   * first page of each lane */
+  llmp_lane_info_t lanes[LLMP_LANE_COUNT]
+      __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+
   /* The messages start here. They can be of variable size, so don't address
    * them by array. */
-  llmp_message_t messages[];
+  llmp_message_t messages[] __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+
+} llmp_page_t;
+
+/* Pages kept around after EOP, so that the next EOP needs no new shared map.
+The sender of a page keeps it to write to it again, once all receivers are done
+with it. Receivers keep it mapped, in case the sender reuses it. */
+typedef struct llmp_page_pool {
+
+  size_t      count;
+  afl_shmem_t maps[LLMP_PAGE_POOL_SIZE];
+
+} llmp_page_pool_t;
+
+/* Counters of one client in the stats page. Only the broker writes them. */
+typedef struct llmp_client_stats {
+
+  /* Msgs (and their payload bytes) the broker read from the client */
+  u64 msgs_sent;
+  u64 bytes_sent;
+  /* Broadcast msgs (and payload bytes) the client read, and how many msgs it
+   * still has to read. Refreshed every LLMP_STATS_INTERVAL_US. */
+  u64 msgs_recvd;
+  u64 bytes_recvd;
+  u64 lag;
+  /* How many out pages the client filled up */
+  u64 eops;
+  /* Msgs of the client a broker hook did not forward */
+  u64 hook_drops;
+  /* How often the client ran into backpressure, per llmp_flow_policy_t.
+   * Refreshed every LLMP_STATS_INTERVAL_US. */
+  u64 flow_grows;
+  u64 flow_stalls;
+  u64 flow_drops;
+
+} __attribute__((aligned(LLMP_CACHE_LINE_SIZE))) llmp_client_stats_t;
+
+/* The broker's stats, in shared memory for other processes to map read-only
+ * (see llmp_stats_map). The broker updates it with relaxed atomics, so each
+ * counter on its own is consistent, but not all of them together. */
+typedef struct llmp_stats_page {
+
+  /* LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION */
+  u32 layout_version;
+  /* Clients registered so far, counted or not */
+  u32 client_count;
+  /* Msgs (and payload bytes) the broker broadcast */
+  u64 msgs_broadcast;
+  u64 bytes_broadcast;
+  /* Broadcast pages the broker filled up */
+  u64 eops;
+  /* Monotonic time of the last refresh of the receive side, in us */
+  u64 refreshed_us;
+  /* Queue entries the dedup hook saw, and the duplicates it dropped (see
+   * llmp_broker_enable_dedup) */
+  u64 dedup_msgs;
+  u64 dedup_drops;
+  /* Async hook verdicts the broker stopped waiting for */
+  u64 hook_timeouts;
+  /* Clients the last gc left out: their process was gone, or they were more
+   * than the max lag behind (see llmp_broker_set_gc_max_lag) */
+  u32 gc_dead_clients;
+  u32 gc_lagging_clients;
+
+  llmp_client_stats_t clients[LLMP_STATS_MAX_CLIENTS];
+
+} llmp_stats_page_t;
+
+/* Where a client reads in a broadcast lane */
+typedef struct llmp_client_lane {
+
+  /* the broadcast map we read from, unmapped (NULL map) until the first recv
+   */
+  afl_shmem_t current_broadcast_map;
+  /* the last message we received on this lane */
+  llmp_message_t *last_msg_recvd;
+  /* The generation current_broadcast_map had when we mapped it. If it
+   * changed, the broker reused the page while we lagged behind. */
+  u32 generation;
+
+} llmp_client_lane_t;
+
+/* What a client does when its out page is full while the broker lags behind
+ * by more than its flow limit */
+typedef enum llmp_flow_policy {
+
+  /* Open a new page anyway, the out pages grow without bound */
+  LLMP_FLOW_GROW,
+  /* Wait for the broker to catch up. Don't use from the broker's thread. */
+  LLMP_FLOW_BLOCK,
+  /* Drop the msg, llmp_client_alloc_next returns NULL */
+  LLMP_FLOW_DROP,
 
-} __attribute__((__packed__)) llmp_page_t;
+} llmp_flow_policy_t;
 
 /* For the client: state (also used as metadata by broker) */
 typedef struct llmp_client_state {
 
   /* unique ID of this client */
   u32 id;
-  /* the last message we received */
-  llmp_message_t *last_msg_recvd;
-  /* the current broadcast map to read from */
-  afl_shmem_t *current_broadcast_map;
+  /* The broadcast lanes we read from (LLMP_LANE_MASK) */
+  u32 lane_mask;
+  /* Where recv looks first, so that no lane starves the others */
+  u32 next_lane;
+  /* Where we are in each lane */
+  llmp_client_lane_t lanes[LLMP_LANE_COUNT];
   /* the last msg we sent */
   llmp_message_t *last_msg_sent;
   /* Number of maps we're using */
   size_t out_map_count;
   /* The maps to write to */
   afl_shmem_t *out_maps;
+  /* The same for priority msgs, no maps until the first one */
+  llmp_message_t *last_priority_msg_sent;
+  size_t          priority_map_count;
+  afl_shmem_t *   priority_maps;
+  /* Out of band segments we created, freed once nobody holds them */
+  size_t       oob_segment_count;
+  afl_shmem_t *oob_segments;
+  /* The msg in the newest segment, and its descriptor, until sent */
+  llmp_message_t *oob_msg;
+  llmp_message_t *oob_descriptor;
+  /* Segments of the out of band msgs we returned, released on the next recv */
+  size_t       oob_map_count;
+  afl_shmem_t *oob_maps;
+  /* Flow control of the out maps, see llmp_client_set_flow_control */
+  llmp_flow_policy_t flow_policy;
+  size_t             flow_limit;
+  /* Bytes (incl. msg headers) of all msgs we sent on the out maps */
+  u64 bytes_sent;
+  /* Number of client_out_maps mapped to read zero copy messages */
+  size_t ref_map_count;
+  /* client_out_maps of other clients, mapped read-only (zero copy) */
+  afl_shmem_t *ref_maps;
+  /* The first broadcast map of lane 0, holding the doorbells and the first
+   * page of each lane */
+  afl_shmem_t *broker_doorbell_map;
+  /* Number of maps we're done with, but that may still hold returned msgs */
+  size_t retired_map_count;
+  /* Broadcast (and ref) maps left behind on EOP. Pooled on the next recv. */
+  afl_shmem_t *retired_maps;
+  /* Our out maps the broker is done with, to reuse on EOP */
+  llmp_page_pool_t out_pool;
+  /* Broadcast (and ref) maps we no longer read, still mapped */
+  llmp_page_pool_t broadcast_pool;
 
 } llmp_client_state_t;
 
@@ -151,6 +517,61 @@ client instead. */
 typedef bool (*llmp_message_hook_func)(llmp_broker_state_t *broker,
                                        llmp_message_t *msg, void *data);
 
+/* A bridge to the broker on another node, see llmp_broker_register_bridge.
+Runs as threaded client of the local broker. */
+typedef struct llmp_bridge {
+
+  /* Our client at the local broker */
+  llmp_client_state_t *client;
+  /* Node ids of the local broker and the one on the other end */
+  u32 node_id;
+  u32 remote_node_id;
+  /* Only msgs with one of these tags cross the bridge */
+  size_t tag_count;
+  u32 *  tags;
+
+  /* The host to connect to, or NULL if we accept the connection */
+  char *host;
+  /* The port to connect to, or the one we listen on */
+  int port;
+  int listen_fd;
+  /* The connection to the other bridge, or -1 */
+  int fd;
+
+  /* Outgoing frame, written up to out_pos */
+  u8 *   out_buf;
+  size_t out_len;
+  size_t out_pos;
+  /* Incoming data, in_len bytes, may hold partial frames */
+  u8 *   in_buf;
+  size_t in_len;
+
+  /* Msgs that crossed the bridge, per direction */
+  volatile u64 msgs_out;
+  volatile u64 msgs_in;
+  /* Set by llmp_bridge_stop */
+  volatile bool stop;
+
+} llmp_bridge_t;
+
+/* Lets local client processes connect over a unix socket, see
+llmp_broker_register_unix_server. Runs as threaded client of the broker. */
+typedef struct llmp_unix_server {
+
+  /* The socket path, unlinked again on free */
+  char *path;
+  int   listen_fd;
+  /* Our dup of the broker's first broadcast page fd, or -1 if the shmem
+   * backend has no fds to pass */
+  int page_fd;
+
+  /* Handshakes done so far */
+  volatile u64 clients_added;
+  /* Set by llmp_unix_server_stop */
+  volatile bool stop;
+
+} llmp_unix_server_t;
+
 /* For the broker, internal: to keep track of the client */
 typedef struct llmp_broker_client_metadata {
 
@@ -165,6 +586,21 @@ typedef struct llmp_broker_client_metadata {
   /* The last message we/the broker received for this client. */
   llmp_message_t *last_msg_broker_read;
 
+  /* The lanes (LLMP_LANE_MASK) with broadcast messages that reference
+  cur_client_map (zero copy). The broker needs to keep it mapped after EOP */
+  u32 cur_client_map_lanes;
+
+  /* What we read from the client's out maps so far, see bytes_consumed */
+  u64 bytes_consumed;
+
+  /* The priority out map we're reading from, NULL map until the client
+  announces one in its cur_client_map. Priority msgs are always copied. */
+  afl_shmem_t     cur_priority_map;
+  llmp_message_t *last_priority_msg_read;
+
+  /* Old maps of this client, still mapped, in case the client reuses them */
+  llmp_page_pool_t map_pool;
+
   /* pthread associated to this client, if we have a threaded client */
   pthread_t *pthread;
   /* the client loop function */
@@ -182,20 +618,175 @@ typedef struct llmp_message_hook_data {
 
 } llmp_message_hook_data_t;
 
-/* state of the main broker. Mostly internal stuff. */
-struct llmp_broker_state {
+/* An async msg hook, see llmp_broker_add_async_message_hook */
+typedef struct llmp_async_hook {
+
+  llmp_message_hook_func *func;
+  void *                  data;
+  /* How long the broker waits for the verdict, 0 to not wait at all */
+  u32 verdict_us;
+
+} llmp_async_hook_t;
+
+/* A msg for an async hook to look at */
+typedef struct llmp_hook_job {
+
+  llmp_message_hook_func *func;
+  void *                  data;
+  llmp_message_t *        msg;
+  /* Set by the worker once the hook returned */
+  volatile u32 verdict;
+
+} llmp_hook_job_t;
+
+/* A thread running async hooks. The broker is the only producer of its ring
+ * of jobs, the worker the only consumer. */
+typedef struct llmp_hook_worker {
+
+  llmp_broker_state_t *broker;
+  pthread_t            thread;
+  volatile bool        stop;
+
+  llmp_hook_job_t jobs[LLMP_HOOK_RING_SIZE];
+  /* Written by the broker only: the next job to queue */
+  volatile u64 head __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  /* Written by the worker only: the next job to run. Jobs before it are done,
+   * the broker may not touch their msgs anymore. */
+  volatile u64    tail __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+  llmp_doorbell_t doorbell;
+
+} llmp_hook_worker_t;
+
+/* A client map the broker keeps, as broadcast messages still reference it */
+typedef struct llmp_retained_map {
+
+  afl_shmem_t map;
+  /* The lanes (LLMP_LANE_MASK) referencing this map */
+  u32 lanes;
+  /* Generation of the last broadcast page referencing this map, per lane */
+  u32 broadcast_generations[LLMP_LANE_COUNT];
+
+} llmp_retained_map_t;
+
+/* One chain of broadcast pages of the broker */
+typedef struct llmp_broker_lane {
 
   llmp_message_t *last_msg_sent;
 
   size_t       broadcast_map_count;
   afl_shmem_t *broadcast_maps;
 
+} llmp_broker_lane_t;
+
+/* A bounded set of payload hashes, see llmp_broker_enable_dedup */
+typedef struct llmp_dedup {
+
+  /* XXH3 hashes, 0 marks a free slot. slot_count is a power of 2. */
+  u64 *  slots;
+  size_t slot_count;
+
+} llmp_dedup_t;
+
+/* The start of a journal file. The llmp msgs follow in data, laid out just
+ * like on a page. */
+typedef struct llmp_journal_header {
+
+  /* LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION of the broker writing it */
+  u32 layout_version;
+  /* Bytes of msgs in data, stored after the msgs got written */
+  volatile u64 used;
+  u64          msg_count;
+  u8           data[] __attribute__((aligned(LLMP_MSG_ALIGNMENT)));
+
+} llmp_journal_header_t;
+
+/* An append-only file of the msgs the broker forwarded, see
+ * llmp_broker_enable_journal */
+typedef struct llmp_journal {
+
+  char *                 path;
+  int                    fd;
+  size_t                 size;
+  bool                   writable;
+  llmp_journal_header_t *header;
+  /* When the broker last synced it to disk */
+  u64 synced_us;
+
+} llmp_journal_t;
+
+/* Sends msgs with the tag to the lane, see llmp_broker_route_tag */
+typedef struct llmp_tag_route {
+
+  u32 tag;
+  u32 lane;
+
+} llmp_tag_route_t;
+
+/* How the broker waits for new messages */
+typedef enum llmp_broker_wakeup {
+
+  /* Spin for LLMP_BROKER_SPIN_US, then sleep until a client rings the
+     doorbell */
+  LLMP_WAKEUP_DOORBELL,
+  /* Check for new messages every 5 ms */
+  LLMP_WAKEUP_POLL,
+
+} llmp_broker_wakeup_t;
+
+/* state of the main broker. Mostly internal stuff. */
+struct llmp_broker_state {
+
+  /* The first page of lane 0 also holds the doorbells and the first page of
+   * all other lanes */
+  llmp_broker_lane_t lanes[LLMP_LANE_COUNT];
+
+  /* Tags not found here go to LLMP_LANE_DEFAULT */
+  size_t            tag_route_count;
+  llmp_tag_route_t *tag_routes;
+
+  /* How to wait for new messages in llmp_broker_loop */
+  llmp_broker_wakeup_t wakeup;
+
+  /* Freed broadcast maps, to reuse on EOP */
+  llmp_page_pool_t broadcast_pool;
+
+  /* Broadcast references to client messages instead of copies */
+  bool                 zero_copy;
+  size_t               retained_map_count;
+  llmp_retained_map_t *retained_maps;
+
+  /* Out of band segments of broadcast msgs, released once the broadcast page
+   * with their descriptor is gone */
+  size_t               oob_segment_count;
+  llmp_retained_map_t *oob_segments;
+
   size_t                    msg_hook_count;
   llmp_message_hook_data_t *msg_hooks;
 
+  /* The set of the dedup hook, NULL unless enabled */
+  llmp_dedup_t *dedup;
+
+  /* Where forwarded msgs get written to, NULL unless enabled */
+  llmp_journal_t *journal;
+
+  /* Async hooks, and the workers running them (started with the first) */
+  size_t              async_hook_count;
+  llmp_async_hook_t   async_hooks[LLMP_ASYNC_HOOKS_MAX];
+  llmp_hook_worker_t *hook_workers;
+  u32                 next_hook_worker;
+
   size_t                         llmp_client_count;
   llmp_broker_client_metadata_t *llmp_clients;
 
+  /* The llmp_stats_page_t, see llmp_broker_stats_shm_str */
+  afl_shmem_t stats_map;
+
+  /* Identifies this broker to bridges, see llmp_broker_set_node_id */
+  u32 node_id;
+
+  /* See llmp_broker_set_gc_max_lag */
+  u32 gc_max_lag;
+
 };
 
 /* Get a message buf as type if size matches, else NULL */
@@ -224,6 +815,10 @@ bool llmp_msg_in_page(llmp_page_t *page, llmp_message_t *msg);
 /* Creates a new client process that will connect to the given port */
 llmp_client_state_t *llmp_client_new(int port);
 
+/* Creates a new client process that will connect to the unix socket at path,
+ * see llmp_broker_register_unix_server. Only the handshake passes fds. */
+llmp_client_state_t *llmp_client_new_unix(char *path);
+
 /* Creates a new, unconnected, client state */
 llmp_client_state_t *llmp_client_new_unconnected();
 
@@ -238,10 +833,48 @@ llmp_message_t *llmp_client_recv(llmp_client_state_t *client);
   then returns that message. */
 llmp_message_t *llmp_client_recv_blocking(llmp_client_state_t *client);
 
-/* Alloc the next message, internally resetting the ringbuf if full */
+/* Only read broadcasts of the lanes in lane_mask (LLMP_LANE_MASK) from now on,
+so the broker doesn't keep pages of other lanes around for us. Lanes get mapped
+on the first recv, so subscribe right after connecting to never map others.
+Clients read all lanes by default. Msgs of different lanes may arrive out of
+order. */
+void llmp_client_subscribe(llmp_client_state_t *client, u32 lane_mask);
+
+/* Tells the broker this client won't read any (more) broadcasts, so old
+broadcast pages don't have to be kept for it. The pages we were at get
+unmapped. Calling llmp_client_recv* afterwards starts over at the first page of
+each lane, followed by the oldest page still around: msgs in between are lost,
+msgs of the first page are read again. */
+void llmp_client_ignore_broadcasts(llmp_client_state_t *client);
+
+/* A client receives up to max broadcast messages at once, following EOPs to
+new pages on the way. Returns the number of messages written to msgs.
+All returned messages stay valid until the next llmp_client_recv* call. */
+size_t llmp_client_recv_batch(llmp_client_state_t *client,
+                              llmp_message_t **msgs, size_t max);
+
+/* Alloc the next message, internally resetting the ringbuf if full.
+Msgs larger than LLMP_OOB_THRESHOLD get a shared segment of their own. */
 llmp_message_t *llmp_client_alloc_next(llmp_client_state_t *client,
                                        size_t               size);
 
+/* Sets what the client does when its out page is full while the broker didn't
+read more than limit bytes of its msgs yet (default: LLMP_FLOW_GROW,
+LLMP_FLOW_DEFAULT_LIMIT). This is checked whenever the out page fills up, so
+the broker may lag behind by up to a page more. */
+void llmp_client_set_flow_control(llmp_client_state_t *client,
+                                  llmp_flow_policy_t policy, size_t limit);
+
+/* How many more bytes the client may send before the broker lags behind by its
+ * flow limit, 0 if it already does */
+size_t llmp_client_flow_credit(llmp_client_state_t *client);
+
+/* Alloc the next message for a small and urgent msg, on the priority out maps.
+The broker forwards these before any other msgs, to LLMP_LANE_PRIORITY.
+Send it with llmp_client_send, as usual. */
+llmp_message_t *llmp_client_alloc_next_priority(llmp_client_state_t *client,
+                                                size_t               size);
+
 /* Commits a msg to the client's out ringbuf */
 bool llmp_client_send(llmp_client_state_t *client_state, llmp_message_t *msg);
 
@@ -253,6 +886,37 @@ void llmp_clientloop_tcp(llmp_client_state_t *client_state, void *data);
  */
 llmp_broker_state_t *llmp_broker_new();
 
+/* Destroys the broker and the state of all its threaded clients.
+Make sure none of the threaded clients is still running. */
+void llmp_broker_destroy(llmp_broker_state_t *broker);
+
+/* In zero copy mode, the broker broadcasts references to the messages in the
+client pages instead of copying them over. Clients resolve these references in
+llmp_client_recv, mapping the other clients' pages read-only.
+Set this before any message has been sent. */
+void llmp_broker_set_zero_copy(llmp_broker_state_t *broker, bool zero_copy);
+
+/* The shared memory (in bytes) the broker currently keeps mapped: broadcast
+ * pages, client pages and retained client pages */
+size_t llmp_broker_shm_usage(llmp_broker_state_t *broker);
+
+/* The shm_str of the broker's stats page. Tools can map it with
+ * llmp_stats_map, for as long as the broker is alive. */
+char *llmp_broker_stats_shm_str(llmp_broker_state_t *broker);
+
+/* Refreshes the receive side (msgs_recvd, bytes_recvd, lag) of the stats
+ * page right away. The broker loop does this every LLMP_STATS_INTERVAL_US. */
+void llmp_broker_update_stats(llmp_broker_state_t *broker);
+
+/* Maps the stats page of a broker read-only, by its shm_str. Returns NULL if it
+ * can't be mapped or has a different layout. Unmap with afl_shmem_unmap. */
+llmp_stats_page_t *llmp_stats_map(afl_shmem_t *shm, char *shm_str);
+
+/* Sets how llmp_broker_loop waits for new messages (default:
+ * LLMP_WAKEUP_DOORBELL) */
+void llmp_broker_set_wakeup(llmp_broker_state_t *broker,
+                            llmp_broker_wakeup_t wakeup);
+
 /* Client thread will be called with llmp_client_state_t client, containing the
 data in ->data. This will register a client to be spawned up as soon as
 broker_loop() starts. Clients can also added later via
@@ -269,12 +933,105 @@ bool llmp_broker_launch_clientloops(llmp_broker_state_t *broker);
  tcp */
 bool llmp_broker_register_local_server(llmp_broker_state_t *broker, int port);
 
+/* Registers a threaded client that listens for new client processes on a unix
+socket at path (replacing whatever is there), to hand out the first broadcast
+page and register their first out page. Cheaper than tcp, and with USEMEMFD,
+these two pages get passed as fds. Later pages go through /proc, see above.
+Returns NULL on error. The broker frees the server on destroy. */
+llmp_unix_server_t *llmp_broker_register_unix_server(
+    llmp_broker_state_t *broker, char *path);
+
+/* The clientloop of the unix server */
+void llmp_clientloop_unix_server(llmp_client_state_t *client_state,
+                                 void *               data);
+
+/* Lets the unix server clientloop return soon */
+void llmp_unix_server_stop(llmp_unix_server_t *server);
+
+/* Broadcasts msgs with this tag on the given lane, instead of
+ * LLMP_LANE_DEFAULT. Route tags before any client sends them. */
+afl_ret_t llmp_broker_route_tag(llmp_broker_state_t *broker, u32 tag,
+                                u32 lane);
+
+/* Sets the node id of this broker, unique among all bridged brokers. Random
+ * by default. Set this before registering bridges. */
+void llmp_broker_set_node_id(llmp_broker_state_t *broker, u32 node_id);
+
+/* Clients more than max_lag broadcast pages behind on a lane no longer keep
+the broker from freeing (and reusing) pages there. When they catch up, they
+start over at the first page, having lost the msgs in between. 0 keeps pages
+around for all clients, however far behind. Clients whose process is gone
+never keep pages around. Default: LLMP_GC_DEFAULT_MAX_LAG. */
+void llmp_broker_set_gc_max_lag(llmp_broker_state_t *broker, u32 max_lag);
+
+/* Registers a bridge to the broker of another node, as threaded client.
+Each bridge forwards the local broadcasts with one of the given tags to the
+other end, in batches, and sends the msgs it gets from there to the local
+broker. Bridged msgs carry LLMP_SENDER_BRIDGED in their sender.
+With host set, the bridge connects to host:port, else it listens on port
+(0 picks a free one, see bridge->port) for the other end.
+Bridges reconnect if the connection drops. Meanwhile, they don't keep
+broadcast pages around: on reconnect, they forward the broadcasts of the first
+page, and those of the oldest pages still around (see
+llmp_client_ignore_broadcasts).
+Returns NULL on error. The broker frees the bridge on destroy. */
+llmp_bridge_t *llmp_broker_register_bridge(llmp_broker_state_t *broker,
+                                           char *host, int port, u32 *tags,
+                                           size_t tag_count);
+
+/* The clientloop of each bridge */
+void llmp_clientloop_bridge(llmp_client_state_t *client_state, void *data);
+
+/* Lets the bridge clientloop return soon */
+void llmp_bridge_stop(llmp_bridge_t *bridge);
+
 /* Adds a hook that gets called for each new message the broker touches.
 if the callback returns false, the message is not forwarded to the clients. */
 afl_ret_t llmp_broker_add_message_hook(llmp_broker_state_t *   broker,
                                        llmp_message_hook_func *hook,
                                        void *                  data);
 
+/* Adds a hook that runs on one of LLMP_HOOK_WORKERS threads instead of the
+broker. With a verdict_us of 0, the broker forwards msgs right away and ignores
+what the hook returns, good for persisting or indexing msgs. Else, it waits up
+to verdict_us for the hook to decide, then forwards anyway, counting a
+hook_timeout in the stats page. A msg stays valid until the hook returned, even
+after the timeout, but the broker and the stats page are off limits: async
+hooks may run concurrently with the broker, and with each other. */
+afl_ret_t llmp_broker_add_async_message_hook(llmp_broker_state_t *   broker,
+                                             llmp_message_hook_func *hook,
+                                             void *data, u32 verdict_us);
+
+/* Adds a hook that drops LLMP_TAG_NEW_QUEUE_ENTRY msgs with a payload the
+broker forwarded before, so that clients finding the same entry at the same time
+don't make all others add it n times. Keeps the XXH3 hashes of the last payloads
+in a lock-free set of slot_count slots (0: LLMP_DEDUP_DEFAULT_SLOTS, rounded up
+to a power of 2). Old hashes get forgotten, so duplicates far apart may pass.
+The dedup rate shows in the stats page (dedup_drops / dedup_msgs). */
+afl_ret_t llmp_broker_enable_dedup(llmp_broker_state_t *broker,
+                                   size_t               slot_count);
+
+/* Makes the broker write all msgs it forwards to a journal file at path,
+mmapped, of size bytes (0: LLMP_JOURNAL_DEFAULT_SIZE), synced to disk every
+LLMP_JOURNAL_SYNC_US. Once full, the journal is rewritten with its newer half.
+If the file already holds a journal, say of a broker that died, its msgs are
+broadcast again first, so clients of the restarted broker get them.
+Late clients can catch up with llmp_journal_open. */
+afl_ret_t llmp_broker_enable_journal(llmp_broker_state_t *broker, char *path,
+                                     size_t size);
+
+/* Maps the journal file at path read-only, to replay the msgs in it */
+afl_ret_t llmp_journal_open(llmp_journal_t *journal, char *path);
+
+/* The msg after last in the journal, the first one if last is NULL. NULL once
+we read all msgs. The broker rewrites (not overwrites) the file once it's full,
+so the msgs of an open journal stay put. */
+llmp_message_t *llmp_journal_next(llmp_journal_t *journal,
+                                  llmp_message_t *last);
+
+/* Syncs the journal, if we write it, and unmaps it */
+void llmp_journal_close(llmp_journal_t *journal);
+
 /* The broker walks all pages and looks for changes, then broadcasts them on
  its own shared page.
  Never returns. */
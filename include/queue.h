@@ -30,7 +30,7 @@
 #define MAX_FEEDBACK_QUEUES 10
 
 #include "input.h"
-#include "list.h"
+#include "corpus.h"
 #include "afl-shmem.h"
 #include <stdbool.h>
 
@@ -53,25 +53,34 @@ struct queue_entry_functions {
   queue_entry_t *(*get_next)(queue_entry_t *);
   queue_entry_t *(*get_prev)(queue_entry_t *);
   queue_entry_t *(*get_parent)(queue_entry_t *);
-  queue_entry_t *(*get_child)(
-      queue_entry_t *,
-      size_t);     /*TODO: Still need to add a base implementation for this.*/
+  queue_entry_t *(*get_child)(queue_entry_t *, size_t);
 
 };
 
+/* parent_idx of entries without a parent (in their queue) */
+#define QUEUE_ENTRY_NO_PARENT ((size_t)-1)
+
+/* Lineage is kept by index in the entry's queue, out of line: most entries
+never get children, so they don't pay for them. A filename set by others stays
+theirs, eviction only writes (and frees) one of its own if none is set. */
 struct queue_entry {
 
   raw_input_t *       input;
-  bool                on_disk;
-  char *              filename;
+  bool                on_disk;     // Input evicted to filename, see get_input
+  bool                referenced;  // Used since the clock hand last came by
+  bool                pinned;      // Never evicted while set, e.g. when fuzzed
+  bool                from_wire;   // Shared by another fuzzer, not broadcast
+  bool                own_file;    // filename got allocated by eviction
+  char *              filename;    // Where the input is on disk, if anywhere
   struct base_queue * queue;
   struct queue_entry *next;
   struct queue_entry *prev;
-  struct queue_entry *parent;
 
-  list_t children;
-  size_t children_num;  // Keeps track of the number of child entries for each
-                        // entry
+  size_t  idx;         // Index in queue, set once added
+  size_t  parent_idx;  // Index of the parent in queue, or QUEUE_ENTRY_NO_PARENT
+  size_t *children;    // Indices of the children, allocated on the first one
+  size_t  children_num;
+  size_t  ram_size;    // Bytes of the input counted in queue->ram_used
 
   struct queue_entry_functions funcs;
 
@@ -80,6 +89,11 @@ struct queue_entry {
 afl_ret_t afl_queue_entry_init(queue_entry_t *, raw_input_t *);
 void      afl_queue_entry_deinit(queue_entry_t *);
 
+/* Makes child (which must be in the queue of parent already) a child of
+ * parent */
+afl_ret_t afl_queue_entry_add_child(queue_entry_t *parent,
+                                    queue_entry_t *child);
+
 static inline queue_entry_t *afl_queue_entry_create(raw_input_t *input) {
 
   queue_entry_t *queue_entry = calloc(1, sizeof(queue_entry_t));
@@ -103,10 +117,78 @@ static inline void afl_queue_entry_delete(queue_entry_t *queue_entry) {
 }
 
 // Default implementations for the functions for queue_entry vtable
+/* Reloads the input from disk first, if it got evicted */
 raw_input_t *  afl_get_input_default(queue_entry_t *entry);
+bool           afl_is_on_disk_default(queue_entry_t *entry);
 queue_entry_t *afl_get_next_default(queue_entry_t *entry);
 queue_entry_t *afl_get_prev_default(queue_entry_t *entry);
 queue_entry_t *afl_get_parent_default(queue_entry_t *entry);
+queue_entry_t *afl_get_child_default(queue_entry_t *entry, size_t nth);
+
+/* Wire format of LLMP_TAG_NEW_QUEUE_ENTRY msgs: this header, directly followed
+by the len input bytes. Unlike queue_entry_t, it holds no pointers, so it means
+the same in every process reading it. The flags tell which of the optional
+fields are set. */
+#define QUEUE_WIRE_VERSION (1)
+#define QUEUE_WIRE_EXEC_US (1 << 0)
+
+typedef struct queue_entry_wire {
+
+  u16 version;
+  u16 flags;
+  u32 len;
+  u64 exec_us;  // Exec time of the input, if QUEUE_WIRE_EXEC_US
+  u8  buf[];
+
+} queue_entry_wire_t;
+
+/* The size of the entry in wire format */
+static inline size_t afl_queue_entry_wire_len(queue_entry_t *entry) {
+
+  return sizeof(queue_entry_wire_t) + entry->input->len;
+
+}
+
+/* Writes the entry to wire, which must hold afl_queue_entry_wire_len bytes.
+  Set exec_us afterwards, if known. */
+void afl_queue_entry_to_wire(queue_entry_t *entry, queue_entry_wire_t *wire);
+/* Copies the input bytes of a wire msg of len bytes to input, reusing its
+  buffer. This is the only copy, the header stays in the msg. */
+afl_ret_t afl_queue_entry_from_wire(queue_entry_wire_t *wire, size_t len,
+                                    raw_input_t *input);
+
+/* The entries of a queue, by index. Chunk k holds QUEUE_INDEX_FIRST_CHUNK << k
+entries, so the chunk table never grows, chunks never move (pointers to slots
+stay valid while the queue grows), and at most half of the slots are unused. */
+#define QUEUE_INDEX_FIRST_CHUNK_POW2 (6)
+#define QUEUE_INDEX_FIRST_CHUNK (1 << QUEUE_INDEX_FIRST_CHUNK_POW2)
+#define QUEUE_INDEX_CHUNKS (40)
+
+typedef struct queue_index {
+
+  queue_entry_t **chunks[QUEUE_INDEX_CHUNKS];
+  size_t          chunk_count;
+
+} queue_index_t;
+
+/* The slot of entry idx, which must be below the number of entries */
+static inline queue_entry_t **afl_queue_index_slot(queue_index_t *index,
+                                                   size_t         idx) {
+
+  size_t pos = idx + QUEUE_INDEX_FIRST_CHUNK;
+  u32    msb = 63 - __builtin_clzll(pos);
+
+  return &index->chunks[msb - QUEUE_INDEX_FIRST_CHUNK_POW2]
+                       [pos - ((size_t)1 << msb)];
+
+}
+
+/* Stores entry at idx, allocating the next chunk if idx is the first index
+ * past the last one */
+afl_ret_t afl_queue_index_set(queue_index_t *index, size_t idx,
+                              queue_entry_t *entry);
+/* Frees all chunks, not the entries */
+void afl_queue_index_clear(queue_index_t *index);
 
 typedef struct base_queue base_queue_t;
 
@@ -130,8 +212,7 @@ struct base_queue_functions {
 
 struct base_queue {
 
-  afl_shmem_t *               shared_mem;
-  queue_entry_t **            queue_entries;
+  queue_index_t               entries;
   queue_entry_t *             base;
   u64                         current;
   int                         engine_id;
@@ -142,6 +223,10 @@ struct base_queue {
   size_t                      names_id;
   bool                        save_to_files;
   bool                        fuzz_started;
+  size_t                      ram_budget;  // 0 keeps all inputs in memory
+  size_t                      ram_used;    // Bytes of inputs in memory
+  size_t                      clock_hand;  // Next entry to consider evicting
+  afl_corpus_t *              corpus;  // New inputs get appended here, if set
   struct base_queue_functions funcs;
 
   /* TODO: Still need to add shared_mutex (after multithreading), map of
@@ -151,6 +236,25 @@ struct base_queue {
 
 /* TODO: Add the base  */
 
+/* The entry at idx, idx must be below queue->size */
+static inline queue_entry_t *afl_base_queue_entry(base_queue_t *queue,
+                                                  size_t        idx) {
+
+  return *afl_queue_index_slot(&queue->entries, idx);
+
+}
+
+/* Keeps at most about budget bytes of inputs in memory: once more are, the
+least recently used ones (by CLOCK) get evicted to files in the queue's
+directory, and reloaded by get_input. The queue needs a directory of its own
+(set_directory) first. 0 turns eviction off again. */
+afl_ret_t afl_base_queue_set_ram_budget(base_queue_t *queue, size_t budget);
+
+/* Appends the inputs of all entries added from now on to corpus (opened
+writable), and points them at their copy there. The queue doesn't own the
+corpus, it must stay open as long as the queue's entries are around. */
+void afl_base_queue_set_corpus(base_queue_t *queue, afl_corpus_t *corpus);
+
 afl_ret_t afl_base_queue_init(base_queue_t *);
 void      afl_base_queue_deinit(base_queue_t *);
 
@@ -24,30 +24,104 @@
 
  */
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#if defined(USEMEMFD) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE                                       /* memfd_create */
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#if defined(USEMMAP) || defined(USEMEMFD)
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#else
+  #include <sys/ipc.h>
+  #include <sys/shm.h>
+#endif
 #include "common.h"
 #include "afl-shmem.h"
 
-void afl_shmem_deinit(afl_shmem_t *shm) {
+#ifdef USEMEMFD
 
-  if (!shm || !shm->map) {
+  /* Only linux/memfd.h has this one, which clashes with sys/mman.h */
+  #if defined(MFD_HUGETLB) && !defined(MFD_HUGE_2MB)
+    #define MFD_HUGE_2MB (21U << 26)
+  #endif
 
-    // Not set or not initialized;
-    return;
+/* Creates an anonymous memfd of (at least) map_size bytes and maps it.
+ * Hugetlb backed if asked for and the system has huge pages to spare. The
+ * length mapped ends up in mapped_size, map_size stays what was asked for. */
+static bool afl_shmem_memfd_map(afl_shmem_t *shm, size_t map_size,
+                                bool hugetlb) {
+
+  unsigned int flags = MFD_CLOEXEC;
+
+  if (hugetlb) {
+
+  #if defined(MFD_HUGETLB) && defined(MFD_HUGE_2MB)
+    flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    /* hugetlbfs wants whole huge pages */
+    map_size = (map_size + AFL_SHMEM_HUGEPAGE_SIZE - 1) &
+               ~((size_t)AFL_SHMEM_HUGEPAGE_SIZE - 1);
+  #else
+    return false;
+  #endif
 
   }
 
-  shm->shm_str[0] = '\0';
+  shm->g_shm_fd = memfd_create("afl_shmem", flags);
+  if (shm->g_shm_fd == -1) { return false; }
 
-#ifdef USEMMAP
-  if (shm->map != NULL) {
+  if (ftruncate(shm->g_shm_fd, map_size)) { goto error; }
+
+  /* For hugetlb, this is where we find out if the huge pages could be
+   * reserved. */
+  shm->map =
+      mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->g_shm_fd, 0);
+  if (shm->map == MAP_FAILED) {
 
-    munmap(shm->map, shm->map_size);
     shm->map = NULL;
+    goto error;
+
+  }
+
+  #ifdef MADV_HUGEPAGE
+  /* If we did not get hugetlb pages, transparent huge pages are the next best
+   * thing (if shmem THP is enabled at all) */
+  if (!hugetlb && map_size >= AFL_SHMEM_HUGEPAGE_SIZE) {
+
+    madvise(shm->map, map_size, MADV_HUGEPAGE);
+
+  }
+
+  #endif
+
+  shm->mapped_size = map_size;
+  snprintf(shm->shm_str, sizeof(shm->shm_str), "%d:%d", getpid(),
+           shm->g_shm_fd);
+  return true;
+
+error:
+  close(shm->g_shm_fd);
+  shm->g_shm_fd = -1;
+  return false;
+
+}
+
+#endif
+
+void afl_shmem_deinit(afl_shmem_t *shm) {
+
+  if (!shm || !shm->map) {
+
+    // Not set or not initialized;
+    return;
 
   }
 
+#if defined(USEMMAP) || defined(USEMEMFD)
+  munmap(shm->map, shm->mapped_size);
+
   if (shm->g_shm_fd != -1) {
 
     close(shm->g_shm_fd);
@@ -55,10 +129,15 @@ void afl_shmem_deinit(afl_shmem_t *shm) {
 
   }
 
+  #ifdef USEMMAP
+  shm_unlink(shm->shm_str);
+  #endif
 #else
+  shmdt(shm->map);
   shmctl(shm->shm_id, IPC_RMID, NULL);
 #endif
 
+  shm->shm_str[0] = '\0';
   shm->map = NULL;
 
 }
@@ -69,7 +148,21 @@ u8 *afl_shmem_init(afl_shmem_t *shm, size_t map_size) {
 
   shm->map = NULL;
 
-#ifdef USEMMAP
+#if defined(USEMEMFD)
+
+  /* The memfd goes away with the last process that has it open or mapped, so
+   * nothing leaks if we crash. */
+  if (!(map_size >= AFL_SHMEM_HUGEPAGE_MIN &&
+        afl_shmem_memfd_map(shm, map_size, true)) &&
+      !afl_shmem_memfd_map(shm, map_size, false)) {
+
+    shm->map_size = 0;
+    shm->shm_str[0] = '\0';
+    return NULL;
+
+  }
+
+#elif defined(USEMMAP)
 
   shm->g_shm_fd = -1;
 
@@ -93,8 +186,9 @@ u8 *afl_shmem_init(afl_shmem_t *shm, size_t map_size) {
   /* configure the size of the shared memory segment */
   if (ftruncate(shm->g_shm_fd, map_size)) {
 
-    clos(shm->g_shm_fd);
+    close(shm->g_shm_fd);
     shm_unlink(shm->shm_str);
+    shm->g_shm_fd = -1;
     shm->shm_str[0] = '\0';
     return NULL;
 
@@ -103,16 +197,19 @@ u8 *afl_shmem_init(afl_shmem_t *shm, size_t map_size) {
   /* map the shared memory segment to the address space of the process */
   shm->map =
       mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->g_shm_fd, 0);
-  if (shm->map == MAP_FAILED || shm->map == -1 || !shm->map) {
+  if (shm->map == MAP_FAILED || !shm->map) {
 
     close(shm->g_shm_fd);
     shm_unlink(shm->shm_str);
+    shm->map = NULL;
     shm->g_shm_fd = -1;
     shm->shm_str[0] = '\0';
     return NULL;
 
   }
 
+  shm->mapped_size = map_size;
+
 #else
 
   shm->shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600);
@@ -144,7 +241,9 @@ u8 *afl_shmem_init(afl_shmem_t *shm, size_t map_size) {
 
 }
 
-u8 *afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size) {
+/* Maps an existing shared map, optionally read-only */
+static u8 *afl_shmem_attach(afl_shmem_t *shm, char *shm_str, size_t map_size,
+                            bool readonly) {
 
   if (!shm || !shm_str || !shm_str[0] || !map_size) { return NULL; }
   shm->map = NULL;
@@ -152,12 +251,28 @@ u8 *afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size) {
   shm->map_size = map_size;
   strncpy(shm->shm_str, shm_str, sizeof(shm->shm_str) - 1);
 
-#ifdef USEMMAP
-  const char *   shm_file_path = shm_str;
+#if defined(USEMMAP) || defined(USEMEMFD)
   unsigned char *shm_base = NULL;
 
+  #ifdef USEMEMFD
+  /* The creator's fd, reachable through procfs, also from other processes */
+  int         pid, fd;
+  char        fd_path[64];
+  struct stat st;
+
+  if (sscanf(shm_str, "%d:%d", &pid, &fd) != 2) {
+
+    shm->shm_str[0] = '\0';
+    return NULL;
+
+  }
+
+  snprintf(fd_path, sizeof(fd_path), "/proc/%d/fd/%d", pid, fd);
+  shm->g_shm_fd = open(fd_path, (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  #else
   /* create the shared memory segment as if it was a file */
-  shm->g_shm_fd = shm_open(shm_file_path, O_RDWR, 0600);
+  shm->g_shm_fd = shm_open(shm_str, readonly ? O_RDONLY : O_RDWR, 0600);
+  #endif
   if (shm->g_shm_fd == -1) {
 
     shm->shm_str[0] = '\0';
@@ -165,25 +280,49 @@ u8 *afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size) {
 
   }
 
-  /* map the shared memory segment to the address space of the process */
-  shm_base =
-      mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm->g_shm_fd, 0);
-  if (shm_base == MAP_FAILED) {
+  #ifdef USEMEMFD
+  /* Hugetlb maps can only be mapped in whole huge pages */
+  if (fstat(shm->g_shm_fd, &st) || (size_t)st.st_size < map_size) {
 
-    close(shm->g_shm_fd);
-    shm->g_shm_fd = -1;
-    shm->map_size = 0;
-    shm->shm_str[0] = '\0';
+    goto error;
 
-    return NULL;
+  }
+
+  if ((size_t)st.st_blksize > (size_t)sysconf(_SC_PAGESIZE)) {
+
+    map_size = (map_size + st.st_blksize - 1) & ~((size_t)st.st_blksize - 1);
 
   }
 
+  #endif
+
+  /* map the shared memory segment to the address space of the process */
+  shm_base = mmap(0, map_size, readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                  MAP_SHARED, shm->g_shm_fd, 0);
+  if (shm_base == MAP_FAILED) { goto error; }
+
   shm->map = shm_base;
+  shm->mapped_size = map_size;
+
+  #ifdef USEMEMFD
+  /* The mapping keeps the memfd alive, we don't need another fd for it. */
+  close(shm->g_shm_fd);
+  shm->g_shm_fd = -1;
+  #endif
+
+  return shm->map;
+
+error:
+  close(shm->g_shm_fd);
+  shm->g_shm_fd = -1;
+  shm->map_size = 0;
+  shm->shm_str[0] = '\0';
+  return NULL;
+
 #else
   shm->shm_id = atoi(shm_str);
 
-  shm->map = shmat(shm->shm_id, NULL, 0);
+  shm->map = shmat(shm->shm_id, NULL, readonly ? SHM_RDONLY : 0);
 
   if (shm->map == (void *)-1) {
 
@@ -194,9 +333,45 @@ u8 *afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size) {
 
   }
 
+  return shm->map;
 #endif
 
-  return shm->map;
+}
+
+u8 *afl_shmem_by_str(afl_shmem_t *shm, char *shm_str, size_t map_size) {
+
+  return afl_shmem_attach(shm, shm_str, map_size, false);
+
+}
+
+u8 *afl_shmem_by_str_readonly(afl_shmem_t *shm, char *shm_str,
+                              size_t map_size) {
+
+  return afl_shmem_attach(shm, shm_str, map_size, true);
+
+}
+
+/* Unmaps the map from this process, without destroying it for the others */
+void afl_shmem_unmap(afl_shmem_t *shm) {
+
+  if (!shm || !shm->map) { return; }
+
+#if defined(USEMMAP) || defined(USEMEMFD)
+  munmap(shm->map, shm->mapped_size);
+
+  if (shm->g_shm_fd != -1) {
+
+    close(shm->g_shm_fd);
+    shm->g_shm_fd = -1;
+
+  }
+
+#else
+  shmdt(shm->map);
+#endif
+
+  shm->shm_str[0] = '\0';
+  shm->map = NULL;
 
 }
 
@@ -0,0 +1,274 @@
+/*
+   american fuzzy lop++ - fuzzer header
+   ------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This is the Library based on AFL++ which can be used to build
+   customized fuzzers for a specific target while taking advantage of
+   a lot of features that AFL++ already provides.
+
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "corpus.h"
+
+/* Rounds up to whole pages */
+static inline size_t afl_corpus_page_align(size_t size) {
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) & ~(page_size - 1);
+
+}
+
+/* Writes the header of a new, empty store */
+static afl_ret_t afl_corpus_create(int fd) {
+
+  afl_corpus_header_t header = {0};
+
+  header.magic = AFL_CORPUS_MAGIC;
+  header.version = AFL_CORPUS_VERSION;
+  header.max_entries = AFL_CORPUS_DEFAULT_MAX_ENTRIES;
+  header.index_offset = afl_corpus_page_align(sizeof(afl_corpus_header_t));
+  header.data_offset = afl_corpus_page_align(
+      header.index_offset + header.max_entries * sizeof(afl_corpus_slice_t));
+  header.max_data = AFL_CORPUS_DEFAULT_MAX_DATA;
+
+  /* The index stays sparse until used */
+  if (ftruncate(fd, header.data_offset)) { return AFL_RET_ERRNO; }
+
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+
+    return AFL_RET_SHORT_WRITE;
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+afl_ret_t afl_corpus_open(afl_corpus_t *corpus, char *path, bool writable) {
+
+  afl_corpus_header_t header;
+  struct stat         st;
+  afl_ret_t           err;
+
+  memset(corpus, 0, sizeof(afl_corpus_t));
+
+  corpus->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+  if (corpus->fd < 0) { return AFL_RET_FILE_OPEN_ERROR; }
+
+  /* Two writers would append at the same offset. The lock goes away with the
+   * fd, also if we crash. */
+  if (writable && flock(corpus->fd, LOCK_EX | LOCK_NB)) {
+
+    err = errno == EWOULDBLOCK ? AFL_RET_IN_USE : AFL_RET_ERRNO;
+    goto error;
+
+  }
+
+  if (fstat(corpus->fd, &st)) {
+
+    err = AFL_RET_ERRNO;
+    goto error;
+
+  }
+
+  if (!st.st_size) {
+
+    if (!writable) {
+
+      err = AFL_RET_FILE_SIZE;
+      goto error;
+
+    }
+
+    err = afl_corpus_create(corpus->fd);
+    if (err != AFL_RET_SUCCESS) { goto error; }
+
+  }
+
+  if (pread(corpus->fd, &header, sizeof(header), 0) != sizeof(header)) {
+
+    err = AFL_RET_SHORT_READ;
+    goto error;
+
+  }
+
+  u64 index_end =
+      header.index_offset + header.max_entries * sizeof(afl_corpus_slice_t);
+  if (header.magic != AFL_CORPUS_MAGIC ||
+      header.version != AFL_CORPUS_VERSION || header.data_offset < index_end) {
+
+    err = AFL_RET_MALFORMED_MSG;
+    goto error;
+
+  }
+
+  if (fstat(corpus->fd, &st)) {
+
+    err = AFL_RET_ERRNO;
+    goto error;
+
+  }
+
+  /* Reserve it all at once, so the map (and the inputs pointing into it) never
+   * move. Only what the file holds may be touched. */
+  corpus->map_size = header.data_offset + header.max_data;
+  corpus->map =
+      mmap(NULL, corpus->map_size,
+           writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+           corpus->fd, 0);
+  if (corpus->map == MAP_FAILED) {
+
+    corpus->map = NULL;
+    err = AFL_RET_ERRNO;
+    goto error;
+
+  }
+
+  corpus->writable = writable;
+  corpus->file_size = st.st_size;
+  corpus->header = (afl_corpus_header_t *)corpus->map;
+  corpus->index = (afl_corpus_slice_t *)(corpus->map + header.index_offset);
+  corpus->data = corpus->map + header.data_offset;
+
+  if (corpus->header->data_used > header.max_data ||
+      header.data_offset + corpus->header->data_used > corpus->file_size ||
+      corpus->header->count > header.max_entries) {
+
+    afl_corpus_close(corpus);
+    return AFL_RET_MALFORMED_MSG;
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+error:
+  close(corpus->fd);
+  corpus->fd = -1;
+  return err;
+
+}
+
+void afl_corpus_close(afl_corpus_t *corpus) {
+
+  if (corpus->map) { munmap(corpus->map, corpus->map_size); }
+  if (corpus->fd >= 0) { close(corpus->fd); }
+
+  memset(corpus, 0, sizeof(afl_corpus_t));
+  corpus->fd = -1;
+
+}
+
+afl_ret_t afl_corpus_append(afl_corpus_t *corpus, u8 *bytes, size_t len,
+                            size_t *id) {
+
+  afl_corpus_header_t *header = corpus->header;
+
+  if (!corpus->writable) { return AFL_RET_FILE_OPEN_ERROR; }
+  if (header->count >= header->max_entries) { return AFL_RET_ARRAY_END; }
+
+  /* Same as load_from_file, keep a 0 byte after the input */
+  u64 offset = header->data_used;
+  u64 end = offset + len + 1;
+  if (end > header->max_data) { return AFL_RET_FILE_SIZE; }
+
+  if (header->data_offset + end > corpus->file_size) {
+
+    size_t file_size = header->data_offset +
+                       MIN(header->max_data, end + AFL_CORPUS_GROW_SIZE);
+    if (ftruncate(corpus->fd, file_size)) { return AFL_RET_ERRNO; }
+    corpus->file_size = file_size;
+
+  }
+
+  memcpy(corpus->data + offset, bytes, len);
+  corpus->data[offset + len] = 0;
+
+  corpus->index[header->count].offset = offset;
+  corpus->index[header->count].len = len;
+  header->data_used = end;
+
+  if (id) { *id = header->count; }
+
+  /* Readers in other processes only look at what count covers */
+  __atomic_store_n(&header->count, header->count + 1, __ATOMIC_RELEASE);
+
+  return AFL_RET_SUCCESS;
+
+}
+
+afl_ret_t afl_corpus_input(afl_corpus_t *corpus, size_t id,
+                           raw_input_t *input) {
+
+  /* The header and index are shared, so a torn or corrupt store must not make
+   * us read past what we mapped, or what the file holds. Only trust the
+   * geometry we checked on open. */
+  size_t max_entries = (corpus->data - (u8 *)corpus->index) /
+                       sizeof(afl_corpus_slice_t);
+  size_t data_offset = corpus->data - corpus->map;
+
+  if (id >= afl_corpus_count(corpus)) { return AFL_RET_ARRAY_END; }
+  if (id >= max_entries) { return AFL_RET_MALFORMED_MSG; }
+
+  afl_corpus_slice_t slice = corpus->index[id];
+
+  u64 data_used =
+      __atomic_load_n(&corpus->header->data_used, __ATOMIC_ACQUIRE);
+
+  if (data_used > corpus->map_size - data_offset) {
+
+    return AFL_RET_MALFORMED_MSG;
+
+  }
+
+  if (data_offset + data_used > corpus->file_size) {
+
+    /* The writer may have grown the file since we looked */
+    struct stat st;
+    if (fstat(corpus->fd, &st)) { return AFL_RET_ERRNO; }
+    corpus->file_size = st.st_size;
+    if (data_offset + data_used > corpus->file_size) {
+
+      return AFL_RET_MALFORMED_MSG;
+
+    }
+
+  }
+
+  /* Each testcase is followed by a 0 byte */
+  if (slice.offset >= data_used || slice.len >= data_used - slice.offset) {
+
+    return AFL_RET_MALFORMED_MSG;
+
+  }
+
+  afl_input_release_bytes(input);
+  input->bytes = corpus->data + slice.offset;
+  input->len = slice.len;
+  input->mapped = true;
+
+  return AFL_RET_SUCCESS;
+
+}
@@ -57,11 +57,16 @@ afl_ret_t afl_engine_init(engine_t *engine, executor_t *executor,
 
   engine->funcs.execute = afl_execute_default;
   engine->funcs.load_testcases_from_dir = afl_load_testcases_from_dir_default;
+  engine->funcs.load_testcases_from_corpus =
+      afl_load_testcases_from_corpus_default;
   engine->funcs.loop = afl_loop_default;
   engine->funcs.handle_new_message = afl_handle_new_message_default;
   afl_ret_t ret = afl_rand_init(&engine->rnd);
 
   engine->buf = NULL;
+  engine->llmp_client = NULL;
+  engine->msg_budget = DEFAULT_MSG_BUDGET;
+  engine->last_exec_us = 0;
 
   if (ret != AFL_RET_SUCCESS) { return ret; }
 
@@ -157,13 +162,69 @@ int afl_add_feedback_default(engine_t *engine, feedback_t *feedback) {
 
 }
 
+/* Runs an initial testcase, then adds it to all feedback queues. Takes over
+ * input. Inputs mapped from a corpus store stay mapped in the queues. */
+static afl_ret_t afl_engine_load_input(engine_t *engine, raw_input_t *input) {
+
+  size_t    i;
+  afl_ret_t err = AFL_RET_SUCCESS;
+  afl_ret_t run_result = engine->funcs.execute(engine, input);
+
+  /* We add the corpus to the queue initially for all the feedback queues */
+
+  for (i = 0; i < engine->feedbacks_num; ++i) {
+
+    raw_input_t *copy;
+    if (input->mapped) {
+
+      copy = afl_input_create();
+      if (copy) { copy->funcs.restore(copy, input); }
+
+    } else {
+
+      copy = input->funcs.copy(input);
+
+    }
+
+    if (!copy) {
+
+      err = AFL_RET_ERROR_INPUT_COPY;
+      break;
+
+    }
+
+    queue_entry_t *entry = afl_queue_entry_create(copy);
+    if (!entry) {
+
+      afl_input_delete(copy);
+      err = AFL_RET_ALLOC;
+      break;
+
+    }
+
+    engine->feedbacks[i]->queue->base.funcs.add_to_queue(
+        &engine->feedbacks[i]->queue->base, entry);
+
+  }
+
+  if (run_result == AFL_RET_WRITE_TO_CRASH) {
+
+    SAYF("Crashing input found in initial corpus\n");
+
+  }
+
+  afl_input_delete(input);
+  return err;
+
+}
+
 afl_ret_t afl_load_testcases_from_dir_default(
     engine_t *engine, char *dirpath, raw_input_t *(*custom_input_create)()) {
 
   DIR *          dir_in;
   struct dirent *dir_ent;
   char           infile[PATH_MAX];
-  size_t         i;
+  afl_ret_t      err = AFL_RET_SUCCESS;
 
   raw_input_t *input;
   size_t       dir_name_size = strlen(dirpath);
@@ -190,7 +251,7 @@ afl_ret_t afl_load_testcases_from_dir_default(
 
   }
 
-  while ((dir_ent = readdir(dir_in))) {
+  while (err == AFL_RET_SUCCESS && (dir_ent = readdir(dir_in))) {
 
     if (dir_ent->d_name[0] == '.') {
 
@@ -212,14 +273,8 @@ afl_ret_t afl_load_testcases_from_dir_default(
 
     if (!input) {
 
-      closedir(dir_in);
-      if (engine->executor->funcs.destroy_cb) {
-
-        engine->executor->funcs.destroy_cb(engine->executor);
-
-      };
-
-      return AFL_RET_ALLOC;
+      err = AFL_RET_ALLOC;
+      break;
 
     }
 
@@ -228,35 +283,65 @@ afl_ret_t afl_load_testcases_from_dir_default(
     /* TODO: Error handling? */
     input->funcs.load_from_file(input, infile);
 
-    afl_ret_t run_result = engine->funcs.execute(engine, input);
+    err = afl_engine_load_input(engine, input);
 
-    /* We add the corpus to the queue initially for all the feedback queues */
+  }
 
-    for (i = 0; i < engine->feedbacks_num; ++i) {
+  closedir(dir_in);
 
-      raw_input_t *copy = input->funcs.copy(input);
-      if (!copy) { return AFL_RET_ERROR_INPUT_COPY; }
+  if (err != AFL_RET_SUCCESS && engine->executor->funcs.destroy_cb) {
 
-      queue_entry_t *entry = afl_queue_entry_create(copy);
-      engine->feedbacks[i]->queue->base.funcs.add_to_queue(
-          &engine->feedbacks[i]->queue->base, entry);
+    engine->executor->funcs.destroy_cb(engine->executor);
+
+  }
+
+  return err;
+
+}
+
+afl_ret_t afl_load_testcases_from_corpus_default(engine_t *    engine,
+                                                 afl_corpus_t *corpus) {
+
+  size_t    id;
+  size_t    count = afl_corpus_count(corpus);
+  afl_ret_t err = AFL_RET_SUCCESS;
+
+  if (engine->executor->funcs.init_cb) {
+
+    afl_ret_t ret = engine->executor->funcs.init_cb(engine->executor);
+    if (ret != AFL_RET_SUCCESS) { return ret; }
+
+  }
+
+  for (id = 0; id < count && err == AFL_RET_SUCCESS; id++) {
+
+    raw_input_t *input = afl_input_create();
+    if (!input) {
+
+      err = AFL_RET_ALLOC;
+      break;
 
     }
 
-    if (run_result == AFL_RET_WRITE_TO_CRASH) {
+    err = afl_corpus_input(corpus, id, input);
+    if (err != AFL_RET_SUCCESS) {
 
-      SAYF("Crashing input found in initial corpus\n");
+      afl_input_delete(input);
+      break;
 
     }
 
-    afl_input_delete(input);
-    input = NULL;
+    err = afl_engine_load_input(engine, input);
 
   }
 
-  closedir(dir_in);
+  if (err != AFL_RET_SUCCESS && engine->executor->funcs.destroy_cb) {
 
-  return AFL_RET_SUCCESS;
+    engine->executor->funcs.destroy_cb(engine->executor);
+
+  }
+
+  return err;
 
 }
 
@@ -265,16 +350,48 @@ void afl_handle_new_message_default(engine_t *engine, llmp_message_t *msg) {
   /* Default implementation, handles only new queue entry messages. Users have
    * liberty with this function */
 
+  /* The broker broadcasts to everybody, us included. Our own entries are in
+   * our queues already. */
+  if (engine->llmp_client && msg->sender == engine->llmp_client->id) {
+
+    return;
+
+  }
+
   if (msg->tag == LLMP_TAG_NEW_QUEUE_ENTRY) {
 
+    /* The msg lives in a broadcast page that gets unmapped eventually, so every
+     * queue gets its own copy of the input. */
     /* Users can experiment here, adding entries to different queues based on
      * the message tag. Right now, let's just add it to all queues*/
     size_t i = 0;
     for (i = 0; i < engine->global_queue->feedback_queues_num; ++i) {
 
+      raw_input_t *input = afl_input_create();
+      if (!input) { break; }
+
+      afl_ret_t ret = afl_queue_entry_from_wire(
+          (queue_entry_wire_t *)msg->buf, msg->buf_len, input);
+      if (ret != AFL_RET_SUCCESS) {
+
+        WARNF("Could not read queue entry: %s", afl_ret_stringify(ret));
+        afl_input_delete(input);
+        break;
+
+      }
+
+      queue_entry_t *entry = afl_queue_entry_create(input);
+      if (!entry) {
+
+        afl_input_delete(input);
+        break;
+
+      }
+
+      /* Entries of others are not ours to broadcast again */
+      entry->from_wire = true;
       engine->global_queue->feedback_queues[i]->base.funcs.add_to_queue(
-          &engine->global_queue->feedback_queues[i]->base,
-          (queue_entry_t *)msg->buf);
+          &engine->global_queue->feedback_queues[i]->base, entry);
 
     }
 
@@ -282,6 +399,15 @@ void afl_handle_new_message_default(engine_t *engine, llmp_message_t *msg) {
 
 }
 
+/* Current (monotonic) time in microseconds */
+static inline u64 afl_engine_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+}
+
 u8 afl_execute_default(engine_t *engine, raw_input_t *input) {
 
   size_t      i;
@@ -293,7 +419,9 @@ u8 afl_execute_default(engine_t *engine, raw_input_t *input) {
 
   if (engine->start_time == 0) { engine->start_time = time(NULL); }
 
+  u64         exec_start = afl_engine_time_us();
   exit_type_t run_result = executor->funcs.run_target_cb(executor);
+  engine->last_exec_us = afl_engine_time_us() - exec_start;
 
   engine->executions++;
 
@@ -331,6 +459,38 @@ u8 afl_execute_default(engine_t *engine, raw_input_t *input) {
 
 }
 
+/* Hands pending broadcast messages to the engine's message handler, at most
+ * engine->msg_budget of them (all, if 0). */
+static void afl_engine_handle_messages(engine_t *engine) {
+
+  llmp_message_t *msgs[MSG_BATCH_SIZE];
+  size_t          handled = 0;
+
+  while (!engine->msg_budget || handled < engine->msg_budget) {
+
+    size_t max = MSG_BATCH_SIZE;
+    if (engine->msg_budget && engine->msg_budget - handled < max) {
+
+      max = engine->msg_budget - handled;
+
+    }
+
+    size_t count = llmp_client_recv_batch(engine->llmp_client, msgs, max);
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+
+      engine->funcs.handle_new_message(engine, msgs[i]);
+
+    }
+
+    handled += count;
+    if (count < max) { break; }  // Drained
+
+  }
+
+}
+
 afl_ret_t afl_loop_default(engine_t *engine) {
 
   while (true) {
@@ -339,14 +499,11 @@ afl_ret_t afl_loop_default(engine_t *engine) {
 
     /* let's call this engine's message handler */
 
-    if (engine->funcs.handle_new_message) {
-
-      /* Let's read the broadcasted messages now */
-      llmp_message_t *msg = llmp_client_recv(engine->llmp_client);
-
-      if (!msg) { continue; }  // No new messages
+    if (engine->funcs.handle_new_message && engine->llmp_client) {
 
-      engine->funcs.handle_new_message(engine, msg);
+      /* Let's read the broadcasted messages now, one batch at a time, so we
+       * keep up with the other fuzzers even if fuzz_one is slow */
+      afl_engine_handle_messages(engine);
 
     }
 
@@ -71,25 +71,27 @@ afl_ret_t afl_perform_default(fuzz_one_t *fuzz_one) {
 
   if (!queue_entry) { return AFL_RET_NULL_QUEUE_ENTRY; }
 
-  /* Fuzz the entry with every stage */
-  for (i = 0; i < fuzz_one->stages_num; ++i) {
-
-    stage_t * current_stage = fuzz_one->stages[i];
-    afl_ret_t stage_ret =
-        current_stage->funcs.perform(current_stage, queue_entry->input);
+  /* Reloads the input, if it got evicted to disk */
+  raw_input_t *input = queue_entry->funcs.get_input(queue_entry);
+  if (!input) { return AFL_RET_FILE_OPEN_ERROR; }
 
-    switch (stage_ret) {
+  /* The stages copy the input over and over, while adding new entries to the
+   * queue, which must not evict it meanwhile */
+  bool      pinned = queue_entry->pinned;
+  afl_ret_t ret = AFL_RET_SUCCESS;
+  queue_entry->pinned = true;
 
-      case AFL_RET_SUCCESS:
-        continue;
-      default:
-        return stage_ret;
+  /* Fuzz the entry with every stage */
+  for (i = 0; i < fuzz_one->stages_num && ret == AFL_RET_SUCCESS; ++i) {
 
-    }
+    stage_t *current_stage = fuzz_one->stages[i];
+    ret = current_stage->funcs.perform(current_stage, input);
 
   }
 
-  return AFL_RET_SUCCESS;
+  queue_entry->pinned = pinned;
+
+  return ret;
 
 }
 
@@ -45,16 +45,24 @@ afl_ret_t afl_input_init(raw_input_t *input) {
 
   input->bytes = 0x0;
   input->len = 0x0;
+  input->mapped = false;
 
   return AFL_RET_SUCCESS;
 
 }
 
-void afl_input_deinit(raw_input_t *input) {
+void afl_input_release_bytes(raw_input_t *input) {
 
-  if (input->bytes) { free(input->bytes); }
+  if (input->bytes && !input->mapped) { free(input->bytes); }
 
   input->bytes = NULL;
+  input->mapped = false;
+
+}
+
+void afl_input_deinit(raw_input_t *input) {
+
+  afl_input_release_bytes(input);
   input->len = 0;
 
   return;
@@ -65,7 +73,17 @@ void afl_input_deinit(raw_input_t *input) {
 
 void afl_raw_inp_clear_default(raw_input_t *input) {
 
-  memset(input->bytes, 0x0, input->len);
+  /* Mapped bytes are shared with others, just drop them */
+  if (input->mapped) {
+
+    afl_input_release_bytes(input);
+
+  } else {
+
+    memset(input->bytes, 0x0, input->len);
+
+  }
+
   input->len = 0;
 
   return;
@@ -93,7 +111,7 @@ raw_input_t *afl_raw_inp_copy_default(raw_input_t *orig_inp) {
 void afl_raw_inp_deserialize_default(raw_input_t *input, u8 *bytes,
                                      size_t len) {
 
-  if (input->bytes) free(input->bytes);
+  afl_input_release_bytes(input);
   input->bytes = bytes;
   input->len = len;
 
@@ -114,11 +132,22 @@ afl_ret_t afl_raw_inp_load_from_file_default(raw_input_t *input, char *fname) {
 
   if (fd < 0) { return AFL_RET_FILE_OPEN_ERROR; }
 
-  if (fstat(fd, &st) || !st.st_size) { return AFL_RET_FILE_SIZE; }
+  if (fstat(fd, &st) || !st.st_size) {
 
+    close(fd);
+    return AFL_RET_FILE_SIZE;
+
+  }
+
+  afl_input_release_bytes(input);
   input->len = st.st_size;
   input->bytes = calloc(input->len + 1, 1);
-  if (!input->bytes) { return AFL_RET_ALLOC; }
+  if (!input->bytes) {
+
+    close(fd);
+    return AFL_RET_ALLOC;
+
+  }
 
   ssize_t ret = read(fd, input->bytes, input->len);
   close(fd);
@@ -147,7 +176,10 @@ afl_ret_t afl_raw_inp_save_to_file_default(raw_input_t *input, char *fname) {
 
 void afl_raw_inp_restore_default(raw_input_t *input, raw_input_t *new_inp) {
 
+  /* Mapped bytes stay mapped, they must never get freed */
   input->bytes = new_inp->bytes;
+  input->len = new_inp->len;
+  input->mapped = new_inp->mapped;
 
   return;
 
@@ -37,9 +37,12 @@ current map.
  \|/                \|/                \|/
 [client0]        [client1]    ...    [clientN]
 
-In the future, if we need zero copy, the current_broadcast_map could instead
-list the client_out_map ID an offset for each message. In that case, the clients
-also need to create new shmaps once their bufs are filled up.
+If zero copy is enabled (llmp_broker_set_zero_copy), the broker does not copy
+the message contents. Instead, current_broadcast_map lists the client_out_map id
+and the offset of each message. The clients then map the client_out_map
+read-only and read the message from there. As clients create new shmaps once
+their pages are filled up, a message never moves. The broker keeps old
+client_out_maps mapped for as long as broadcast messages reference them.
 
 
 To use, you will have to create a broker using llmp_broker_new().
@@ -59,18 +62,28 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 #include <math.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <sched.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 
+#include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
-#ifndef USEMMAP
+#ifdef __linux__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+#if !defined(USEMMAP) && !defined(USEMEMFD)
   #include <sys/shm.h>
 #endif
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "config.h"
 #include "debug.h"
@@ -78,6 +91,7 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 #include "aflpp.h"
 #include "common.h"
 #include "llmp.h"
+#include "xxh3.h"
 
 /* all the debug prints */
 #ifdef LLMP_DEBUG
@@ -98,6 +112,11 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
   We've added a client */
 #define LLMP_TAG_CLIENT_ADDED_V1 (0xC11E471)
 
+/* INTERNAL TAG
+  Like LLMP_TAG_CLIENT_ADDED_V1, but the client page got passed to the broker
+  process as fd, named "pid:fd" by our own pid. Closed once mapped. */
+#define LLMP_TAG_CLIENT_ADDED_FD_V1 (0xC11E4FD)
+
 /* INTERNAL TAG
   If you're reading this, we got an issue */
 #define LLMP_TAG_UNALLOCATED_V1 (0xDEADAFll)
@@ -105,6 +124,23 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 /* Just a random msg */
 #define LLMP_ALIVE_V1 (0xA11431)
 
+/* INTERNAL TAG
+  Zero copy: a reference to a message in a client_out_map.
+  The payload will be of type `llmp_payload_msg_ref_t`.
+  Resolved by llmp_client_recv, clients never get to see this tag. */
+#define LLMP_TAG_MSG_REF_V1 (0x2EF0C09)
+
+/* INTERNAL TAG
+  Describes a msg too large for the pages, in an out of band segment.
+  The payload will be of type `llmp_payload_new_page_t`, naming the segment.
+  Resolved by llmp_client_recv, clients never get to see this tag. */
+#define LLMP_TAG_OOB_V1 (0x00B5E6)
+
+/* Verdicts of async hook jobs */
+#define LLMP_HOOK_PENDING (0)
+#define LLMP_HOOK_FORWARD (1)
+#define LLMP_HOOK_DROP (2)
+
 /* Message payload when a client got added LLMP_TAG_CLIENT_ADDED_V1 */
 /* A new sharedmap appeared.
   This is an internal message!
@@ -119,10 +155,79 @@ typedef struct llmp_payload_new_page {
 
 } __attribute__((__packed__)) llmp_payload_new_page_t;
 
+/* A reference to a message in a client page, broadcast in zero copy mode.
+  This is an internal message!
+  LLMP_TAG_MSG_REF_V1
+  */
+typedef struct llmp_payload_msg_ref {
+
+  /* generation of the referenced page, to detect stale references */
+  u32 generation;
+  /* offset of the llmp_message_t in the referenced map */
+  size_t offset;
+  /* length of the referenced message payload */
+  size_t buf_len;
+  /* size of the referenced map */
+  size_t map_size;
+  /* 0-terminated str handle for the referenced map */
+  char shm_str[AFL_SHMEM_STRLEN_MAX];
+
+} __attribute__((__packed__)) llmp_payload_msg_ref_t;
+
+/* An out of band segment, holding a single msg larger than LLMP_OOB_THRESHOLD
+ */
+typedef struct llmp_oob_segment {
+
+  /* LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION of the sender */
+  u32 layout_version;
+  /* The descriptor (sent or broadcast) and each client reading the msg hold a
+   * ref. The sender frees the segment once there are none left. */
+  volatile u32 refs;
+
+  llmp_message_t msg __attribute__((aligned(LLMP_CACHE_LINE_SIZE)));
+
+} llmp_oob_segment_t;
+
+/* Bridges greet each other with this on connect, in network byte order */
+#define LLMP_BRIDGE_MAGIC (0x4C425201)
+
+typedef struct llmp_bridge_hello {
+
+  /* LLMP_BRIDGE_MAGIC */
+  u32 magic;
+  /* node id of the broker behind this bridge */
+  u32 node_id;
+
+} __attribute__((__packed__)) llmp_bridge_hello_t;
+
+/* A batch of msgs sent from bridge to bridge, in network byte order.
+  Followed by msg_count llmp_bridge_msg_t headers, each followed by its buf. */
+typedef struct llmp_bridge_frame {
+
+  u32 msg_count;
+  /* bytes following this header */
+  u32 len;
+
+} __attribute__((__packed__)) llmp_bridge_frame_t;
+
+typedef struct llmp_bridge_msg {
+
+  u32 tag;
+  /* llmp_bridge_sender() of the msg, hops not counting the current bridge */
+  u32 sender;
+  u32 buf_len;
+
+} __attribute__((__packed__)) llmp_bridge_msg_t;
+
+/* Space a msg with the given payload length takes up in a page, incl. the
+ * padding that keeps the next msg aligned */
+#define LLMP_MSG_SIZE(buf_len)                                       \
+  ((sizeof(llmp_message_t) + (buf_len) + LLMP_MSG_ALIGNMENT - 1) & \
+   ~((size_t)LLMP_MSG_ALIGNMENT - 1))
+
 /* We need at least this much space at the end of each page to notify about the
  * next page/restart */
-#define LLMP_MSG_END_OF_PAGE_LEN \
-  (sizeof(llmp_message_t) + sizeof(llmp_payload_new_page_t))
+#define LLMP_MSG_END_OF_PAGE_LEN LLMP_MSG_SIZE(sizeof(llmp_payload_new_page_t))
 
 /* If a msg is contained in the current page */
 bool llmp_msg_in_page(llmp_page_t *page, llmp_message_t *msg) {
@@ -139,6 +244,82 @@ static inline llmp_page_t *shmem2page(afl_shmem_t *afl_shmem) {
 
 }
 
+/* If the peer that set up this page uses the same page layout as we do */
+static inline bool llmp_page_layout_ok(llmp_page_t *page) {
+
+  return page->layout_version == (LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION);
+
+}
+
+/* Maps the out of band segment a descriptor names and returns the msg in it.
+ * Clients take a ref, the broker takes over the one of the descriptor. */
+static llmp_message_t *llmp_oob_map(afl_shmem_t *seg_map, llmp_message_t *desc,
+                                    bool take_ref) {
+
+  llmp_payload_new_page_t *info =
+      LLMP_MSG_BUF_AS(desc, llmp_payload_new_page_t);
+  if (!info) {
+
+    FATAL("Illegal message length for out of band msg (is %ld, expected %ld)",
+          desc->buf_len, sizeof(llmp_payload_new_page_t));
+
+  }
+
+  if (!afl_shmem_by_str(seg_map, info->shm_str, info->map_size)) {
+
+    FATAL("Could not map out of band segment %s of size %ld", info->shm_str,
+          info->map_size);
+
+  }
+
+  llmp_oob_segment_t *seg = (llmp_oob_segment_t *)seg_map->map;
+  if (seg->layout_version != (LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION) ||
+      !seg->refs) {
+
+    FATAL("BUG: Stale or broken out of band segment %s", info->shm_str);
+
+  }
+
+  if (take_ref) { __atomic_add_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL); }
+
+  return &seg->msg;
+
+}
+
+/* Drops our ref on an out of band segment and unmaps it */
+static void llmp_oob_release(afl_shmem_t *seg_map) {
+
+  __atomic_sub_fetch(&((llmp_oob_segment_t *)seg_map->map)->refs, 1,
+                     __ATOMIC_ACQ_REL);
+  afl_shmem_unmap(seg_map);
+
+}
+
+/* The broker's stats page */
+static inline llmp_stats_page_t *llmp_broker_stats(
+    llmp_broker_state_t *broker) {
+
+  return (llmp_stats_page_t *)broker->stats_map.map;
+
+}
+
+/* The stats of a client, or NULL if the stats page has no room for it */
+static inline llmp_client_stats_t *llmp_broker_client_stats(
+    llmp_broker_state_t *broker, u32 client_id) {
+
+  if (client_id >= LLMP_STATS_MAX_CLIENTS) { return NULL; }
+  return &llmp_broker_stats(broker)->clients[client_id];
+
+}
+
+/* Adds to a stats counter. Only the broker writes, readers of the stats page
+ * just need to see no torn values. */
+static inline void llmp_stats_add(u64 *counter, u64 value) {
+
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+
+}
+
 /* In case we don't have enough space, make sure the next page will be large
   enough. For now, we want to have at least enough space to store 2 of the
   largest messages we encountered. */
@@ -149,14 +330,94 @@ static inline size_t new_map_size(size_t max_alloc) {
 
 }
 
+/* Current (monotonic) time in microseconds */
+static inline u64 llmp_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+}
+
+/* Wakes up everybody sleeping on the doorbell. No syscall if nobody sleeps.
+  Call this after the new message has been published. */
+static inline void llmp_doorbell_ring(llmp_doorbell_t *doorbell) {
+
+  /* Pairs with llmp_doorbell_wait: either we see the waiter, or the waiter
+   * sees the message we published before ringing. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (likely(!doorbell->waiters)) { return; }
+
+  __atomic_fetch_add(&doorbell->seq, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+  syscall(SYS_futex, &doorbell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+
+}
+
+/* Sleeps until the doorbell rings (or LLMP_DOORBELL_MAX_SLEEP_MS passed).
+  has_work is checked once more after we registered as waiter, so we won't
+  miss a ring that happened before. */
+static void llmp_doorbell_wait(llmp_doorbell_t *doorbell,
+                               bool (*has_work)(void *), void *data) {
+
+  __atomic_fetch_add(&doorbell->waiters, 1, __ATOMIC_SEQ_CST);
+  u32 seq = __atomic_load_n(&doorbell->seq, __ATOMIC_SEQ_CST);
+
+  if (!has_work(data)) {
+
+#ifdef __linux__
+    struct timespec timeout = {0, LLMP_DOORBELL_MAX_SLEEP_MS * 1000 * 1000};
+    syscall(SYS_futex, &doorbell->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+#else
+    (void)seq;
+    usleep(1000);
+#endif
+
+  }
+
+  __atomic_fetch_sub(&doorbell->waiters, 1, __ATOMIC_SEQ_CST);
+
+}
+
 /* Initialize a new llmp_page_t */
 static void _llmp_page_init(llmp_page_t *page, u32 sender, size_t size) {
 
+  u32 i;
+
+  page->layout_version = LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION;
   page->sender = sender;
+  page->generation = 0;
+  page->save_to_unmap = 0;
   page->current_msg_id = 0;
   page->max_alloc_size = 0;
+  page->link_seq = 0;
+  page->broker_doorbell.seq = 0;
+  page->broker_doorbell.waiters = 0;
+  page->lanes_doorbell.seq = 0;
+  page->lanes_doorbell.waiters = 0;
+  page->new_msg_doorbell.seq = 0;
+  page->new_msg_doorbell.waiters = 0;
+  page->msgs_recvd = 0;
+  page->bytes_recvd = 0;
+  page->bytes_consumed = 0;
+  page->flow_grows = 0;
+  page->flow_stalls = 0;
+  page->flow_drops = 0;
+  memset(&page->priority_map, 0, sizeof(llmp_lane_info_t));
+  for (i = 0; i < LLMP_LANE_COUNT; i++) {
+
+    page->watermarks[i] = 0;
+    page->recv_generations[i] = 0;
+    page->recv_msg_ids[i] = 0;
+
+  }
+
+  memset(page->lanes, 0, sizeof(page->lanes));
+  page->pid = getpid();
   page->size_total = size;
-  page->size_used = 0;
+  /* The page header is part of the page, too */
+  page->size_used = sizeof(llmp_page_t);
   page->messages->message_id = 0;
   page->messages->tag = LLMP_TAG_UNALLOCATED_V1;
 
@@ -165,8 +426,33 @@ static void _llmp_page_init(llmp_page_t *page, u32 sender, size_t size) {
 /* Pointer to the message behind the last message */
 static inline llmp_message_t *_llmp_next_msg_ptr(llmp_message_t *last_msg) {
 
-  return (llmp_message_t *)((u8 *)last_msg + sizeof(llmp_message_t) +
-                            last_msg->buf_len);
+  return (llmp_message_t *)((u8 *)last_msg +
+                            LLMP_MSG_SIZE(last_msg->buf_len));
+
+}
+
+/* Copies the new page info of an EOP msg. The broker may point the EOP of its
+ * first page elsewhere at any time, so we read it like a seqlock. */
+static void llmp_copy_eop_pageinfo(llmp_page_t *page, llmp_message_t *msg,
+                                   llmp_payload_new_page_t *pageinfo_cpy) {
+
+  llmp_payload_new_page_t *pageinfo =
+      LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+  if (!pageinfo) {
+
+    FATAL("Illegal message length for EOP (is %ld, expected %ld)",
+          msg->buf_len, sizeof(llmp_payload_new_page_t));
+
+  }
+
+  u32 seq;
+  do {
+
+    seq = __atomic_load_n(&page->link_seq, __ATOMIC_ACQUIRE);
+    memcpy(pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  } while ((seq & 1) || seq != page->link_seq);
 
 }
 
@@ -197,7 +483,43 @@ llmp_message_t *llmp_recv(llmp_page_t *page, llmp_message_t *last_msg) {
 
 }
 
-/* Blocks/spins until the next message gets posted to the page,
+/* What llmp_page_has_new_msg looks for */
+typedef struct llmp_page_watch {
+
+  llmp_page_t *page;
+  size_t       last_msg_id;
+
+} llmp_page_watch_t;
+
+static bool llmp_page_has_new_msg(void *data) {
+
+  llmp_page_watch_t *watch = (llmp_page_watch_t *)data;
+  MEM_BARRIER();
+  return watch->page->current_msg_id != watch->last_msg_id;
+
+}
+
+/* Spins for LLMP_CLIENT_SPIN_US, then sleeps on the page's new_msg_doorbell,
+  until a message newer than last_msg_id got posted to the page. */
+static void llmp_page_await_new_msg(llmp_page_t *page, size_t last_msg_id) {
+
+  llmp_page_watch_t watch = {page, last_msg_id};
+  u64               spin_start = llmp_time_us();
+
+  while (!llmp_page_has_new_msg(&watch)) {
+
+    if (llmp_time_us() - spin_start > LLMP_CLIENT_SPIN_US) {
+
+      llmp_doorbell_wait(&page->new_msg_doorbell, llmp_page_has_new_msg,
+                         &watch);
+
+    }
+
+  }
+
+}
+
+/* Blocks until the next message gets posted to the page,
   then returns that message. */
 llmp_message_t *llmp_recv_blocking(llmp_page_t *   page,
                                    llmp_message_t *last_msg) {
@@ -216,18 +538,11 @@ llmp_message_t *llmp_recv_blocking(llmp_page_t *   page,
 
   }
 
-  while (1) {
-
-    MEM_BARRIER();
-    if (page->current_msg_id != current_msg_id) {
-
-      llmp_message_t *ret = llmp_recv(page, last_msg);
-      if (!ret) { FATAL("BUG: blocking llmp message should never be NULL!"); }
-      return ret;
-
-    }
+  llmp_page_await_new_msg(page, current_msg_id);
 
-  }
+  llmp_message_t *ret = llmp_recv(page, last_msg);
+  if (!ret) { FATAL("BUG: blocking llmp message should never be NULL!"); }
+  return ret;
 
 }
 
@@ -263,7 +578,7 @@ llmp_message_t *llmp_alloc_eop(llmp_page_t *page, llmp_message_t *last_msg) {
       last_msg ? _llmp_next_msg_ptr(last_msg) : page->messages;
 
   ret->buf_len = sizeof(llmp_payload_new_page_t);
-  ret->message_id = last_msg ? last_msg->message_id += 1 : 1;
+  ret->message_id = page->current_msg_id + 1;
   ret->tag = LLMP_TAG_END_OF_PAGE_V1;
 
   page->size_used += LLMP_MSG_END_OF_PAGE_LEN;
@@ -276,7 +591,7 @@ llmp_message_t *llmp_alloc_eop(llmp_page_t *page, llmp_message_t *last_msg) {
 llmp_message_t *llmp_alloc_next(llmp_page_t *page, llmp_message_t *last_msg,
                                 size_t buf_len) {
 
-  size_t complete_msg_size = sizeof(llmp_message_t) + buf_len;
+  size_t complete_msg_size = LLMP_MSG_SIZE(buf_len);
 
   /* In case we don't have enough space, make sure the next page will be large
    * enough */
@@ -308,9 +623,6 @@ llmp_message_t *llmp_alloc_next(llmp_page_t *page, llmp_message_t *last_msg,
 
     /* We start fresh */
     ret = page->messages;
-    /* We need to start with 1 for ids, as current message id is initialized
-     * with 0... */
-    ret->message_id = last_msg ? last_msg->message_id + 1 : 1;
 
   } else if (page->current_msg_id != last_msg->message_id) {
 
@@ -323,10 +635,11 @@ llmp_message_t *llmp_alloc_next(llmp_page_t *page, llmp_message_t *last_msg,
   } else {
 
     ret = _llmp_next_msg_ptr(last_msg);
-    ret->message_id = last_msg->message_id + 1;
 
   }
 
+  /* Ids start at 1 on each page, as current_msg_id is initialized with 0 */
+  ret->message_id = page->current_msg_id + 1;
   ret->buf_len = buf_len;
 
   /* Maybe catch some bugs... */
@@ -358,14 +671,35 @@ bool llmp_send(llmp_page_t *page, llmp_message_t *msg) {
   MEM_BARRIER();
   page->current_msg_id = msg->message_id;
   MEM_BARRIER();
+  /* Only costs a syscall if a receiver sleeps in llmp_client_recv_blocking */
+  llmp_doorbell_ring(&page->new_msg_doorbell);
   return true;
 
 }
 
-static inline afl_shmem_t *_llmp_broker_current_broadcast_map(
-    llmp_broker_state_t *broker_state) {
+static inline afl_shmem_t *_llmp_lane_current_map(llmp_broker_lane_t *lane) {
+
+  return &lane->broadcast_maps[lane->broadcast_map_count - 1];
+
+}
+
+/* The first page of lane 0, with the doorbells and the lane infos */
+static inline llmp_page_t *llmp_broker_first_page(llmp_broker_state_t *broker) {
+
+  return shmem2page(&broker->lanes[0].broadcast_maps[0]);
+
+}
+
+/* Creates a new shared map that goes away with the last process using it */
+static u8 *llmp_shmem_init(afl_shmem_t *shm, size_t size) {
 
-  return &broker_state->broadcast_maps[broker_state->broadcast_map_count - 1];
+  if (!afl_shmem_init(shm, size)) { return NULL; }
+#if defined(__linux__) && !defined(USEMMAP) && !defined(USEMEMFD)
+  /* Linux still lets others attach to it, but the map goes away with the last
+   * process using it, even if we crash. */
+  shmctl(shm->shm_id, IPC_RMID, NULL);
+#endif
+  return shm->map;
 
 }
 
@@ -375,19 +709,131 @@ llmp_page_t *llmp_new_page_shmem(afl_shmem_t *uninited_afl_shmem, size_t sender,
                                  size_t size_requested) {
 
   size_t size = next_pow2(MAX(size_requested, (size_t)LLMP_INITIAL_MAP_SIZE));
-  if (!afl_shmem_init(uninited_afl_shmem, size)) { return NULL; }
+  if (!llmp_shmem_init(uninited_afl_shmem, size)) { return NULL; }
   _llmp_page_init(shmem2page(uninited_afl_shmem), sender, size_requested);
   return shmem2page(uninited_afl_shmem);
 
 }
 
-/* This function handles EOP by creating a new shared page and informing the
-  listener about it using a EOP message. */
+/* Adds a map to the pool. If the pool is full, the oldest map in it gets
+ * destroyed (if we own it) or unmapped. */
+static void llmp_pool_put(llmp_page_pool_t *pool, afl_shmem_t *map,
+                          bool owner) {
+
+  if (pool->count == LLMP_PAGE_POOL_SIZE) {
+
+    if (owner) {
+
+      afl_shmem_deinit(&pool->maps[0]);
+
+    } else {
+
+      afl_shmem_unmap(&pool->maps[0]);
+
+    }
+
+    memmove(pool->maps, pool->maps + 1,
+            (LLMP_PAGE_POOL_SIZE - 1) * sizeof(afl_shmem_t));
+    pool->count--;
+
+  }
+
+  memcpy(&pool->maps[pool->count], map, sizeof(afl_shmem_t));
+  pool->count++;
+
+}
+
+/* Moves the pooled map i to out */
+static void llmp_pool_take(llmp_page_pool_t *pool, size_t i,
+                           afl_shmem_t *out) {
+
+  memcpy(out, &pool->maps[i], sizeof(afl_shmem_t));
+  memmove(&pool->maps[i], &pool->maps[i + 1],
+          (pool->count - i - 1) * sizeof(afl_shmem_t));
+  pool->count--;
+
+}
+
+/* Takes a map of at least map_size bytes out of the pool. */
+static bool llmp_pool_take_size(llmp_page_pool_t *pool, size_t map_size,
+                                afl_shmem_t *out) {
+
+  size_t i;
+  for (i = 0; i < pool->count; i++) {
+
+    if (pool->maps[i].map_size >= map_size) {
+
+      llmp_pool_take(pool, i, out);
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Takes the map with the given shm_str out of the pool. */
+static bool llmp_pool_take_str(llmp_page_pool_t *pool, char *shm_str,
+                               afl_shmem_t *out) {
+
+  size_t i;
+  for (i = 0; i < pool->count; i++) {
+
+    if (!strncmp(pool->maps[i].shm_str, shm_str, AFL_SHMEM_STRLEN_MAX)) {
+
+      llmp_pool_take(pool, i, out);
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Like afl_shmem_by_str, but reuses a pooled map, if we still have it */
+static u8 *llmp_pool_map_by_str(llmp_page_pool_t *pool, afl_shmem_t *shm,
+                                char *shm_str, size_t map_size) {
+
+  if (llmp_pool_take_str(pool, shm_str, shm)) { return shm->map; }
+  return afl_shmem_by_str(shm, shm_str, map_size);
+
+}
+
+/* Destroys (if we own them) or unmaps all maps in the pool */
+static void llmp_pool_clear(llmp_page_pool_t *pool, bool owner) {
+
+  size_t i;
+  for (i = 0; i < pool->count; i++) {
+
+    if (owner) {
+
+      afl_shmem_deinit(&pool->maps[i]);
+
+    } else {
+
+      afl_shmem_unmap(&pool->maps[i]);
+
+    }
+
+  }
+
+  pool->count = 0;
+
+}
+
+/* This function handles EOP by creating a new shared page (or reusing one from
+  the pool) and informing the listener about it using a EOP message. */
 static afl_ret_t llmp_handle_out_eop(afl_shmem_t **maps_p, size_t *map_count_p,
-                                     llmp_message_t **last_msg_p) {
+                                     llmp_message_t ** last_msg_p,
+                                     llmp_page_pool_t *pool) {
 
   u32          map_count = *map_count_p;
-  llmp_page_t *old_map = shmem2page(maps_p[map_count - 1]);
+  llmp_page_t *old_map = shmem2page(&(*maps_p)[map_count - 1]);
+  u32          i;
 
   if (!afl_realloc((void **)maps_p, (map_count + 1) * sizeof(afl_shmem_t))) {
 
@@ -397,9 +843,20 @@ static afl_ret_t llmp_handle_out_eop(afl_shmem_t **maps_p, size_t *map_count_p,
   }
 
   /* Broadcast a new, large enough, message. Also sorry for that c ptr stuff! */
-  llmp_page_t *new_map =
-      llmp_new_page_shmem(&(*maps_p)[map_count], old_map->sender,
-                          new_map_size(old_map->max_alloc_size));
+  size_t       size = new_map_size(old_map->max_alloc_size);
+  llmp_page_t *new_map;
+  if (llmp_pool_take_size(pool, size, &(*maps_p)[map_count])) {
+
+    /* Nobody reads from it anymore, no syscall needed. */
+    new_map = shmem2page(&(*maps_p)[map_count]);
+    _llmp_page_init(new_map, old_map->sender, size);
+
+  } else {
+
+    new_map = llmp_new_page_shmem(&(*maps_p)[map_count], old_map->sender, size);
+
+  }
+
   if (!new_map) {
 
     DBG("Unable to initialize new broker page");
@@ -409,8 +866,24 @@ static afl_ret_t llmp_handle_out_eop(afl_shmem_t **maps_p, size_t *map_count_p,
 
   *map_count_p = *map_count_p + 1;
 
-  new_map->current_msg_id = old_map->current_msg_id;
+  /* Message ids start over on the new page. */
+  new_map->generation = old_map->generation + 1;
   new_map->max_alloc_size = old_map->max_alloc_size;
+  new_map->msgs_recvd = old_map->msgs_recvd;
+  new_map->bytes_recvd = old_map->bytes_recvd;
+  new_map->flow_grows = old_map->flow_grows;
+  new_map->flow_stalls = old_map->flow_stalls;
+  new_map->flow_drops = old_map->flow_drops;
+  for (i = 0; i < LLMP_LANE_COUNT; i++) {
+
+    new_map->watermarks[i] = old_map->watermarks[i];
+    new_map->recv_generations[i] = old_map->recv_generations[i];
+    new_map->recv_msg_ids[i] = old_map->recv_msg_ids[i];
+
+  }
+
+  memcpy(&new_map->priority_map, &old_map->priority_map,
+         sizeof(llmp_lane_info_t));
 
   /* On the old map, place a last message linking to the new map for the clients
    * to consume */
@@ -440,316 +913,264 @@ static afl_ret_t llmp_handle_out_eop(afl_shmem_t **maps_p, size_t *map_count_p,
 
 }
 
-/* no more space left! We'll have to start a new page */
-afl_ret_t llmp_broker_handle_out_eop(llmp_broker_state_t *broker) {
+/* Points the EOP of the first broadcast page of the lane to the given page, so
+ * that new clients continue there. */
+static void llmp_broker_relink_first_page(llmp_broker_lane_t *lane,
+                                          afl_shmem_t *       target) {
+
+  llmp_page_t *first_page = shmem2page(&lane->broadcast_maps[0]);
+
+  /* Nothing got allocated after the EOP */
+  llmp_message_t *eop =
+      (llmp_message_t *)((u8 *)first_page + first_page->size_used -
+                         LLMP_MSG_END_OF_PAGE_LEN);
+  if (eop->tag != LLMP_TAG_END_OF_PAGE_V1) {
+
+    FATAL("BUG: No EOP at the end of the first broadcast page");
 
-  DBG("Broadcasting broker EOP");
-  return (llmp_handle_out_eop(&broker->broadcast_maps,
-                              &broker->broadcast_map_count,
-                              &broker->last_msg_sent) != AFL_RET_SUCCESS);
+  }
+
+  llmp_payload_new_page_t *pageinfo = (llmp_payload_new_page_t *)eop->buf;
+
+  /* Readers retry while link_seq is odd or changed, see
+   * llmp_copy_eop_pageinfo */
+  __atomic_fetch_add(&first_page->link_seq, 1, __ATOMIC_SEQ_CST);
+  pageinfo->map_size = target->map_size;
+  memcpy(pageinfo->shm_str, target->shm_str, AFL_SHMEM_STRLEN_MAX);
+  __atomic_fetch_add(&first_page->link_seq, 1, __ATOMIC_SEQ_CST);
 
 }
 
-llmp_message_t *llmp_broker_alloc_next(llmp_broker_state_t *broker,
-                                       size_t               len) {
+/* If the worker has jobs left to run */
+static bool llmp_hook_worker_has_jobs(void *data) {
 
-  llmp_page_t *broadcast_page =
-      shmem2page(_llmp_broker_current_broadcast_map(broker));
+  llmp_hook_worker_t *worker = (llmp_hook_worker_t *)data;
+  return __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) != worker->tail ||
+         __atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE);
 
-  llmp_message_t *out =
-      llmp_alloc_next(broadcast_page, broker->last_msg_sent, len);
+}
 
-  if (!out) {
+/* Runs the async hook jobs the broker queues for us */
+static void *llmp_hook_worker_loop(void *data) {
 
-    /* no more space left! We'll have to start a new page */
-    afl_ret_t ret = llmp_broker_handle_out_eop(broker);
-    if (ret != AFL_RET_SUCCESS) { FATAL("%s", afl_ret_stringify(ret)); }
+  llmp_hook_worker_t *worker = (llmp_hook_worker_t *)data;
 
-    /* llmp_handle_out_eop allocates a new current broadcast_map */
-    broadcast_page = shmem2page(_llmp_broker_current_broadcast_map(broker));
+  while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
 
-    /* the alloc is now on a new page */
-    out = llmp_alloc_next(broadcast_page, broker->last_msg_sent, len);
-    if (!out) {
+    u64 tail = worker->tail;
+    if (tail == __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE)) {
 
-      FATAL("Error allocating %ld bytes in shmap %s", len,
-            _llmp_broker_current_broadcast_map(broker)->shm_str);
+      llmp_doorbell_wait(&worker->doorbell, llmp_hook_worker_has_jobs, worker);
+      continue;
 
     }
 
+    llmp_hook_job_t *job = &worker->jobs[tail & (LLMP_HOOK_RING_SIZE - 1)];
+    bool forward = (*job->func)(worker->broker, job->msg, job->data);
+
+    u32 verdict = forward ? LLMP_HOOK_FORWARD : LLMP_HOOK_DROP;
+    __atomic_store_n(&job->verdict, verdict, __ATOMIC_RELEASE);
+    /* From here on, the broker may release the msg */
+    __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_RELEASE);
+
   }
 
-  return out;
+  return NULL;
 
 }
 
-/* Registers a new client for the given sharedmap str and size.
-  Be careful: Intenral realloc may change the location of the client map */
-static llmp_broker_client_metadata_t *llmp_broker_register_client(
-    llmp_broker_state_t *broker, char *shm_str, size_t map_size) {
+/* Waits for the async hooks to finish all jobs. Call this before unmapping
+ * (or handing back) anything queued msgs may point into. */
+static void llmp_broker_drain_hooks(llmp_broker_state_t *broker) {
 
-  /* make space for a new client and calculate its id */
-  if (!afl_realloc((void **)&broker->llmp_clients,
-                   (broker->llmp_client_count + 1) *
-                       sizeof(llmp_broker_client_metadata_t))) {
+  u32 i;
 
-    return NULL;
+  if (likely(!broker->hook_workers)) { return; }
 
-  }
+  for (i = 0; i < LLMP_HOOK_WORKERS; i++) {
 
-  llmp_broker_client_metadata_t *client =
-      &broker->llmp_clients[broker->llmp_client_count];
-  memset(client, 0, sizeof(llmp_broker_client_metadata_t));
+    llmp_hook_worker_t *worker = &broker->hook_workers[i];
+    while (__atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE) != worker->head) {
 
-  client->client_state = calloc(1, sizeof(llmp_client_state_t));
-  if (!client->client_state) { return NULL; }
+      llmp_doorbell_ring(&worker->doorbell);
+      sched_yield();
 
-  client->client_state->id = broker->llmp_client_count;
+    }
 
-  client->cur_client_map = calloc(1, sizeof(afl_shmem_t));
-  if (!client->cur_client_map) {
+  }
 
-    DBG("Could not allocate mem for client map");
-    return NULL;
-
-  }
-
-  if (!afl_shmem_by_str(client->cur_client_map, shm_str, map_size)) {
-
-    DBG("Could not map shmem '%s'", shm_str);
-    return NULL;
-
-  }
+}
 
-#ifdef LLMP_DEBUG
-  size_t i;
-  for (i = 0; i < broker->llmp_client_count; i++) {
+/* Queues a msg for an async hook, waiting for room if the ring is full.
+ * Returns the job, so the broker can wait for the verdict. */
+static llmp_hook_job_t *llmp_broker_queue_hook_job(llmp_broker_state_t *broker,
+                                                   llmp_async_hook_t *  hook,
+                                                   llmp_message_t *     msg) {
 
-    u32 actual_id = broker->llmp_clients[i].client_state->id;
-    if (i != actual_id) {
+  llmp_hook_worker_t *worker =
+      &broker->hook_workers[broker->next_hook_worker++ % LLMP_HOOK_WORKERS];
+  u64 head = worker->head;
 
-      FATAL("Inconsistent client state detected: id is %d but should be %ld",
-            actual_id, i);
+  while (head - __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE) >=
+         LLMP_HOOK_RING_SIZE) {
 
-    }
+    llmp_doorbell_ring(&worker->doorbell);
+    sched_yield();
 
   }
 
-#endif
-
-  broker->llmp_client_count++;
-
-  // tODO: Add client map
+  llmp_hook_job_t *job = &worker->jobs[head & (LLMP_HOOK_RING_SIZE - 1)];
+  job->func = hook->func;
+  job->data = hook->data;
+  job->msg = msg;
+  job->verdict = LLMP_HOOK_PENDING;
 
-  DBG("Added clientprocess with id %d", client->client_state->id);
+  __atomic_store_n(&worker->head, head + 1, __ATOMIC_RELEASE);
+  llmp_doorbell_ring(&worker->doorbell);
 
-  return client;
+  return job;
 
 }
 
-/* broker broadcast to its own page for all others to read */
-static inline void llmp_broker_handle_new_msgs(llmp_broker_state_t *          broker,
-                                        llmp_broker_client_metadata_t *client) {
-
-  // TODO: We could memcpy a range of pending messages, instead of one by one.
-
-  llmp_page_t *incoming = shmem2page(client->cur_client_map);
-  u32          current_message_id = client->last_msg_broker_read
-                                        ? client->last_msg_broker_read->message_id
-                                        : 0;
-  while (current_message_id != incoming->current_msg_id) {
+/* Hands the msg to all async hooks, then waits for the verdicts as long as the
+ * hooks allow. Returns false if one of them dropped the msg in time. */
+static bool llmp_broker_call_async_hooks(llmp_broker_state_t *broker,
+                                         llmp_message_t *     msg) {
 
-    llmp_message_t *msg = llmp_recv(incoming, client->last_msg_broker_read);
+  llmp_hook_job_t *jobs[LLMP_ASYNC_HOOKS_MAX] = {0};
+  bool             forward_msg = true;
+  size_t           pending = 0;
+  size_t           i;
 
-    DBG("Our current_message_id for client %d (at ptr %p) is %d%s, now "
-        "processing msg id "
-        "%d with tag 0x%X",
-        client->client_state->id, client, current_message_id,
-        client->last_msg_broker_read ? "" : " (last msg was NULL)",
-        msg->message_id, msg->tag);
+  for (i = 0; i < broker->async_hook_count; i++) {
 
-    if (!msg) {
+    llmp_hook_job_t *job =
+        llmp_broker_queue_hook_job(broker, &broker->async_hooks[i], msg);
+    if (broker->async_hooks[i].verdict_us) {
 
-      FATAL(
-          "No message received but not all message ids receved! Data out of "
-          "sync?");
+      jobs[i] = job;
+      pending++;
 
     }
 
-    if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
-
-      llmp_payload_new_page_t *pageinfo =
-          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
-
-        FATAL("Illegal message length for EOP (is %ld, expected %ld)",
-              msg->buf_len, sizeof(llmp_payload_new_page_t));
-
-      }
-
-      DBG("Got EOP from client %d. Mapping new map.", client->client_state->id);
-
-      /* We can reuse the map mem space, no need to free and calloc.
-      However, the pageinfo points to the map we're about to unmap.
-      Copy the contents first. */
-
-      llmp_payload_new_page_t pageinfo_cpy;
-      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
-
-      afl_shmem_t *client_map = client->cur_client_map;
-      shmem2page(client_map)->save_to_unmap = true;
-      afl_shmem_deinit(client_map);
+  }
 
-      if (!afl_shmem_by_str(client_map, pageinfo->shm_str,
-                            pageinfo->map_size)) {
+  u64 start_us = pending ? llmp_time_us() : 0;
 
-        FATAL("Could not get shmem by str for map %s of size %ld",
-              pageinfo->shm_str, pageinfo->map_size);
+  while (pending) {
 
-      }
+    u64 waited_us = llmp_time_us() - start_us;
 
-    } else if (msg->tag == LLMP_TAG_CLIENT_ADDED_V1) {
+    for (i = 0; i < broker->async_hook_count; i++) {
 
-      DBG("Will add a new client.");
+      if (!jobs[i]) { continue; }
 
-      /* This client informs us about yet another new client
-      add it to the list! Also, no need to forward this msg. */
-      llmp_payload_new_page_t *pageinfo =
-          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
+      u32 verdict = __atomic_load_n(&jobs[i]->verdict, __ATOMIC_ACQUIRE);
+      if (verdict == LLMP_HOOK_PENDING &&
+          waited_us < broker->async_hooks[i].verdict_us) {
 
-        WARNF(
-            "Ignoring broken CLIENT_ADDED msg due to incorrect size. "
-            "Expected %ld but got %ld",
-            sizeof(llmp_payload_new_page_t), msg->buf_len);
+        continue;
 
       }
 
-      /* register_client may realloc the clients, we need to find ours again */
-      u32 client_id = client->client_state->id;
-      if (!llmp_broker_register_client(broker, pageinfo->shm_str,
-                                       pageinfo->map_size)) {
+      if (verdict == LLMP_HOOK_PENDING) {
 
-        FATAL("Could not register clientprocess with shm_str %s",
-              pageinfo->shm_str);
+        DBG("Async hook %ld timed out, forwarding msg with tag 0x%X", i,
+            msg->tag);
+        llmp_stats_add(&llmp_broker_stats(broker)->hook_timeouts, 1);
 
       }
 
-      /* find client again */
-      client = &broker->llmp_clients[client_id];
-
-    } else {
-
-      bool   forward_msg = true;
-      size_t i;
-      for (i = 0; i < broker->msg_hook_count; i++) {
-
-        llmp_message_hook_data_t *msg_hook = &broker->msg_hooks[i];
-        forward_msg &= (*msg_hook->func)(broker, msg, msg_hook->data);
-
-      }
+      forward_msg &= verdict != LLMP_HOOK_DROP;
+      jobs[i] = NULL;
+      pending--;
 
-      if (likely(forward_msg)) {
+    }
 
-        DBG("Broadcasting msg with id %d, tag 0x%X", msg->message_id, msg->tag);
-        llmp_message_t *out = llmp_broker_alloc_next(broker, msg->buf_len);
+    if (pending) { sched_yield(); }
 
-        if (!out) {
+  }
 
-          FATAL("Error allocating %ld bytes in shmap %s", msg->buf_len,
-                _llmp_broker_current_broadcast_map(broker)->shm_str);
+  return forward_msg;
 
-        }
+}
 
-        /* Copy over the whole message.
-        If we should need zero copy, we could instead post a link to the
-        original msg with the map_id and offset. */
-        memcpy(out, msg, sizeof(llmp_message_t) + msg->buf_len);
+/* We're done with this client map: tell the client it may reuse it, but keep
+ * it mapped in case it does. */
+static void llmp_broker_pool_client_map(llmp_broker_state_t *broker,
+                                        afl_shmem_t *        client_map) {
 
-        /* We need to replace the message ID with our own */
-        llmp_page_t *out_page =
-            shmem2page(_llmp_broker_current_broadcast_map(broker));
+  /* Async hooks may still look at msgs on it */
+  llmp_broker_drain_hooks(broker);
 
-        out->message_id = out_page->current_msg_id + 1;
+  llmp_page_t *page = shmem2page(client_map);
 
-        if (!llmp_send(out_page, out)) { FATAL("Error sending msg"); }
+  page->save_to_unmap = true;
 
-        broker->last_msg_sent = out;
+  if (page->sender < broker->llmp_client_count) {
 
-      }
+    llmp_pool_put(&broker->llmp_clients[page->sender].map_pool, client_map,
+                  false);
 
-    }
+  } else {
 
-    client->last_msg_broker_read = msg;
-    current_message_id = msg->message_id;
+    afl_shmem_unmap(client_map);
 
   }
 
 }
 
-/* The broker walks all pages and looks for changes, then broadcasts them on
- * its own shared page, once. */
-inline void llmp_broker_once(llmp_broker_state_t *broker) {
+/* Frees the broadcast pages of the lane all clients read past. The first page
+ * is kept for new clients. */
+static void llmp_broker_gc_lane(llmp_broker_state_t *broker, u32 lane_id,
+                                u32 min_generation) {
 
-  u32 i;
-  MEM_BARRIER();
-  for (i = 0; i < broker->llmp_client_count; i++) {
+  llmp_broker_lane_t *lane = &broker->lanes[lane_id];
+  size_t              i;
 
-    llmp_broker_client_metadata_t *client = &broker->llmp_clients[i];
-    llmp_broker_handle_new_msgs(broker, client);
+  /* Never free the first, or the current page */
+  size_t freed = 0;
+  while (1 + freed < lane->broadcast_map_count - 1 &&
+         shmem2page(&lane->broadcast_maps[1 + freed])->generation <
+             min_generation) {
+
+    freed++;
 
   }
 
-}
+  if (!freed) { return; }
 
-/* The broker walks all pages and looks for changes, then broadcasts them on
- * its own shared page */
-void llmp_broker_loop(llmp_broker_state_t *broker) {
+  DBG("Freeing %ld broadcast pages of lane %d", freed, lane_id);
 
-  while (1) {
+  llmp_broker_relink_first_page(lane, &lane->broadcast_maps[1 + freed]);
 
-    MEM_BARRIER();
-    llmp_broker_once(broker);
+  for (i = 1; i <= freed; i++) {
 
-    /* 5 milis of sleep for now to not busywait at 100% */
-    usleep(5 * 1000);
+    llmp_pool_put(&broker->broadcast_pool, &lane->broadcast_maps[i], true);
 
   }
 
-}
-
-/* A wrapper around unpacking the data, calling through to the loop */
-static void *_llmp_client_wrapped_loop(void *llmp_client_broker_metadata_ptr) {
-
-  llmp_broker_client_metadata_t *metadata =
-      (llmp_broker_client_metadata_t *)llmp_client_broker_metadata_ptr;
-  metadata->clientloop(metadata->client_state, metadata->data);
-
-  WARNF("Client loop exited for client %d", metadata->client_state->id);
-  return NULL;
+  memmove(&lane->broadcast_maps[1], &lane->broadcast_maps[1 + freed],
+          (lane->broadcast_map_count - 1 - freed) * sizeof(afl_shmem_t));
+  lane->broadcast_map_count -= freed;
 
 }
 
-/* Kicks off all threaded clients in the brackground, using pthreads */
-bool llmp_broker_launch_clientloops(llmp_broker_state_t *broker) {
-
-  size_t i;
-
-  for (i = 0; i < broker->llmp_client_count; i++) {
+/* If no broadcast page still around references the retained map */
+static bool llmp_broker_retained_map_done(llmp_retained_map_t *retained,
+                                          u32 *min_generations) {
 
-    if (broker->llmp_clients[i].pthread != NULL) {
+  u32 lane_id;
 
-      /* Got a pthread -> threaded client. Spwan. :) */
-      int s =
-          pthread_create(broker->llmp_clients[i].pthread, NULL,
-                         _llmp_client_wrapped_loop, &broker->llmp_clients[i]);
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-      if (s) {
+    if (!(retained->lanes & LLMP_LANE_MASK(lane_id))) { continue; }
 
-        // TODO: Better Error-handling! :)
-        PFATAL("Error creating thread %ld", i);
+    /* Referenced from a first page, which never goes away */
+    if (!retained->broadcast_generations[lane_id] ||
+        retained->broadcast_generations[lane_id] >= min_generations[lane_id]) {
 
-      }
+      return false;
 
     }
 
@@ -759,604 +1180,4161 @@ bool llmp_broker_launch_clientloops(llmp_broker_state_t *broker) {
 
 }
 
-/* Start all threads and the main broker. Never returns. */
-void llmp_broker_run(llmp_broker_state_t *broker) {
+/* If the process of the client page is gone. Threaded clients are never. */
+static bool llmp_broker_client_dead(llmp_page_t *client_page) {
 
-  llmp_broker_launch_clientloops(broker);
-  llmp_broker_loop(broker);
+  return client_page->pid > 0 && client_page->pid != getpid() &&
+         kill(client_page->pid, 0) == -1 && errno == ESRCH;
 
 }
 
-/* We don't have any space. Send eop, the reset to beginning of ringbuf */
-static bool llmp_client_handle_out_eop(llmp_client_state_t *client) {
-
-  DBG("Sending client EOP for client %d", client->id);
+/* Frees the broadcast pages all clients read past, and the client maps only
+these pages referenced (zero copy). The first page of each lane is kept for new
+clients, including the client maps it references. Dead clients, and clients
+more than gc_max_lag pages behind, don't count. */
+static void llmp_broker_gc(llmp_broker_state_t *broker) {
+
+  u32    cur_generations[LLMP_LANE_COUNT];
+  u32    min_generations[LLMP_LANE_COUNT];
+  u32    dead_clients = 0;
+  u32    lagging_clients = 0;
+  u32    lane_id;
+  size_t i;
 
-  if (llmp_handle_out_eop(&client->out_maps, &client->out_map_count,
-                          &client->last_msg_sent) != AFL_RET_SUCCESS) {
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-    DBG("An error occurred when handling client eop");
-    return false;
+    cur_generations[lane_id] =
+        shmem2page(_llmp_lane_current_map(&broker->lanes[lane_id]))
+            ->generation;
+    min_generations[lane_id] = cur_generations[lane_id];
 
   }
 
-  u8 *current_map = client->out_maps[client->out_map_count - 1].map;
+  for (i = 0; i < broker->llmp_client_count; i++) {
 
-  /* This is a good time to see if we can unallocate older pages.
-  The broker would have informed us by setting the flag
-  */
-  while (client->out_maps[0].map != current_map &&
-         shmem2page(&client->out_maps[0])->save_to_unmap) {
+    llmp_page_t *client_page =
+        shmem2page(broker->llmp_clients[i].cur_client_map);
+    bool lagging = false;
 
-    /* This page is save to unmap. The broker already reads or read it. */
+    if (llmp_broker_client_dead(client_page)) {
 
-    DBG("Unmap shared map %s from client", client->out_maps[0].shm_str);
-    memmove(client->out_maps, client->out_maps + 1,
-            (client->out_map_count - 1) * sizeof(afl_shmem_t));
+      dead_clients++;
+      continue;
 
-  }
+    }
 
-  return true;
+    for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-}
+      u32 watermark = client_page->watermarks[lane_id];
 
-/* A client receives a broadcast message. Returns null if no message is
- * availiable */
-llmp_message_t *llmp_client_recv(llmp_client_state_t *client) {
+      if (broker->gc_max_lag && watermark != LLMP_WATERMARK_NO_RECV &&
+          cur_generations[lane_id] - watermark > broker->gc_max_lag) {
 
-  llmp_message_t *msg = NULL;
+        lagging = true;
+        continue;
 
-  while (1) {
+      }
 
-    msg = llmp_recv(shmem2page(client->current_broadcast_map),
-                    client->last_msg_recvd);
-    if (!msg) { return NULL; }
+      min_generations[lane_id] = MIN(min_generations[lane_id], watermark);
 
-    client->last_msg_recvd = msg;
-    if (msg->tag == LLMP_TAG_UNALLOCATED_V1) {
+    }
 
-      FATAL("BUG: Read unallocated msg");
+    if (lagging) { lagging_clients++; }
 
-    } else if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+  }
 
-      /* we reached the end of the current page.
-      We'll init a new page but can reuse the mem are of the current map.
-      However, we cannot use the message if we deinit its page, so let's copy */
-      llmp_payload_new_page_t pageinfo_cpy;
-      afl_shmem_t *           broadcast_map = client->current_broadcast_map;
+  __atomic_store_n(&llmp_broker_stats(broker)->gc_dead_clients, dead_clients,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&llmp_broker_stats(broker)->gc_lagging_clients,
+                   lagging_clients, __ATOMIC_RELAXED);
 
-      llmp_payload_new_page_t *pageinfo =
-          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
+  i = 0;
+  while (i < broker->retained_map_count) {
 
-        FATAL("Illegal message length for EOP (is %ld, expected %ld)",
-              msg->buf_len, sizeof(llmp_payload_new_page_t));
+    llmp_retained_map_t *retained = &broker->retained_maps[i];
+    if (!llmp_broker_retained_map_done(retained, min_generations)) {
 
-      }
+      i++;
+      continue;
 
-      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+    }
 
-      DBG("Got EOP from broker. Mapping new map.");
+    llmp_broker_pool_client_map(broker, &retained->map);
+    memmove(retained, retained + 1,
+            (broker->retained_map_count - i - 1) * sizeof(llmp_retained_map_t));
+    broker->retained_map_count--;
 
-      /* Never read by broker broker: shmem2page(map)->save_to_unmap = true; */
-      afl_shmem_deinit(broadcast_map);
+  }
 
-      if (!afl_shmem_by_str(client->current_broadcast_map, pageinfo->shm_str,
-                            pageinfo->map_size)) {
+  i = 0;
+  while (i < broker->oob_segment_count) {
 
-        FATAL("Could not get shmem by str for map %s of size %ld",
-              pageinfo->shm_str, pageinfo->map_size);
+    llmp_retained_map_t *segment = &broker->oob_segments[i];
+    if (!llmp_broker_retained_map_done(segment, min_generations)) {
 
-      }
+      i++;
+      continue;
 
-    } else {
+    }
 
-      return msg;
+    llmp_broker_drain_hooks(broker);
+    llmp_oob_release(&segment->map);
+    memmove(segment, segment + 1,
+            (broker->oob_segment_count - i - 1) * sizeof(llmp_retained_map_t));
+    broker->oob_segment_count--;
 
-    }
+  }
+
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    llmp_broker_gc_lane(broker, lane_id, min_generations[lane_id]);
 
   }
 
 }
 
-/* A client blocks/spins until the next message gets posted to the page,
-  then returns that message. */
-llmp_message_t *llmp_client_recv_blocking(llmp_client_state_t *client) {
-
-  llmp_page_t *page = shmem2page(client->current_broadcast_map);
+/* no more space left! We'll have to start a new page */
+afl_ret_t llmp_broker_handle_out_eop(llmp_broker_state_t *broker,
+                                     u32                  lane_id) {
 
-  while (1) {
+  llmp_broker_lane_t *lane = &broker->lanes[lane_id];
 
-    MEM_BARRIER();
-    /* busy-wait for a new msg_id to show up in the page */
-    if (page->current_msg_id !=
-        (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0)) {
+  DBG("Broadcasting broker EOP on lane %d", lane_id);
+  afl_ret_t ret =
+      llmp_handle_out_eop(&lane->broadcast_maps, &lane->broadcast_map_count,
+                          &lane->last_msg_sent, &broker->broadcast_pool);
+  if (ret != AFL_RET_SUCCESS) { return ret; }
 
-      DBG("Blocking read got new page->current_msg_id %ld (last msg id was %d)",
-          page->current_msg_id,
-          (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0));
+  llmp_stats_add(&llmp_broker_stats(broker)->eops, 1);
 
-      llmp_message_t *ret = llmp_client_recv(client);
-      if (ret) {
+  /* A good time to get rid of pages all clients are done with */
+  llmp_broker_gc(broker);
+  return AFL_RET_SUCCESS;
 
-        DBG("blocking got new msg %d", ret->message_id);
-        return ret;
+}
 
-      }
+llmp_message_t *llmp_broker_alloc_next(llmp_broker_state_t *broker,
+                                       u32 lane_id, size_t len) {
 
-#ifdef LLMP_DEBUG
-      if (client->last_msg_recvd != NULL &&
-          client->last_msg_recvd->tag == LLMP_TAG_END_OF_PAGE_V1) {
+  llmp_broker_lane_t *lane = &broker->lanes[lane_id];
+  llmp_page_t *       broadcast_page = shmem2page(_llmp_lane_current_map(lane));
 
-        FATAL("BUG: client recv returned null unexpectedly");
+  llmp_message_t *out =
+      llmp_alloc_next(broadcast_page, lane->last_msg_sent, len);
 
-      }
+  if (!out) {
 
-#endif
-      /* The current page could have changed in recv (EOP) */
-      page = shmem2page(client->current_broadcast_map);
-      /* last msg will exist, even if EOP was handled internally */
+    /* no more space left! We'll have to start a new page */
+    afl_ret_t ret = llmp_broker_handle_out_eop(broker, lane_id);
+    if (ret != AFL_RET_SUCCESS) { FATAL("%s", afl_ret_stringify(ret)); }
 
-    }
+    /* llmp_handle_out_eop allocates a new current broadcast_map */
+    broadcast_page = shmem2page(_llmp_lane_current_map(lane));
 
-  }
+    /* the alloc is now on a new page */
+    out = llmp_alloc_next(broadcast_page, lane->last_msg_sent, len);
+    if (!out) {
 
-  llmp_message_t *msg = llmp_recv_blocking(
-      shmem2page(client->current_broadcast_map), client->last_msg_recvd);
-  if (msg->tag == LLMP_TAG_UNALLOCATED_V1) {
+      FATAL("Error allocating %ld bytes in shmap %s", len,
+            _llmp_lane_current_map(lane)->shm_str);
 
-    FATAL("BUG: Read unallocated msg");
+    }
 
   }
 
-  client->last_msg_recvd = msg;
-  return msg;
+  return out;
 
 }
 
-/* Alloc the next message, internally resetting the ringbuf if full */
-llmp_message_t *llmp_client_alloc_next(llmp_client_state_t *client,
-                                       size_t               size) {
+/* Publishes a msg on a broadcast lane */
+static inline void llmp_broker_send(llmp_broker_state_t *broker, u32 lane_id,
+                                    llmp_message_t *msg) {
 
-  llmp_message_t *msg;
+  llmp_broker_lane_t *lane = &broker->lanes[lane_id];
 
-  msg =
-      llmp_alloc_next(shmem2page(&client->out_maps[client->out_map_count - 1]),
-                      client->last_msg_sent, size);
+  if (!llmp_send(shmem2page(_llmp_lane_current_map(lane)), msg)) {
 
-  if (!msg) {
+    FATAL("Error sending msg");
 
-    /* Page is full -> Tell broker and start from the beginning.
-    Also, pray the broker got all messaes we're overwriting. :) */
-    if (!llmp_client_handle_out_eop(client)) {
+  }
 
-      DBG("BUG: Error sending EOP");
-      return NULL;
+  lane->last_msg_sent = msg;
 
-    }
+  /* For clients waiting on more than one lane */
+  llmp_doorbell_ring(&llmp_broker_first_page(broker)->lanes_doorbell);
 
-    /* The client_out_map will have been changed by llmp_handle_out_eop. Don't
-     * alias.
-     */
-    msg = llmp_alloc_next(
-        shmem2page(&client->out_maps[client->out_map_count - 1]),
-        client->last_msg_sent, sizeof(u32));
-    if (!msg) {
+}
 
-      DBG("BUG: Something went wrong allocating a msg in the shmap");
-      return NULL;
+/* The lane msgs with this tag get broadcast on */
+static inline u32 llmp_broker_lane_of(llmp_broker_state_t *broker, u32 tag) {
 
-    }
+  size_t i;
 
-  }
+  for (i = 0; i < broker->tag_route_count; i++) {
 
-  msg->sender = client->id;
-  msg->message_id =
-      client->last_msg_sent ? client->last_msg_sent->message_id + 1 : 1;
+    if (broker->tag_routes[i].tag == tag) { return broker->tag_routes[i].lane; }
 
-  return msg;
+  }
 
-}
+  return LLMP_LANE_DEFAULT;
 
-/* Commits a msg to the client's out ringbuf */
-bool llmp_client_send(llmp_client_state_t *client_state, llmp_message_t *msg) {
+}
 
-  DBG("Client %d sends new msg with tag 0x%X and size %ld", client_state->id,
-      msg->tag, msg->buf_len);
+/* Closes the fd named by a "pid:fd" page str of a page passed to us */
+static void llmp_close_passed_fd(char *shm_str) {
 
-  llmp_page_t *page =
-      shmem2page(&client_state->out_maps[client_state->out_map_count - 1]);
+  int pid, fd;
 
-#ifdef LLMP_DEBUG
-  if (!llmp_msg_in_page(page, msg)) {
+  if (sscanf(shm_str, "%d:%d", &pid, &fd) == 2 && pid == getpid()) {
 
-    FATAL(
-        "BUG: Message to send not in correct page (%p not in %p with size %ld)",
-        msg, page, page->size_total);
+    close(fd);
 
   }
 
-#endif
+}
 
-  bool ret = llmp_send(page, msg);
-  client_state->last_msg_sent = msg;
-  return ret;
+/* Registers a new client for the given sharedmap str and size.
+  Be careful: Intenral realloc may change the location of the client map */
+static llmp_broker_client_metadata_t *llmp_broker_register_client(
+    llmp_broker_state_t *broker, char *shm_str, size_t map_size) {
+
+  /* make space for a new client and calculate its id */
+  if (!afl_realloc((void **)&broker->llmp_clients,
+                   (broker->llmp_client_count + 1) *
+                       sizeof(llmp_broker_client_metadata_t))) {
+
+    return NULL;
+
+  }
+
+  llmp_broker_client_metadata_t *client =
+      &broker->llmp_clients[broker->llmp_client_count];
+  memset(client, 0, sizeof(llmp_broker_client_metadata_t));
+
+  client->client_state = calloc(1, sizeof(llmp_client_state_t));
+  if (!client->client_state) { return NULL; }
+
+  client->client_state->id = broker->llmp_client_count;
+  client->client_state->lane_mask = LLMP_LANE_MASK_ALL;
+  client->client_state->flow_limit = LLMP_FLOW_DEFAULT_LIMIT;
+
+  client->cur_client_map = calloc(1, sizeof(afl_shmem_t));
+  if (!client->cur_client_map) {
+
+    DBG("Could not allocate mem for client map");
+    return NULL;
+
+  }
+
+  if (!afl_shmem_by_str(client->cur_client_map, shm_str, map_size)) {
+
+    DBG("Could not map shmem '%s'", shm_str);
+    return NULL;
+
+  }
+
+  if (!llmp_page_layout_ok(shmem2page(client->cur_client_map))) {
+
+    WARNF("Client map %s has llmp layout 0x%X, expected 0x%X", shm_str,
+          shmem2page(client->cur_client_map)->layout_version,
+          LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION);
+    afl_shmem_unmap(client->cur_client_map);
+    return NULL;
+
+  }
+
+#ifdef LLMP_DEBUG
+  size_t i;
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    u32 actual_id = broker->llmp_clients[i].client_state->id;
+    if (i != actual_id) {
+
+      FATAL("Inconsistent client state detected: id is %d but should be %ld",
+            actual_id, i);
+
+    }
+
+  }
+
+#endif
+
+  broker->llmp_client_count++;
+  __atomic_store_n(&llmp_broker_stats(broker)->client_count,
+                   broker->llmp_client_count, __ATOMIC_RELAXED);
+
+  // tODO: Add client map
+
+  DBG("Added clientprocess with id %d", client->client_state->id);
+
+  return client;
+
+}
+
+/* Zero copy: broadcast a reference to the msg in the client's page instead of
+ * its contents */
+static inline llmp_message_t *llmp_broker_forward_ref(
+    llmp_broker_state_t *broker, u32 lane_id,
+    llmp_broker_client_metadata_t *client, llmp_message_t *msg) {
+
+  llmp_message_t *out =
+      llmp_broker_alloc_next(broker, lane_id, sizeof(llmp_payload_msg_ref_t));
+
+  out->tag = LLMP_TAG_MSG_REF_V1;
+  out->sender = msg->sender;
+
+  afl_shmem_t *           client_map = client->cur_client_map;
+  llmp_payload_msg_ref_t *ref = (llmp_payload_msg_ref_t *)out->buf;
+
+  ref->generation = shmem2page(client_map)->generation;
+  ref->offset = (u8 *)msg - client_map->map;
+  ref->buf_len = msg->buf_len;
+  ref->map_size = client_map->map_size;
+  memcpy(ref->shm_str, client_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  /* The client map may no longer go away on EOP */
+  client->cur_client_map_lanes |= LLMP_LANE_MASK(lane_id);
+
+  return out;
+
+}
+
+/* The client is done with its current map. Unless broadcast messages still
+ * reference it, the map can go. */
+static void llmp_broker_release_client_map(
+    llmp_broker_state_t *broker, llmp_broker_client_metadata_t *client) {
+
+  afl_shmem_t *client_map = client->cur_client_map;
+  u32          lane_id;
+
+  if (!client->cur_client_map_lanes) {
+
+    llmp_broker_pool_client_map(broker, client_map);
+    return;
+
+  }
+
+  /* Clients may still read from this map (zero copy), keep it around for as
+  long as the broadcast page with the last reference to it. */
+  if (!afl_realloc((void **)&broker->retained_maps,
+                   (broker->retained_map_count + 1) *
+                       sizeof(llmp_retained_map_t))) {
+
+    FATAL("Could not allocate space to retain client map %s",
+          client_map->shm_str);
+
+  }
+
+  llmp_retained_map_t *retained =
+      &broker->retained_maps[broker->retained_map_count];
+  memcpy(&retained->map, client_map, sizeof(afl_shmem_t));
+  retained->lanes = client->cur_client_map_lanes;
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    retained->broadcast_generations[lane_id] =
+        shmem2page(_llmp_lane_current_map(&broker->lanes[lane_id]))
+            ->generation;
+
+  }
+
+  broker->retained_map_count++;
+
+  client->cur_client_map_lanes = 0;
+
+  /* Zero copy rarely fills broadcast pages, so check for old maps here, too */
+  llmp_broker_gc(broker);
+
+}
+
+/* A run of consecutive msgs from one client page, to be forwarded at once */
+typedef struct llmp_broker_span {
+
+  /* All msgs of a span go to the same lane */
+  u32             lane;
+  llmp_message_t *first;
+  u32             count;
+  /* From the start of first to the end of last */
+  size_t len;
+  /* The largest msg (incl. header) in the span */
+  size_t max_msg_size;
+
+} llmp_broker_span_t;
+
+/* If len more bytes still fit in the current broadcast page of the lane
+ * (leaving room for the EOP) */
+static inline bool llmp_broker_fits(llmp_broker_state_t *broker, u32 lane_id,
+                                    size_t len) {
+
+  llmp_page_t *page =
+      shmem2page(_llmp_lane_current_map(&broker->lanes[lane_id]));
+  return page->size_used + len + LLMP_MSG_END_OF_PAGE_LEN <= page->size_total;
+
+}
+
+/* Copies all msgs of the span to the broadcast page with a single memcpy,
+ * assigns them our own message ids and publishes them all at once. */
+static void llmp_broker_forward_span(llmp_broker_state_t *broker,
+                                     llmp_broker_span_t * span) {
+
+  if (!span->count) { return; }
+
+  llmp_broker_lane_t *lane = &broker->lanes[span->lane];
+  llmp_page_t *       page = shmem2page(_llmp_lane_current_map(lane));
+  size_t              max_alloc_size = page->max_alloc_size;
+
+  /* Allocate the whole span as one large msg. Only single msgs may not fit,
+   * in which case this opens a new page. */
+  llmp_message_t *out = llmp_broker_alloc_next(
+      broker, span->lane, span->len - sizeof(llmp_message_t));
+  page = shmem2page(_llmp_lane_current_map(lane));
+
+  /* Don't let the span size grow the following pages */
+  if (span->count > 1) {
+
+    page->max_alloc_size = MAX(max_alloc_size, span->max_msg_size);
+
+  }
+
+  u32 message_id = out->message_id;
+  memcpy(out, span->first, span->len);
+
+  llmp_message_t *msg = out;
+  u32             i;
+  for (i = 1; i < span->count; i++) {
+
+    msg->message_id = message_id++;
+    msg = _llmp_next_msg_ptr(msg);
+
+  }
+
+  msg->message_id = message_id;
+
+  /* Publishes all msgs of the span */
+  llmp_broker_send(broker, span->lane, msg);
+
+  span->count = 0;
+  span->len = 0;
+  span->max_msg_size = 0;
+
+}
+
+/* Follows the EOP of a client page: maps the page it points to (reusing the
+ * old mapping if the client reused the page) to map. */
+static void llmp_broker_map_next_client_page(
+    llmp_broker_client_metadata_t *client, afl_shmem_t *map,
+    llmp_payload_new_page_t *pageinfo, u32 generation) {
+
+  if (!llmp_pool_map_by_str(&client->map_pool, map, pageinfo->shm_str,
+                            pageinfo->map_size)) {
+
+    FATAL("Could not get shmem by str for map %s of size %ld",
+          pageinfo->shm_str, pageinfo->map_size);
+
+  }
+
+  if (shmem2page(map)->generation != generation + 1) {
+
+    FATAL("BUG: Map %s of client %d has generation %d, expected %d",
+          pageinfo->shm_str, client->client_state->id,
+          shmem2page(map)->generation, generation + 1);
+
+  }
+
+}
+
+/* Room for msgs in the journal */
+static inline size_t llmp_journal_capacity(llmp_journal_t *journal) {
+
+  return journal->size - sizeof(llmp_journal_header_t);
+
+}
+
+/* Maps the journal file at path. If writable, the file is created (or grown)
+ * to hold size bytes, and a fresh journal is started unless it holds one. */
+static afl_ret_t llmp_journal_map(llmp_journal_t *journal, char *path,
+                                  size_t size, bool writable) {
+
+  struct stat st;
+
+  memset(journal, 0, sizeof(llmp_journal_t));
+
+  journal->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+  if (journal->fd < 0) { return AFL_RET_FILE_OPEN_ERROR; }
+
+  if (fstat(journal->fd, &st)) {
+
+    close(journal->fd);
+    return AFL_RET_ERRNO;
+
+  }
+
+  /* Never cut off what's in there */
+  size = MAX(size, (size_t)st.st_size);
+  if (size < sizeof(llmp_journal_header_t)) {
+
+    close(journal->fd);
+    return AFL_RET_FILE_SIZE;
+
+  }
+
+  if (writable && (size_t)st.st_size < size && ftruncate(journal->fd, size)) {
+
+    close(journal->fd);
+    return AFL_RET_ERRNO;
+
+  }
+
+  void *map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, journal->fd, 0);
+  if (map == MAP_FAILED) {
+
+    close(journal->fd);
+    return AFL_RET_ERRNO;
+
+  }
+
+  journal->header = (llmp_journal_header_t *)map;
+  journal->size = size;
+  journal->writable = writable;
+
+  llmp_journal_header_t *header = journal->header;
+  if (header->layout_version == (LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION) &&
+      header->used <= llmp_journal_capacity(journal)) {
+
+    return AFL_RET_SUCCESS;
+
+  }
+
+  if (!writable) {
+
+    munmap(map, size);
+    close(journal->fd);
+    return AFL_RET_MALFORMED_MSG;
+
+  }
+
+  if (header->layout_version) {
+
+    WARNF("Journal %s has llmp layout 0x%X, expected 0x%X. Starting over.",
+          path, header->layout_version,
+          LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION);
+
+  }
+
+  header->layout_version = LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION;
+  header->used = 0;
+  header->msg_count = 0;
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Unmaps the journal, leaving the file as is */
+static void llmp_journal_unmap(llmp_journal_t *journal) {
+
+  munmap(journal->header, journal->size);
+  close(journal->fd);
+  journal->header = NULL;
+
+}
+
+/* Writes the journal to disk */
+static void llmp_journal_sync(llmp_journal_t *journal) {
+
+  size_t len = sizeof(llmp_journal_header_t) + journal->header->used;
+
+  if (msync(journal->header, len, MS_SYNC)) {
+
+    WARNF("Could not sync journal %s: %s", journal->path, strerror(errno));
+
+  }
+
+  journal->synced_us = llmp_time_us();
+
+}
+
+/* The journal is full: write its newer half to a new file, then rename that
+ * over the old one. Readers of the old one can keep reading it. */
+static void llmp_journal_compact(llmp_journal_t *journal) {
+
+  llmp_journal_header_t *header = journal->header;
+  llmp_journal_t         compacted;
+  char                   tmp_path[PATH_MAX];
+  size_t                 start = 0;
+  u64                    dropped = 0;
+
+  while (header->used - start > llmp_journal_capacity(journal) / 2) {
+
+    llmp_message_t *msg = (llmp_message_t *)(header->data + start);
+    start += LLMP_MSG_SIZE(msg->buf_len);
+    dropped++;
+
+  }
+
+  DBG("Compacting journal %s, dropping %llu msgs", journal->path, dropped);
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->path);
+  unlink(tmp_path);
+
+  afl_ret_t ret = llmp_journal_map(&compacted, tmp_path, journal->size, true);
+  if (ret != AFL_RET_SUCCESS) {
+
+    WARNF("Could not compact journal %s (%s), starting over", journal->path,
+          afl_ret_stringify(ret));
+    header->msg_count = 0;
+    __atomic_store_n(&header->used, 0, __ATOMIC_RELEASE);
+    return;
+
+  }
+
+  memcpy(compacted.header->data, header->data + start, header->used - start);
+  compacted.header->msg_count = header->msg_count - dropped;
+  compacted.header->used = header->used - start;
+  compacted.path = journal->path;
+  llmp_journal_sync(&compacted);
+
+  if (rename(tmp_path, journal->path)) {
+
+    FATAL("Could not rename journal %s to %s", tmp_path, journal->path);
+
+  }
+
+  llmp_journal_unmap(journal);
+  memcpy(journal, &compacted, sizeof(llmp_journal_t));
+
+}
+
+/* Adds a forwarded msg to the journal */
+static void llmp_journal_append(llmp_journal_t *journal, llmp_message_t *msg) {
+
+  size_t msg_size = LLMP_MSG_SIZE(msg->buf_len);
+
+  if (journal->header->used + msg_size > llmp_journal_capacity(journal)) {
+
+    if (msg_size > llmp_journal_capacity(journal) / 2) {
+
+      DBG("Msg with tag 0x%X too large for the journal", msg->tag);
+      return;
+
+    }
+
+    llmp_journal_compact(journal);
+
+  }
+
+  llmp_journal_header_t *header = journal->header;
+  memcpy(header->data + header->used, msg,
+         sizeof(llmp_message_t) + msg->buf_len);
+  header->msg_count++;
+  /* Readers only look at msgs before used */
+  __atomic_store_n(&header->used, header->used + msg_size, __ATOMIC_RELEASE);
+
+}
+
+/* If all msg hooks let the msg through */
+static inline bool llmp_broker_call_hooks(llmp_broker_state_t *broker,
+                                          llmp_message_t *     msg) {
+
+  bool   forward_msg = true;
+  size_t i;
+  for (i = 0; i < broker->msg_hook_count; i++) {
+
+    llmp_message_hook_data_t *msg_hook = &broker->msg_hooks[i];
+    forward_msg &= (*msg_hook->func)(broker, msg, msg_hook->data);
+
+  }
+
+  if (unlikely(broker->async_hook_count)) {
+
+    forward_msg &= llmp_broker_call_async_hooks(broker, msg);
+
+  }
+
+  /* All forwarded msgs pass here, the only place to catch them all */
+  if (unlikely(broker->journal) && forward_msg) {
+
+    llmp_journal_append(broker->journal, msg);
+
+  }
+
+  return forward_msg;
+
+}
+
+/* Adds what the broker read from a client to the stats page */
+static void llmp_broker_count_msgs(llmp_broker_state_t *broker, u32 sender_id,
+                                   u64 msgs_sent, u64 bytes_sent,
+                                   u64 hook_drops, u64 bytes_dropped,
+                                   u64 eops) {
+
+  if (!msgs_sent && !eops) { return; }
+
+  llmp_stats_page_t *  stats = llmp_broker_stats(broker);
+  llmp_client_stats_t *client_stats =
+      llmp_broker_client_stats(broker, sender_id);
+  if (client_stats) {
+
+    llmp_stats_add(&client_stats->msgs_sent, msgs_sent);
+    llmp_stats_add(&client_stats->bytes_sent, bytes_sent);
+    llmp_stats_add(&client_stats->hook_drops, hook_drops);
+    llmp_stats_add(&client_stats->eops, eops);
+
+  }
+
+  llmp_stats_add(&stats->msgs_broadcast, msgs_sent - hook_drops);
+  llmp_stats_add(&stats->bytes_broadcast, bytes_sent - bytes_dropped);
+
+}
+
+/* Out of band: runs the hooks on the msg in the segment, then broadcasts the
+descriptor on the lane of the msg, or on LLMP_LANE_PRIORITY. The broker holds
+the segment until the broadcast page with the descriptor is gone. Returns false
+if a hook dropped the msg. Either way, buf_len is set to its payload length. */
+static bool llmp_broker_forward_oob(llmp_broker_state_t *broker,
+                                    llmp_message_t *desc, bool priority,
+                                    size_t *buf_len) {
+
+  afl_shmem_t     seg_map = {0};
+  llmp_message_t *msg = llmp_oob_map(&seg_map, desc, false);
+
+  *buf_len = msg->buf_len;
+
+  if (!llmp_broker_call_hooks(broker, msg)) {
+
+    llmp_broker_drain_hooks(broker);
+    llmp_oob_release(&seg_map);
+    return false;
+
+  }
+
+  u32 lane_id =
+      priority ? LLMP_LANE_PRIORITY : llmp_broker_lane_of(broker, msg->tag);
+
+  DBG("Broadcasting out of band msg %s with tag 0x%X on lane %d",
+      seg_map.shm_str, msg->tag, lane_id);
+
+  if (!afl_realloc((void **)&broker->oob_segments,
+                   (broker->oob_segment_count + 1) *
+                       sizeof(llmp_retained_map_t))) {
+
+    FATAL("Could not allocate space to hold out of band segment %s",
+          seg_map.shm_str);
+
+  }
+
+  llmp_message_t *out = llmp_broker_alloc_next(broker, lane_id, desc->buf_len);
+  out->tag = desc->tag;
+  out->sender = desc->sender;
+  memcpy(out->buf, desc->buf, desc->buf_len);
+  llmp_broker_send(broker, lane_id, out);
+
+  /* The page we just sent on is the last to reference the segment */
+  llmp_retained_map_t *segment =
+      &broker->oob_segments[broker->oob_segment_count];
+  memset(segment, 0, sizeof(llmp_retained_map_t));
+  memcpy(&segment->map, &seg_map, sizeof(afl_shmem_t));
+  segment->lanes = LLMP_LANE_MASK(lane_id);
+  segment->broadcast_generations[lane_id] =
+      shmem2page(_llmp_lane_current_map(&broker->lanes[lane_id]))->generation;
+  broker->oob_segment_count++;
+
+  return true;
+
+}
+
+/* Maps the priority out map the client announced, if it did. Returns false
+ * while it has none. */
+static bool llmp_broker_map_priority(llmp_broker_client_metadata_t *client) {
+
+  if (client->cur_priority_map.map) { return true; }
+
+  llmp_lane_info_t *info = &shmem2page(client->cur_client_map)->priority_map;
+  size_t map_size = __atomic_load_n(&info->map_size, __ATOMIC_ACQUIRE);
+  if (!map_size) { return false; }
+
+  if (!afl_shmem_by_str(&client->cur_priority_map, info->shm_str, map_size)) {
+
+    FATAL("Could not map priority map %s of client %d", info->shm_str,
+          client->client_state->id);
+
+  }
+
+  return true;
+
+}
+
+/* Forwards the priority msgs of the client to LLMP_LANE_PRIORITY. They are
+ * small and few, so they get copied one by one. */
+static void llmp_broker_handle_priority_msgs(
+    llmp_broker_state_t *broker, llmp_broker_client_metadata_t *client) {
+
+  if (!llmp_broker_map_priority(client)) { return; }
+
+  u32 sender_id = client->client_state->id;
+  u64 msgs_sent = 0, bytes_sent = 0, hook_drops = 0, bytes_dropped = 0,
+      eops = 0;
+
+  llmp_page_t *incoming = shmem2page(&client->cur_priority_map);
+  u32          current_message_id =
+      client->last_priority_msg_read
+                   ? client->last_priority_msg_read->message_id
+                   : 0;
+  while (current_message_id != incoming->current_msg_id) {
+
+    llmp_message_t *msg = llmp_recv(incoming, client->last_priority_msg_read);
+
+    if (!msg) {
+
+      FATAL(
+          "No priority message received but not all message ids receved! "
+          "Data out of sync?");
+
+    }
+
+    if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+      eops++;
+
+      llmp_payload_new_page_t *pageinfo =
+          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        FATAL("Illegal message length for EOP (is %ld, expected %ld)",
+              msg->buf_len, sizeof(llmp_payload_new_page_t));
+
+      }
+
+      llmp_payload_new_page_t pageinfo_cpy;
+      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+
+      u32 generation = incoming->generation;
+      llmp_broker_pool_client_map(broker, &client->cur_priority_map);
+      llmp_broker_map_next_client_page(client, &client->cur_priority_map,
+                                       &pageinfo_cpy, generation);
+
+      incoming = shmem2page(&client->cur_priority_map);
+      client->last_priority_msg_read = NULL;
+      current_message_id = 0;
+      continue;
+
+    }
+
+    msgs_sent++;
+
+    if (msg->tag == LLMP_TAG_OOB_V1) {
+
+      size_t buf_len;
+      if (!llmp_broker_forward_oob(broker, msg, true, &buf_len)) {
+
+        hook_drops++;
+        bytes_dropped += buf_len;
+
+      }
+
+      bytes_sent += buf_len;
+
+    } else {
+
+      bytes_sent += msg->buf_len;
+
+      if (likely(llmp_broker_call_hooks(broker, msg))) {
+
+        DBG("Broadcasting priority msg with id %d, tag 0x%X", msg->message_id,
+            msg->tag);
+
+        llmp_message_t *out =
+            llmp_broker_alloc_next(broker, LLMP_LANE_PRIORITY, msg->buf_len);
+        out->tag = msg->tag;
+        out->sender = msg->sender;
+        memcpy(out->buf, msg->buf, msg->buf_len);
+        llmp_broker_send(broker, LLMP_LANE_PRIORITY, out);
+
+      } else {
+
+        hook_drops++;
+        bytes_dropped += msg->buf_len;
+
+      }
+
+    }
+
+    client->last_priority_msg_read = msg;
+    current_message_id = msg->message_id;
+
+  }
+
+  llmp_broker_count_msgs(broker, sender_id, msgs_sent, bytes_sent, hook_drops,
+                         bytes_dropped, eops);
+
+}
+
+/* broker broadcast to its own page for all others to read */
+static inline void llmp_broker_handle_new_msgs(
+    llmp_broker_state_t *broker, llmp_broker_client_metadata_t *client) {
+
+  /* Pending msgs are copied over in spans, not one by one */
+  llmp_broker_span_t span = {0};
+
+  /* Counted here, written to the stats page once we're done */
+  u32 sender_id = client->client_state->id;
+  u64 msgs_sent = 0, bytes_sent = 0, hook_drops = 0, bytes_dropped = 0,
+      eops = 0;
+
+  llmp_page_t *incoming = shmem2page(client->cur_client_map);
+  u32          current_message_id = client->last_msg_broker_read
+                                        ? client->last_msg_broker_read->message_id
+                                        : 0;
+  while (current_message_id != incoming->current_msg_id) {
+
+    llmp_message_t *msg = llmp_recv(incoming, client->last_msg_broker_read);
+
+    if (!msg) {
+
+      FATAL(
+          "No message received but not all message ids receved! Data out of "
+          "sync?");
+
+    }
+
+    DBG("Our current_message_id for client %d (at ptr %p) is %d%s, now "
+        "processing msg id "
+        "%d with tag 0x%X",
+        client->client_state->id, client, current_message_id,
+        client->last_msg_broker_read ? "" : " (last msg was NULL)",
+        msg->message_id, msg->tag);
+
+    if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+      eops++;
+
+      llmp_payload_new_page_t *pageinfo =
+          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        FATAL("Illegal message length for EOP (is %ld, expected %ld)",
+              msg->buf_len, sizeof(llmp_payload_new_page_t));
+
+      }
+
+      DBG("Got EOP from client %d. Mapping new map.", client->client_state->id);
+
+      /* We can reuse the map mem space, no need to free and calloc.
+      However, the pageinfo points to the map we're about to unmap.
+      Copy the contents first. */
+
+      llmp_payload_new_page_t pageinfo_cpy;
+      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+
+      u32 generation = incoming->generation;
+
+      /* The span still points into the old map */
+      llmp_broker_forward_span(broker, &span);
+      llmp_broker_release_client_map(broker, client);
+      llmp_broker_map_next_client_page(client, client->cur_client_map,
+                                       &pageinfo_cpy, generation);
+
+      /* Ids start over on the new page */
+      incoming = shmem2page(client->cur_client_map);
+      client->last_msg_broker_read = NULL;
+      current_message_id = 0;
+      continue;
+
+    }
+
+    client->bytes_consumed += LLMP_MSG_SIZE(msg->buf_len);
+
+    if (msg->tag == LLMP_TAG_CLIENT_ADDED_V1 ||
+        msg->tag == LLMP_TAG_CLIENT_ADDED_FD_V1) {
+
+      DBG("Will add a new client.");
+
+      /* Not forwarded, so the span ends here */
+      llmp_broker_forward_span(broker, &span);
+
+      /* This client informs us about yet another new client
+      add it to the list! Also, no need to forward this msg. */
+      llmp_payload_new_page_t *pageinfo =
+          LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        WARNF(
+            "Ignoring broken CLIENT_ADDED msg due to incorrect size. "
+            "Expected %ld but got %ld",
+            sizeof(llmp_payload_new_page_t), msg->buf_len);
+
+      } else {
+
+        /* register_client may realloc the clients, we need to find ours again
+         */
+        u32 client_id = client->client_state->id;
+        if (!llmp_broker_register_client(broker, pageinfo->shm_str,
+                                         pageinfo->map_size)) {
+
+          FATAL("Could not register clientprocess with shm_str %s",
+                pageinfo->shm_str);
+
+        }
+
+        /* Mapped now, the passed fd did its job */
+        if (msg->tag == LLMP_TAG_CLIENT_ADDED_FD_V1) {
+
+          llmp_close_passed_fd(pageinfo->shm_str);
+
+        }
+
+        /* find client again */
+        client = &broker->llmp_clients[client_id];
+
+      }
+
+    } else if (msg->tag == LLMP_TAG_OOB_V1) {
+
+      /* Forwarded alone, so we know which broadcast page it ends up on */
+      llmp_broker_forward_span(broker, &span);
+
+      size_t buf_len;
+      msgs_sent++;
+      if (!llmp_broker_forward_oob(broker, msg, false, &buf_len)) {
+
+        hook_drops++;
+        bytes_dropped += buf_len;
+
+      }
+
+      bytes_sent += buf_len;
+
+    } else {
+
+      msgs_sent++;
+      bytes_sent += msg->buf_len;
+
+      if (likely(llmp_broker_call_hooks(broker, msg))) {
+
+        u32 lane_id = llmp_broker_lane_of(broker, msg->tag);
+
+        DBG("Broadcasting msg with id %d, tag 0x%X on lane %d",
+            msg->message_id, msg->tag, lane_id);
+
+        if (broker->zero_copy) {
+
+          llmp_message_t *out =
+              llmp_broker_forward_ref(broker, lane_id, client, msg);
+          llmp_broker_send(broker, lane_id, out);
+
+        } else {
+
+          size_t msg_size = LLMP_MSG_SIZE(msg->buf_len);
+
+          if (span.count &&
+              (span.lane != lane_id ||
+               !llmp_broker_fits(broker, lane_id, span.len + msg_size))) {
+
+            llmp_broker_forward_span(broker, &span);
+
+          }
+
+          if (!span.count) {
+
+            span.first = msg;
+            span.lane = lane_id;
+
+          }
+
+          span.count++;
+          span.len += msg_size;
+          span.max_msg_size = MAX(span.max_msg_size, msg_size);
+
+          /* Too large for this page: forward alone, on a new page. */
+          if (!llmp_broker_fits(broker, lane_id, span.len)) {
+
+            llmp_broker_forward_span(broker, &span);
+
+          }
+
+        }
+
+      } else {
+
+        hook_drops++;
+        bytes_dropped += msg->buf_len;
+
+        /* Dropped msgs split the span */
+        llmp_broker_forward_span(broker, &span);
+
+      }
+
+    }
+
+    client->last_msg_broker_read = msg;
+    current_message_id = msg->message_id;
+
+  }
+
+  llmp_broker_forward_span(broker, &span);
+
+  /* Gives the client credit for what we read */
+  if (incoming->bytes_consumed != client->bytes_consumed) {
+
+    __atomic_store_n(&incoming->bytes_consumed, client->bytes_consumed,
+                     __ATOMIC_RELEASE);
+
+  }
+
+  llmp_broker_count_msgs(broker, sender_id, msgs_sent, bytes_sent, hook_drops,
+                         bytes_dropped, eops);
+
+}
+
+/* How many broadcast msgs of one lane a client still has to read */
+static u64 llmp_broker_client_lane_lag(llmp_broker_state_t *broker,
+                                       llmp_page_t *client_page, u32 lane_id) {
+
+  llmp_broker_lane_t *lane = &broker->lanes[lane_id];
+  u32                 generation = client_page->recv_generations[lane_id];
+  u32                 msg_id = client_page->recv_msg_ids[lane_id];
+  u64                 lag = 0;
+  size_t              i;
+
+  for (i = 0; i < lane->broadcast_map_count; i++) {
+
+    llmp_page_t *page = shmem2page(&lane->broadcast_maps[i]);
+    size_t       msg_count = page->current_msg_id;
+
+    /* Full pages end with an EOP, which is no msg for the client */
+    if (i + 1 < lane->broadcast_map_count && msg_count) { msg_count--; }
+
+    if (page->generation > generation) {
+
+      lag += msg_count;
+
+    } else if (page->generation == generation && msg_count > msg_id) {
+
+      lag += msg_count - msg_id;
+
+    }
+
+  }
+
+  return lag;
+
+}
+
+/* How many broadcast msgs a client still has to read on all lanes it reads,
+ * going by the position it published in its out page */
+static u64 llmp_broker_client_lag(llmp_broker_state_t *broker,
+                                  llmp_page_t *        client_page) {
+
+  u64 lag = 0;
+  u32 lane_id;
+
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    if (client_page->watermarks[lane_id] == LLMP_WATERMARK_NO_RECV) {
+
+      continue;
+
+    }
+
+    lag += llmp_broker_client_lane_lag(broker, client_page, lane_id);
+
+  }
+
+  return lag;
+
+}
+
+/* Refreshes the receive side of the stats page, from the out pages of the
+ * clients */
+void llmp_broker_update_stats(llmp_broker_state_t *broker) {
+
+  llmp_stats_page_t *stats = llmp_broker_stats(broker);
+  size_t             count =
+      MIN(broker->llmp_client_count, (size_t)LLMP_STATS_MAX_CLIENTS);
+  size_t i;
+
+  MEM_BARRIER();
+  for (i = 0; i < count; i++) {
+
+    llmp_page_t *client_page =
+        shmem2page(broker->llmp_clients[i].cur_client_map);
+    llmp_client_stats_t *client_stats = &stats->clients[i];
+
+    __atomic_store_n(&client_stats->msgs_recvd, client_page->msgs_recvd,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&client_stats->bytes_recvd, client_page->bytes_recvd,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&client_stats->lag,
+                     llmp_broker_client_lag(broker, client_page),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&client_stats->flow_grows, client_page->flow_grows,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&client_stats->flow_stalls, client_page->flow_stalls,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&client_stats->flow_drops, client_page->flow_drops,
+                     __ATOMIC_RELAXED);
+
+  }
+
+  __atomic_store_n(&stats->refreshed_us, llmp_time_us(), __ATOMIC_RELAXED);
+
+}
+
+/* The broker walks all pages and looks for changes, then broadcasts them on
+ * its own shared page, once. */
+inline void llmp_broker_once(llmp_broker_state_t *broker) {
+
+  u32 i;
+  MEM_BARRIER();
+
+  /* Priority msgs of all clients go first, so they don't wait for bulk */
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    llmp_broker_handle_priority_msgs(broker, &broker->llmp_clients[i]);
+
+  }
+
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    llmp_broker_client_metadata_t *client = &broker->llmp_clients[i];
+    llmp_broker_handle_new_msgs(broker, client);
+
+  }
+
+  if (llmp_time_us() - llmp_broker_stats(broker)->refreshed_us >=
+      LLMP_STATS_INTERVAL_US) {
+
+    llmp_broker_update_stats(broker);
+
+  }
+
+  if (unlikely(broker->journal) &&
+      llmp_time_us() - broker->journal->synced_us >= LLMP_JOURNAL_SYNC_US) {
+
+    llmp_journal_sync(broker->journal);
+
+  }
+
+}
+
+/* If any of the clients posted a message the broker did not handle yet */
+static bool llmp_broker_has_new_msgs(void *broker_ptr) {
+
+  llmp_broker_state_t *broker = (llmp_broker_state_t *)broker_ptr;
+  size_t               i;
+
+  MEM_BARRIER();
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    llmp_broker_client_metadata_t *client = &broker->llmp_clients[i];
+
+    u32 last_msg_id = client->last_msg_broker_read
+                          ? client->last_msg_broker_read->message_id
+                          : 0;
+    if (shmem2page(client->cur_client_map)->current_msg_id != last_msg_id) {
+
+      return true;
+
+    }
+
+    if (!client->cur_priority_map.map) {
+
+      /* A newly announced priority map counts as news */
+      if (shmem2page(client->cur_client_map)->priority_map.map_size) {
+
+        return true;
+
+      }
+
+      continue;
+
+    }
+
+    last_msg_id = client->last_priority_msg_read
+                      ? client->last_priority_msg_read->message_id
+                      : 0;
+    if (shmem2page(&client->cur_priority_map)->current_msg_id != last_msg_id) {
+
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Spin for a bit, then sleep until a client rings our doorbell */
+static void llmp_broker_await_new_msgs(llmp_broker_state_t *broker) {
+
+  u64 spin_start = llmp_time_us();
+
+  while (!llmp_broker_has_new_msgs(broker)) {
+
+    if (llmp_time_us() - spin_start > LLMP_BROKER_SPIN_US) {
+
+      /* The first broadcast page holds the doorbell the clients ring */
+      llmp_doorbell_wait(&llmp_broker_first_page(broker)->broker_doorbell,
+                         llmp_broker_has_new_msgs, broker);
+      return;
+
+    }
+
+  }
+
+}
+
+/* The broker walks all pages and looks for changes, then broadcasts them on
+ * its own shared page */
+void llmp_broker_loop(llmp_broker_state_t *broker) {
+
+  while (1) {
+
+    MEM_BARRIER();
+    llmp_broker_once(broker);
+
+    if (broker->wakeup == LLMP_WAKEUP_POLL) {
+
+      /* 5 milis of sleep for now to not busywait at 100% */
+      usleep(5 * 1000);
+
+    } else {
+
+      llmp_broker_await_new_msgs(broker);
+
+    }
+
+  }
+
+}
+
+/* A wrapper around unpacking the data, calling through to the loop */
+static void *_llmp_client_wrapped_loop(void *llmp_client_broker_metadata_ptr) {
+
+  llmp_broker_client_metadata_t *metadata =
+      (llmp_broker_client_metadata_t *)llmp_client_broker_metadata_ptr;
+  metadata->clientloop(metadata->client_state, metadata->data);
+
+  WARNF("Client loop exited for client %d", metadata->client_state->id);
+  return NULL;
+
+}
+
+/* Kicks off all threaded clients in the brackground, using pthreads */
+bool llmp_broker_launch_clientloops(llmp_broker_state_t *broker) {
+
+  size_t i;
+
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    /* Threaded clients without a loop are driven by hand */
+    if (broker->llmp_clients[i].pthread != NULL &&
+        broker->llmp_clients[i].clientloop != NULL) {
+
+      /* Got a pthread -> threaded client. Spwan. :) */
+      int s =
+          pthread_create(broker->llmp_clients[i].pthread, NULL,
+                         _llmp_client_wrapped_loop, &broker->llmp_clients[i]);
+
+      if (s) {
+
+        // TODO: Better Error-handling! :)
+        PFATAL("Error creating thread %ld", i);
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+/* Start all threads and the main broker. Never returns. */
+void llmp_broker_run(llmp_broker_state_t *broker) {
+
+  llmp_broker_launch_clientloops(broker);
+  llmp_broker_loop(broker);
+
+}
+
+/* Frees the out of band segments nobody holds anymore */
+static void llmp_client_free_oob_segments(llmp_client_state_t *client) {
+
+  size_t i = 0;
+  while (i < client->oob_segment_count) {
+
+    llmp_oob_segment_t *seg =
+        (llmp_oob_segment_t *)client->oob_segments[i].map;
+    if (__atomic_load_n(&seg->refs, __ATOMIC_ACQUIRE)) {
+
+      i++;
+      continue;
+
+    }
+
+    DBG("Freeing out of band segment %s", client->oob_segments[i].shm_str);
+    afl_shmem_deinit(&client->oob_segments[i]);
+    memmove(&client->oob_segments[i], &client->oob_segments[i + 1],
+            (client->oob_segment_count - i - 1) * sizeof(afl_shmem_t));
+    client->oob_segment_count--;
+
+  }
+
+}
+
+/* We don't have any space. Send eop, the reset to beginning of ringbuf */
+static bool llmp_client_handle_out_eop(llmp_client_state_t *client,
+                                       afl_shmem_t **       maps_p,
+                                       size_t *             map_count_p,
+                                       llmp_message_t **    last_msg_p) {
+
+  DBG("Sending client EOP for client %d", client->id);
+
+  /* This is a good time to see which older pages we can reuse.
+  The broker would have informed us by setting the flag (zero copy may release
+  them out of order). */
+  afl_shmem_t *maps = *maps_p;
+  size_t       i = 0;
+  while (i < *map_count_p - 1) {
+
+    if (!shmem2page(&maps[i])->save_to_unmap) {
+
+      i++;
+      continue;
+
+    }
+
+    /* This page is save to reuse. The broker already read it. */
+    DBG("Pooling shared map %s of client", maps[i].shm_str);
+    llmp_pool_put(&client->out_pool, &maps[i], true);
+    memmove(&maps[i], &maps[i + 1],
+            (*map_count_p - i - 1) * sizeof(afl_shmem_t));
+    (*map_count_p)--;
+
+  }
+
+  /* And which out of band segments are gone */
+  llmp_client_free_oob_segments(client);
+
+  if (llmp_handle_out_eop(maps_p, map_count_p, last_msg_p, &client->out_pool) !=
+      AFL_RET_SUCCESS) {
+
+    DBG("An error occurred when handling client eop");
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Publishes the generation of the broadcast page we read from on the lane to
+ * the broker, in our current out map. */
+static inline void llmp_client_set_watermark(llmp_client_state_t *client,
+                                             u32 lane_id, u32 generation) {
+
+  if (!client->out_map_count) { return; }
+  shmem2page(&client->out_maps[client->out_map_count - 1])
+      ->watermarks[lane_id] = generation;
+
+}
+
+/* Keeps a map we're done with mapped until the next llmp_client_recv* call,
+ * as messages we returned earlier may still point into it. */
+static void llmp_client_retire_map(llmp_client_state_t *client,
+                                   afl_shmem_t *        map) {
+
+  if (!afl_realloc((void **)&client->retired_maps,
+                   (client->retired_map_count + 1) * sizeof(afl_shmem_t))) {
+
+    /* Rather leak the mapping than pull it away under a returned msg */
+    WARNF("Could not retire map %s, leaking it", map->shm_str);
+    return;
+
+  }
+
+  memcpy(&client->retired_maps[client->retired_map_count], map,
+         sizeof(afl_shmem_t));
+  client->retired_map_count++;
+
+}
+
+/* Drops our refs on the out of band msgs we returned */
+static void llmp_client_release_oob_maps(llmp_client_state_t *client) {
+
+  size_t i;
+  for (i = 0; i < client->oob_map_count; i++) {
+
+    llmp_oob_release(&client->oob_maps[i]);
+
+  }
+
+  client->oob_map_count = 0;
+
+}
+
+/* Pools all maps retired since the last llmp_client_recv* call. We are done
+ * with them now, so the broker may free (or reuse) them. */
+static void llmp_client_release_retired_maps(llmp_client_state_t *client) {
+
+  llmp_client_release_oob_maps(client);
+
+  if (!client->retired_map_count) { return; }
+
+  size_t i;
+  for (i = 0; i < client->retired_map_count; i++) {
+
+    llmp_pool_put(&client->broadcast_pool, &client->retired_maps[i], false);
+
+  }
+
+  client->retired_map_count = 0;
+
+  u32 lane_id;
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    afl_shmem_t *map = &client->lanes[lane_id].current_broadcast_map;
+    if (!(client->lane_mask & LLMP_LANE_MASK(lane_id)) || !map->map) {
+
+      continue;
+
+    }
+
+    llmp_client_set_watermark(client, lane_id, shmem2page(map)->generation);
+
+  }
+
+}
+
+/* Retires all client maps mapped to resolve zero copy references */
+static void llmp_client_retire_refs(llmp_client_state_t *client) {
+
+  size_t i;
+  for (i = 0; i < client->ref_map_count; i++) {
+
+    llmp_client_retire_map(client, &client->ref_maps[i]);
+
+  }
+
+  client->ref_map_count = 0;
+
+}
+
+/* Unmaps all client maps mapped to resolve zero copy references */
+static void llmp_client_unmap_refs(llmp_client_state_t *client) {
+
+  size_t i;
+  for (i = 0; i < client->ref_map_count; i++) {
+
+    afl_shmem_unmap(&client->ref_maps[i]);
+
+  }
+
+  client->ref_map_count = 0;
+
+}
+
+/* Zero copy: returns the message a reference points to, mapping the referenced
+ * client map read-only, if needed. */
+static llmp_message_t *llmp_client_resolve_ref(llmp_client_state_t *client,
+                                               llmp_message_t *     ref_msg) {
+
+  llmp_payload_msg_ref_t *ref =
+      LLMP_MSG_BUF_AS(ref_msg, llmp_payload_msg_ref_t);
+  if (!ref) {
+
+    FATAL("Illegal message length for msg ref (is %ld, expected %ld)",
+          ref_msg->buf_len, sizeof(llmp_payload_msg_ref_t));
+
+  }
+
+  afl_shmem_t *ref_map = NULL;
+  size_t       i;
+  for (i = 0; i < client->ref_map_count; i++) {
+
+    if (!strncmp(client->ref_maps[i].shm_str, ref->shm_str,
+                 AFL_SHMEM_STRLEN_MAX)) {
+
+      ref_map = &client->ref_maps[i];
+      break;
+
+    }
+
+  }
+
+  if (!ref_map) {
+
+    if (!afl_realloc((void **)&client->ref_maps,
+                     (client->ref_map_count + 1) * sizeof(afl_shmem_t))) {
+
+      FATAL("Could not allocate space for referenced map %s", ref->shm_str);
+
+    }
+
+    ref_map = &client->ref_maps[client->ref_map_count];
+    if (!llmp_pool_take_str(&client->broadcast_pool, ref->shm_str, ref_map) &&
+        !afl_shmem_by_str_readonly(ref_map, ref->shm_str, ref->map_size)) {
+
+      FATAL("Could not map referenced map %s of size %ld", ref->shm_str,
+            ref->map_size);
+
+    }
+
+    client->ref_map_count++;
+    DBG("Mapped referenced map %s", ref->shm_str);
+
+  }
+
+  llmp_message_t *msg = (llmp_message_t *)(ref_map->map + ref->offset);
+
+  if (shmem2page(ref_map)->generation != ref->generation ||
+      ref->offset + sizeof(llmp_message_t) + ref->buf_len > ref_map->map_size ||
+      msg->buf_len != ref->buf_len) {
+
+    FATAL("BUG: Stale reference to msg at offset %ld in map %s", ref->offset,
+          ref->shm_str);
+
+  }
+
+  return msg;
+
+}
+
+/* Out of band: returns the msg the descriptor points to, holding a ref on its
+ * segment until the next llmp_client_recv* call */
+static llmp_message_t *llmp_client_resolve_oob(llmp_client_state_t *client,
+                                               llmp_message_t *     desc) {
+
+  if (!afl_realloc((void **)&client->oob_maps,
+                   (client->oob_map_count + 1) * sizeof(afl_shmem_t))) {
+
+    FATAL("Could not allocate space for out of band segment");
+
+  }
+
+  llmp_message_t *msg =
+      llmp_oob_map(&client->oob_maps[client->oob_map_count], desc, true);
+  client->oob_map_count++;
+  return msg;
+
+}
+
+/* Publishes what we received so far for the broker's stats, in our current
+ * out map. Returns msg. */
+static inline llmp_message_t *llmp_client_count_recv(
+    llmp_client_state_t *client, u32 lane_id, llmp_message_t *msg) {
+
+  if (!client->out_map_count) { return msg; }
+
+  llmp_client_lane_t *lane = &client->lanes[lane_id];
+  llmp_page_t *       out_page =
+      shmem2page(&client->out_maps[client->out_map_count - 1]);
+
+  __atomic_store_n(&out_page->msgs_recvd, out_page->msgs_recvd + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&out_page->bytes_recvd, out_page->bytes_recvd + msg->buf_len,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&out_page->recv_generations[lane_id],
+                   shmem2page(&lane->current_broadcast_map)->generation,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&out_page->recv_msg_ids[lane_id],
+                   lane->last_msg_recvd->message_id, __ATOMIC_RELAXED);
+  return msg;
+
+}
+
+/* Maps the first page of the lane. The first page of lane 0 lists where to
+ * find it. */
+static bool llmp_client_map_lane(llmp_client_state_t *client, u32 lane_id) {
+
+  llmp_client_lane_t *lane = &client->lanes[lane_id];
+
+  /* Unconnected */
+  if (!client->broker_doorbell_map) { return false; }
+
+  /* Pin the lane from its start, until the next recv publishes where we are.
+   * Pages freed before are gone, the first page links past them. */
+  llmp_client_set_watermark(client, lane_id, 0);
+
+  llmp_lane_info_t *info =
+      &shmem2page(client->broker_doorbell_map)->lanes[lane_id];
+  if (!llmp_pool_map_by_str(&client->broadcast_pool,
+                            &lane->current_broadcast_map, info->shm_str,
+                            info->map_size)) {
+
+    FATAL("Could not map the first page %s of lane %d", info->shm_str,
+          lane_id);
+
+  }
+
+  lane->generation = shmem2page(&lane->current_broadcast_map)->generation;
+  lane->last_msg_recvd = NULL;
+  DBG("Mapped lane %d", lane_id);
+  return true;
+
+}
+
+/* We lagged too far behind, and the broker freed the pages we were about to
+ * read. Starts over at the first page of the lane. */
+static bool llmp_client_restart_lane(llmp_client_state_t *client,
+                                     u32                  lane_id) {
+
+  llmp_client_lane_t *lane = &client->lanes[lane_id];
+
+  WARNF("Client %d lagged behind on lane %d, msgs got lost", client->id,
+        lane_id);
+
+  /* Returned msgs may still live in it, unmap it on the next recv */
+  llmp_client_retire_map(client, &lane->current_broadcast_map);
+  memset(&lane->current_broadcast_map, 0, sizeof(afl_shmem_t));
+  lane->last_msg_recvd = NULL;
+
+  return llmp_client_map_lane(client, lane_id);
+
+}
+
+/* Returns the next broadcast message of the lane, or NULL. Maps left behind on
+ * EOP are retired, not unmapped, so earlier messages of a batch stay valid. */
+static llmp_message_t *llmp_client_recv_next(llmp_client_state_t *client,
+                                             u32                  lane_id) {
+
+  llmp_client_lane_t *lane = &client->lanes[lane_id];
+  llmp_message_t *    msg = NULL;
+
+  if (!lane->current_broadcast_map.map &&
+      !llmp_client_map_lane(client, lane_id)) {
+
+    return NULL;
+
+  }
+
+  while (1) {
+
+    /* The broker reused our page, we were left out of its gc */
+    if (shmem2page(&lane->current_broadcast_map)->generation !=
+        lane->generation) {
+
+      if (!llmp_client_restart_lane(client, lane_id)) { return NULL; }
+      continue;
+
+    }
+
+    msg = llmp_recv(shmem2page(&lane->current_broadcast_map),
+                    lane->last_msg_recvd);
+    if (!msg) { return NULL; }
+
+    lane->last_msg_recvd = msg;
+    if (msg->tag == LLMP_TAG_UNALLOCATED_V1) {
+
+      FATAL("BUG: Read unallocated msg");
+
+    } else if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+      /* we reached the end of the current page.
+      We'll init a new page but can reuse the mem are of the current map.
+      However, we cannot use the message if we deinit its page, so let's copy */
+      llmp_payload_new_page_t pageinfo_cpy;
+      afl_shmem_t             new_map = {0};
+      afl_shmem_t *           broadcast_map = &lane->current_broadcast_map;
+      llmp_page_t *           page = shmem2page(broadcast_map);
+
+      llmp_copy_eop_pageinfo(page, msg, &pageinfo_cpy);
+
+      DBG("Got EOP from broker. Mapping new map.");
+
+      bool freed = false;
+      while (!llmp_pool_map_by_str(&client->broadcast_pool, &new_map,
+                                   pageinfo_cpy.shm_str,
+                                   pageinfo_cpy.map_size)) {
+
+        /* The broker may have freed the page the first page linked to, and
+         * linked it to the oldest page left instead. */
+        char failed_shm_str[AFL_SHMEM_STRLEN_MAX];
+        memcpy(failed_shm_str, pageinfo_cpy.shm_str, AFL_SHMEM_STRLEN_MAX);
+        llmp_copy_eop_pageinfo(page, msg, &pageinfo_cpy);
+
+        /* Else, it freed the next page while we lagged behind */
+        if (page->generation ||
+            !strncmp(failed_shm_str, pageinfo_cpy.shm_str,
+                     AFL_SHMEM_STRLEN_MAX)) {
+
+          freed = true;
+          break;
+
+        }
+
+      }
+
+      /* Our page may have got reused meanwhile, so its EOP was not ours */
+      if (!freed && page->generation != lane->generation) {
+
+        llmp_pool_put(&client->broadcast_pool, &new_map, false);
+        freed = true;
+
+      }
+
+      if (freed) {
+
+        if (!llmp_client_restart_lane(client, lane_id)) { return NULL; }
+        continue;
+
+      }
+
+      if (shmem2page(&new_map)->generation <= page->generation) {
+
+        FATAL("BUG: Broadcast map %s has generation %d, expected > %d",
+              pageinfo_cpy.shm_str, shmem2page(&new_map)->generation,
+              page->generation);
+
+      }
+
+      /* Messages we returned may still live in the old map. Until the next
+       * recv, our watermark keeps the broker from reusing it. */
+      llmp_client_retire_map(client, broadcast_map);
+
+      /* References on the new page may point to other maps. */
+      llmp_client_retire_refs(client);
+
+      memcpy(&lane->current_broadcast_map, &new_map, sizeof(afl_shmem_t));
+      lane->generation = shmem2page(&new_map)->generation;
+
+      /* Ids start over on the new page */
+      lane->last_msg_recvd = NULL;
+
+    } else if (msg->tag == LLMP_TAG_MSG_REF_V1) {
+
+      return llmp_client_count_recv(client, lane_id,
+                                    llmp_client_resolve_ref(client, msg));
+
+    } else if (msg->tag == LLMP_TAG_OOB_V1) {
+
+      return llmp_client_count_recv(client, lane_id,
+                                    llmp_client_resolve_oob(client, msg));
+
+    } else {
+
+      return llmp_client_count_recv(client, lane_id, msg);
+
+    }
+
+  }
+
+}
+
+/* Returns the next broadcast message of any lane we subscribed to, or NULL.
+ * LLMP_LANE_PRIORITY goes first, the other lanes take turns. */
+static llmp_message_t *llmp_client_recv_any(llmp_client_state_t *client) {
+
+  u32 i;
+
+  /* Priority msgs skip the queue */
+  if (client->lane_mask & LLMP_LANE_MASK(LLMP_LANE_PRIORITY)) {
+
+    llmp_message_t *msg = llmp_client_recv_next(client, LLMP_LANE_PRIORITY);
+    if (msg) { return msg; }
+
+  }
+
+  for (i = 0; i < LLMP_LANE_COUNT; i++) {
+
+    u32 lane_id = (client->next_lane + i) % LLMP_LANE_COUNT;
+    if (lane_id == LLMP_LANE_PRIORITY ||
+        !(client->lane_mask & LLMP_LANE_MASK(lane_id))) {
+
+      continue;
+
+    }
+
+    llmp_message_t *msg = llmp_client_recv_next(client, lane_id);
+    if (msg) {
+
+      client->next_lane = (lane_id + 1) % LLMP_LANE_COUNT;
+      return msg;
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+/* A client receives a broadcast message. Returns null if no message is
+ * availiable */
+llmp_message_t *llmp_client_recv(llmp_client_state_t *client) {
+
+  llmp_client_release_retired_maps(client);
+  return llmp_client_recv_any(client);
+
+}
+
+/* A client receives up to max broadcast messages at once, following EOPs to
+new pages on the way. Returns the number of messages written to msgs. */
+size_t llmp_client_recv_batch(llmp_client_state_t *client,
+                              llmp_message_t **msgs, size_t max) {
+
+  size_t count = 0;
+
+  llmp_client_release_retired_maps(client);
+
+  while (count < max) {
+
+    llmp_message_t *msg = llmp_client_recv_any(client);
+    if (!msg) { break; }
+    msgs[count++] = msg;
+
+  }
+
+  return count;
+
+}
+
+/* Only read broadcasts of the lanes in lane_mask from now on */
+void llmp_client_subscribe(llmp_client_state_t *client, u32 lane_mask) {
+
+  u32 lane_id;
+
+  client->lane_mask = lane_mask & LLMP_LANE_MASK_ALL;
+
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    llmp_client_lane_t *lane = &client->lanes[lane_id];
+
+    if (client->lane_mask & LLMP_LANE_MASK(lane_id)) {
+
+      /* Pin the lane from where we are, or from its start */
+      llmp_client_set_watermark(
+          client, lane_id,
+          lane->current_broadcast_map.map
+              ? shmem2page(&lane->current_broadcast_map)->generation
+              : 0);
+
+    } else {
+
+      llmp_client_set_watermark(client, lane_id, LLMP_WATERMARK_NO_RECV);
+
+      /* Returned msgs may still live in it, unmap it on the next recv */
+      if (lane->current_broadcast_map.map) {
+
+        llmp_client_retire_map(client, &lane->current_broadcast_map);
+        memset(&lane->current_broadcast_map, 0, sizeof(afl_shmem_t));
+        lane->last_msg_recvd = NULL;
+
+      }
+
+    }
+
+  }
+
+}
+
+/* Tells the broker this client won't read any (more) broadcasts */
+void llmp_client_ignore_broadcasts(llmp_client_state_t *client) {
+
+  u32 lane_id;
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    llmp_client_lane_t *lane = &client->lanes[lane_id];
+
+    llmp_client_set_watermark(client, lane_id, LLMP_WATERMARK_NO_RECV);
+
+    /* The broker may reuse the pages we were at from now on. Returned msgs may
+     * still live in them, unmap them on the next recv. */
+    if (lane->current_broadcast_map.map) {
+
+      llmp_client_retire_map(client, &lane->current_broadcast_map);
+      memset(&lane->current_broadcast_map, 0, sizeof(afl_shmem_t));
+      lane->last_msg_recvd = NULL;
+
+    }
+
+  }
+
+}
+
+/* If any lane we read got a msg we did not read yet */
+static bool llmp_client_has_new_msg(void *client_ptr) {
+
+  llmp_client_state_t *client = (llmp_client_state_t *)client_ptr;
+  u32                  lane_id;
+
+  MEM_BARRIER();
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    llmp_client_lane_t *lane = &client->lanes[lane_id];
+    if (!(client->lane_mask & LLMP_LANE_MASK(lane_id)) ||
+        !lane->current_broadcast_map.map) {
+
+      continue;
+
+    }
+
+    u32 last_msg_id = lane->last_msg_recvd ? lane->last_msg_recvd->message_id
+                                           : 0;
+    if (shmem2page(&lane->current_broadcast_map)->current_msg_id !=
+        last_msg_id) {
+
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Spins for LLMP_CLIENT_SPIN_US, then sleeps until a msg got posted to one of
+ * the lanes we read */
+static void llmp_client_await_new_msg(llmp_client_state_t *client) {
+
+  u32 lane_id;
+
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
+
+    llmp_client_lane_t *lane = &client->lanes[lane_id];
+    if (client->lane_mask != LLMP_LANE_MASK(lane_id)) { continue; }
+
+    /* Reading a single lane: don't wake up for the others */
+    llmp_page_await_new_msg(
+        shmem2page(&lane->current_broadcast_map),
+        lane->last_msg_recvd ? lane->last_msg_recvd->message_id : 0);
+    return;
+
+  }
+
+  u64 spin_start = llmp_time_us();
+
+  while (!llmp_client_has_new_msg(client)) {
+
+    if (llmp_time_us() - spin_start > LLMP_CLIENT_SPIN_US) {
+
+      llmp_doorbell_wait(
+          &shmem2page(client->broker_doorbell_map)->lanes_doorbell,
+          llmp_client_has_new_msg, client);
+
+    }
+
+  }
+
+}
+
+/* A client spins for a bit, then sleeps until the next message gets posted
+  to one of its lanes, then returns that message. */
+llmp_message_t *llmp_client_recv_blocking(llmp_client_state_t *client) {
+
+  while (1) {
+
+    llmp_message_t *ret = llmp_client_recv(client);
+    if (ret) { return ret; }
+
+    /* recv followed any EOP (or swallowed an internal message), so wait on
+     * whatever the current pages are now. */
+    llmp_client_await_new_msg(client);
+
+  }
+
+}
+
+/* What the broker read of our msgs so far. It writes that to the out map it
+ * reads, one of those we still have. */
+static u64 llmp_client_bytes_consumed(llmp_client_state_t *client) {
+
+  u64    consumed = 0;
+  size_t i;
+  for (i = 0; i < client->out_map_count; i++) {
+
+    consumed = MAX(consumed,
+                   __atomic_load_n(&shmem2page(&client->out_maps[i])
+                                        ->bytes_consumed,
+                                   __ATOMIC_ACQUIRE));
+
+  }
+
+  return consumed;
+
+}
+
+/* How many more bytes we may send before the broker lags behind by our flow
+ * limit */
+size_t llmp_client_flow_credit(llmp_client_state_t *client) {
+
+  u64 consumed = llmp_client_bytes_consumed(client);
+  u64 lag = client->bytes_sent > consumed ? client->bytes_sent - consumed : 0;
+
+  return lag >= client->flow_limit ? 0 : client->flow_limit - lag;
+
+}
+
+/* Sets what the client does when its out page is full while the broker lags
+ * behind */
+void llmp_client_set_flow_control(llmp_client_state_t *client,
+                                  llmp_flow_policy_t policy, size_t limit) {
+
+  client->flow_policy = policy;
+  client->flow_limit = limit;
+
+}
+
+/* Our out page is full: applies the flow policy if the broker lags behind by
+ * more than our flow limit. Returns false if the msg is to be dropped. */
+static bool llmp_client_flow_control(llmp_client_state_t *client) {
+
+  if (llmp_client_flow_credit(client)) { return true; }
+
+  /* The counters live in the out map, for the broker's stats */
+  llmp_page_t *page = shmem2page(&client->out_maps[client->out_map_count - 1]);
+
+  switch (client->flow_policy) {
+
+    case LLMP_FLOW_BLOCK:
+      DBG("Client %d waits for the broker", client->id);
+      page->flow_stalls++;
+      while (!llmp_client_flow_credit(client)) {
+
+        usleep(LLMP_FLOW_BLOCK_SLEEP_US);
+
+      }
+
+      return true;
+
+    case LLMP_FLOW_DROP:
+      DBG("Client %d drops a msg, the broker lags behind", client->id);
+      page->flow_drops++;
+      return false;
+
+    default:
+      page->flow_grows++;
+      return true;
+
+  }
+
+}
+
+/* Allocates a msg in an out of band segment of its own, for the descriptor
+ * we just allocated. llmp_client_send sends the descriptor. */
+static llmp_message_t *llmp_client_alloc_oob(llmp_client_state_t *client,
+                                             llmp_message_t *     desc,
+                                             size_t               size) {
+
+  /* A msg allocated before, but never sent, holds its segment for nobody */
+  if (client->oob_msg) {
+
+    llmp_oob_segment_t *unsent =
+        (llmp_oob_segment_t *)((u8 *)client->oob_msg -
+                               offsetof(llmp_oob_segment_t, msg));
+    __atomic_store_n(&unsent->refs, 0, __ATOMIC_RELEASE);
+    client->oob_msg = NULL;
+
+  }
+
+  llmp_client_free_oob_segments(client);
+
+  if (!afl_realloc((void **)&client->oob_segments,
+                   (client->oob_segment_count + 1) * sizeof(afl_shmem_t))) {
+
+    DBG("Could not alloc mem for out of band segment");
+    return NULL;
+
+  }
+
+  afl_shmem_t *shm = &client->oob_segments[client->oob_segment_count];
+  if (!afl_shmem_init(shm, sizeof(llmp_oob_segment_t) + size)) {
+
+    DBG("Could not create out of band segment of size %ld", size);
+    return NULL;
+
+  }
+
+  client->oob_segment_count++;
+
+  llmp_oob_segment_t *seg = (llmp_oob_segment_t *)shm->map;
+  seg->layout_version = LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION;
+  seg->refs = 1;
+  seg->msg.sender = client->id;
+  seg->msg.buf_len = size;
+
+  desc->tag = LLMP_TAG_OOB_V1;
+  llmp_payload_new_page_t *info = (llmp_payload_new_page_t *)desc->buf;
+  info->map_size = shm->map_size;
+  memcpy(info->shm_str, shm->shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  client->oob_msg = &seg->msg;
+  client->oob_descriptor = desc;
+
+  return &seg->msg;
+
+}
+
+/* Allocates the next msg on a chain of out maps of the client */
+static llmp_message_t *llmp_client_alloc_on(llmp_client_state_t *client,
+                                            afl_shmem_t **       maps_p,
+                                            size_t *             map_count_p,
+                                            llmp_message_t **    last_msg_p,
+                                            size_t               size) {
+
+  llmp_message_t *msg;
+  size_t          oob_size = 0;
+
+  /* Too large for the pages: only its descriptor goes here */
+  if (size > LLMP_OOB_THRESHOLD) {
+
+    oob_size = size;
+    size = sizeof(llmp_payload_new_page_t);
+
+  }
+
+  msg = llmp_alloc_next(shmem2page(&(*maps_p)[*map_count_p - 1]), *last_msg_p,
+                        size);
+
+  if (!msg) {
+
+    /* Page is full. Unless the broker lags too far behind, tell it and go on
+    with a new page (pages only get reused once the broker read them). */
+    if (maps_p == &client->out_maps && !llmp_client_flow_control(client)) {
+
+      return NULL;
+
+    }
+
+    if (!llmp_client_handle_out_eop(client, maps_p, map_count_p, last_msg_p)) {
+
+      DBG("BUG: Error sending EOP");
+      return NULL;
+
+    }
+
+    /* The client_out_map will have been changed by llmp_handle_out_eop. Don't
+     * alias.
+     */
+    msg = llmp_alloc_next(shmem2page(&(*maps_p)[*map_count_p - 1]),
+                          *last_msg_p, size);
+    if (!msg) {
+
+      DBG("BUG: Something went wrong allocating a msg in the shmap");
+      return NULL;
+
+    }
+
+  }
+
+  msg->sender = client->id;
+
+  if (oob_size) { return llmp_client_alloc_oob(client, msg, oob_size); }
+
+  return msg;
+
+}
+
+/* Alloc the next message, internally resetting the ringbuf if full */
+llmp_message_t *llmp_client_alloc_next(llmp_client_state_t *client,
+                                       size_t               size) {
+
+  return llmp_client_alloc_on(client, &client->out_maps, &client->out_map_count,
+                              &client->last_msg_sent, size);
+
+}
+
+/* Sets up the first priority out map and announces it to the broker in our
+ * current out map */
+static bool llmp_client_init_priority_maps(llmp_client_state_t *client) {
+
+  if (!afl_realloc((void **)&client->priority_maps, sizeof(afl_shmem_t))) {
+
+    DBG("Could not alloc mem for priority map");
+    return false;
+
+  }
+
+  if (!llmp_new_page_shmem(&client->priority_maps[0], client->id,
+                           LLMP_INITIAL_MAP_SIZE)) {
+
+    DBG("Could not create priority map");
+    return false;
+
+  }
+
+  client->priority_map_count = 1;
+
+  /* The broker may still read an older out map than our current one. The
+  shm_str is only looked at once map_size is set. */
+  size_t i;
+  for (i = 0; i < client->out_map_count; i++) {
+
+    llmp_lane_info_t *info = &shmem2page(&client->out_maps[i])->priority_map;
+    memcpy(info->shm_str, client->priority_maps[0].shm_str,
+           AFL_SHMEM_STRLEN_MAX);
+    __atomic_store_n(&info->map_size, client->priority_maps[0].map_size,
+                     __ATOMIC_RELEASE);
+
+  }
+
+  return true;
+
+}
+
+/* Alloc the next message on the priority out maps */
+llmp_message_t *llmp_client_alloc_next_priority(llmp_client_state_t *client,
+                                                size_t               size) {
+
+  if (!client->priority_map_count && !llmp_client_init_priority_maps(client)) {
+
+    return NULL;
+
+  }
+
+  return llmp_client_alloc_on(client, &client->priority_maps,
+                              &client->priority_map_count,
+                              &client->last_priority_msg_sent, size);
+
+}
+
+/* Commits a msg to the client's out ringbuf */
+bool llmp_client_send(llmp_client_state_t *client_state, llmp_message_t *msg) {
+
+  DBG("Client %d sends new msg with tag 0x%X and size %ld", client_state->id,
+      msg->tag, msg->buf_len);
+
+  /* Out of band msgs are sent as their descriptor */
+  if (msg == client_state->oob_msg) {
+
+    msg = client_state->oob_descriptor;
+    client_state->oob_msg = NULL;
+
+  }
+
+  llmp_page_t *page =
+      shmem2page(&client_state->out_maps[client_state->out_map_count - 1]);
+  llmp_message_t **last_msg_p = &client_state->last_msg_sent;
+
+  if (client_state->priority_map_count) {
+
+    llmp_page_t *priority_page = shmem2page(
+        &client_state->priority_maps[client_state->priority_map_count - 1]);
+    if (llmp_msg_in_page(priority_page, msg)) {
+
+      page = priority_page;
+      last_msg_p = &client_state->last_priority_msg_sent;
+
+    }
+
+  }
+
+#ifdef LLMP_DEBUG
+  if (!llmp_msg_in_page(page, msg)) {
+
+    FATAL(
+        "BUG: Message to send not in correct page (%p not in %p with size %ld)",
+        msg, page, page->size_total);
+
+  }
+
+#endif
+
+  bool ret = llmp_send(page, msg);
+  *last_msg_p = msg;
+
+  /* The broker gives credit for these */
+  if (last_msg_p == &client_state->last_msg_sent) {
+
+    client_state->bytes_sent += LLMP_MSG_SIZE(msg->buf_len);
+
+  }
+
+  /* Wake up the broker, in case it sleeps */
+  if (client_state->broker_doorbell_map) {
+
+    llmp_doorbell_ring(
+        &shmem2page(client_state->broker_doorbell_map)->broker_doorbell);
+
+  }
+
+  return ret;
+
+}
+
+/* A simple client that, on connect, reads the new client's shmap str and
+ * writes the broker's initial map str */
+void llmp_clientloop_process_server(llmp_client_state_t *client_state,
+                                    void *               data) {
+
+  int port = (int)(size_t)data;
+
+  /* We only hand out the first broadcast map, never read from it */
+  llmp_client_ignore_broadcasts(client_state);
+
+  /* The first page of lane 0 leads to all others */
+  llmp_payload_new_page_t initial_broadcast_map = {0};
+  initial_broadcast_map.map_size = client_state->broker_doorbell_map->map_size;
+  memcpy(initial_broadcast_map.shm_str,
+         client_state->broker_doorbell_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  struct sockaddr_in serv_addr = {0};
+
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  /* port 2801 */
+  serv_addr.sin_port = htons(port);
+
+  if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+
+    PFATAL("Could not bind to %d", port);
+
+  }
+
+  if (listen(listenfd, 10) == -1) { PFATAL("Coult not listen to %d", port); }
+
+  llmp_message_t *msg =
+      llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+
+  while (1) {
+
+    if (!msg) { FATAL("Error allocating new client msg in tcp client!"); }
+
+    msg->tag = LLMP_TAG_CLIENT_ADDED_V1;
+    llmp_payload_new_page_t *payload = (llmp_payload_new_page_t *)msg->buf;
+
+    int connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
+    if (connfd == -1) {
+
+      WARNF("Error on accept");
+      continue;
+
+    }
+
+    DBG("New clientprocess connected");
+
+    if (write(connfd, &initial_broadcast_map,
+              sizeof(llmp_payload_new_page_t)) !=
+        sizeof(llmp_payload_new_page_t)) {
+
+      WARNF("Socket_client: TCP client disconnected immediately");
+      close(connfd);
+      continue;
+
+    }
+
+    size_t rlen_total = 0;
+
+    while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+
+      ssize_t rlen = read(connfd, payload + rlen_total,
+                          sizeof(llmp_payload_new_page_t) - rlen_total);
+      if (rlen < 0) {
+
+        // TODO: Handle EINTR?
+        WARNF("No complete map str receved from TCP client");
+        close(connfd);
+        continue;
+
+      }
+
+      rlen_total += rlen;
+
+    }
+
+    close(connfd);
+
+    DBG("Got new client with map id %s and size %ld", payload->shm_str,
+        payload->map_size);
+
+    if (!llmp_client_send(client_state, msg)) {
+
+      FATAL("BUG: Error sending incoming tcp msg to broker");
+
+    }
+
+    msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+
+  }
+
+}
+
+/* Sends a page info over a unix socket, with the page fd attached, if any */
+static bool llmp_unix_send_page(int fd, llmp_payload_new_page_t *page,
+                                int page_fd) {
+
+  union {
+
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+
+  } ctrl;
+
+  struct iovec  iov = {page, sizeof(llmp_payload_new_page_t)};
+  struct msghdr mh = {0};
+  ssize_t       len;
+
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+
+  if (page_fd != -1) {
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &page_fd, sizeof(int));
+
+  }
+
+  do {
+
+    len = sendmsg(fd, &mh, MSG_NOSIGNAL);
+
+  } while (len == -1 && errno == EINTR);
+
+  return len == sizeof(llmp_payload_new_page_t);
+
+}
+
+/* Receives a page info over a unix socket. If a page fd came along, page_fd
+ * is set to it and the page gets renamed to "pid:fd" in our own process. */
+static bool llmp_unix_recv_page(int fd, llmp_payload_new_page_t *page,
+                                int *page_fd) {
+
+  union {
+
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+
+  } ctrl;
+
+  struct iovec    iov = {page, sizeof(llmp_payload_new_page_t)};
+  struct msghdr   mh = {0};
+  struct cmsghdr *cmsg;
+  ssize_t         len;
+
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl.buf;
+  mh.msg_controllen = sizeof(ctrl.buf);
+  *page_fd = -1;
+
+  do {
+
+    len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+
+  } while (len == -1 && errno == EINTR);
+
+  if (len == -1) { return false; }
+
+  cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+
+    memcpy(page_fd, CMSG_DATA(cmsg), sizeof(int));
+
+  }
+
+  if (len != sizeof(llmp_payload_new_page_t) ||
+      (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+
+    goto error;
+
+  }
+
+  page->shm_str[AFL_SHMEM_STRLEN_MAX - 1] = '\0';
+
+#ifdef USEMEMFD
+  if (*page_fd != -1) {
+
+    snprintf(page->shm_str, AFL_SHMEM_STRLEN_MAX, "%d:%d", getpid(), *page_fd);
+
+  }
+
+#else
+  /* Our maps are not fd based, the str is all we need */
+  if (*page_fd != -1) { goto error; }
+#endif
+
+  return true;
+
+error:
+  if (*page_fd != -1) { close(*page_fd); }
+  *page_fd = -1;
+  return false;
+
+}
+
+/* Listens for new client processes on a unix socket, passing them the
+ * broker's first broadcast page, and registering their first out page */
+void llmp_clientloop_unix_server(llmp_client_state_t *client_state,
+                                 void *               data) {
+
+  llmp_unix_server_t *server = (llmp_unix_server_t *)data;
+
+  /* We only hand out the first broadcast map, never read from it */
+  llmp_client_ignore_broadcasts(client_state);
+
+  llmp_payload_new_page_t initial_broadcast_map = {0};
+  initial_broadcast_map.map_size = client_state->broker_doorbell_map->map_size;
+  memcpy(initial_broadcast_map.shm_str,
+         client_state->broker_doorbell_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  while (!server->stop) {
+
+    llmp_payload_new_page_t client_map = {0};
+    int                     page_fd;
+
+    struct pollfd pfd = {server->listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, LLMP_UNIX_POLL_MS) <= 0) { continue; }
+
+    int connfd = accept(server->listen_fd, NULL, NULL);
+    if (connfd == -1) { continue; }
+
+    if (!llmp_unix_send_page(connfd, &initial_broadcast_map,
+                             server->page_fd) ||
+        !llmp_unix_recv_page(connfd, &client_map, &page_fd)) {
+
+      WARNF("Unix socket client disconnected during handshake");
+      close(connfd);
+      continue;
+
+    }
+
+    close(connfd);
+
+    DBG("Got new client with map id %s and size %ld", client_map.shm_str,
+        client_map.map_size);
+
+    llmp_message_t *msg =
+        llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+    if (!msg) { FATAL("Error allocating new client msg in unix server!"); }
+
+    msg->tag = page_fd == -1 ? LLMP_TAG_CLIENT_ADDED_V1
+                             : LLMP_TAG_CLIENT_ADDED_FD_V1;
+    memcpy(msg->buf, &client_map, sizeof(llmp_payload_new_page_t));
+
+    if (!llmp_client_send(client_state, msg)) {
+
+      FATAL("BUG: Error sending incoming unix socket msg to broker");
+
+    }
+
+    server->clients_added++;
+
+  }
+
+}
+
+/* Maps the broker's first broadcast page, to ring the broker's doorbell on
+ * send */
+static bool llmp_client_map_broker_doorbell(llmp_client_state_t *client,
+                                            char *shm_str, size_t map_size) {
+
+  client->broker_doorbell_map = calloc(1, sizeof(afl_shmem_t));
+  if (!client->broker_doorbell_map) { return false; }
+
+  if (!afl_shmem_by_str(client->broker_doorbell_map, shm_str, map_size)) {
+
+    free(client->broker_doorbell_map);
+    client->broker_doorbell_map = NULL;
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Maps the broker's first page, as handed out by the broker on connect, and
+ * checks the broker speaks our layout */
+static bool llmp_client_attach_broker(llmp_client_state_t *    client_state,
+                                      llmp_payload_new_page_t *broker_map_msg) {
+
+  /* Lanes get mapped on first recv, from the infos on this page */
+  if (!llmp_client_map_broker_doorbell(client_state, broker_map_msg->shm_str,
+                                       broker_map_msg->map_size)) {
+
+    DBG("Could not map the broker's first page");
+    return false;
+
+  }
+
+  if (!llmp_page_layout_ok(shmem2page(client_state->broker_doorbell_map))) {
+
+    WARNF("Broker uses llmp layout 0x%X, expected 0x%X",
+          shmem2page(client_state->broker_doorbell_map)->layout_version,
+          LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION);
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Creates a new, unconnected, client state */
+llmp_client_state_t *llmp_client_new_unconnected() {
+
+  llmp_client_state_t *client_state = calloc(1, sizeof(llmp_client_state_t));
+  if (!client_state) { return NULL; }
+
+  client_state->lane_mask = LLMP_LANE_MASK_ALL;
+  client_state->flow_limit = LLMP_FLOW_DEFAULT_LIMIT;
+
+  if (!afl_realloc((void **)&client_state->out_maps, 1 * sizeof(afl_shmem_t))) {
+
+    DBG("Could not allocate memory");
+    free(client_state);
+    return NULL;
+
+  }
+
+  client_state->out_map_count = 1;
+
+  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id,
+                           LLMP_INITIAL_MAP_SIZE)) {
+
+    DBG("Could not create sharedmem");
+    afl_free(client_state->out_maps);
+    free(client_state);
+    return NULL;
+
+  }
+
+  return client_state;
+
+}
+
+/* Destroys the given cient state */
+void llmp_client_destroy(llmp_client_state_t *client_state) {
+
+  llmp_client_release_retired_maps(client_state);
+  afl_free(client_state->retired_maps);
+
+  size_t i;
+  for (i = 0; i < client_state->out_map_count; i++) {
+
+    afl_shmem_deinit(&client_state->out_maps[i]);
+
+  }
+
+  afl_free(client_state->out_maps);
+
+  for (i = 0; i < client_state->priority_map_count; i++) {
+
+    afl_shmem_deinit(&client_state->priority_maps[i]);
+
+  }
+
+  afl_free(client_state->priority_maps);
+
+  /* Others may still hold our segments, they stay around until unmapped */
+  llmp_client_release_oob_maps(client_state);
+  afl_free(client_state->oob_maps);
+  for (i = 0; i < client_state->oob_segment_count; i++) {
+
+    afl_shmem_deinit(&client_state->oob_segments[i]);
+
+  }
+
+  afl_free(client_state->oob_segments);
+
+  llmp_client_unmap_refs(client_state);
+  afl_free(client_state->ref_maps);
+
+  llmp_pool_clear(&client_state->out_pool, true);
+  llmp_pool_clear(&client_state->broadcast_pool, false);
+
+  afl_shmem_unmap(client_state->broker_doorbell_map);
+  free(client_state->broker_doorbell_map);
+
+  /* The broker owns the broadcast maps */
+  for (i = 0; i < LLMP_LANE_COUNT; i++) {
+
+    afl_shmem_unmap(&client_state->lanes[i].current_broadcast_map);
+
+  }
+
+  free(client_state);
+
+}
+
+/* Creates a new client process that will connect to the given port */
+llmp_client_state_t *llmp_client_new(int port) {
+
+  int                connfd = 0;
+  struct sockaddr_in servaddr = {0};
+
+  llmp_client_state_t *client_state = llmp_client_new_unconnected();
+  if (!client_state) { return NULL; }
+
+  // socket create and varification
+  connfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connfd == -1) { PFATAL("Unable to create socket"); }
+
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  servaddr.sin_port = htons(port);
+
+  if (connect(connfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+
+    DBG("Unable to connect to broker at localhost:%d, make sure it's running "
+        "and has a port exposed",
+        port);
+    close(connfd);
+    goto error;
+
+  }
+
+  llmp_payload_new_page_t client_map_msg, broker_map_msg = {0};
+  client_map_msg.map_size = client_state->out_maps[0].map_size;
+  memcpy(client_map_msg.shm_str, client_state->out_maps[0].shm_str,
+         AFL_SHMEM_STRLEN_MAX);
+
+  if (write(connfd, &client_map_msg, sizeof(llmp_payload_new_page_t)) !=
+      sizeof(llmp_payload_new_page_t)) {
+
+    DBG("Socket_client: TCP server disconnected immediately");
+    close(connfd);
+    goto error;
+
+  }
+
+  size_t rlen_total = 0;
+
+  while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+
+    ssize_t rlen = read(connfd, (u8 *)&broker_map_msg + rlen_total,
+                        sizeof(llmp_payload_new_page_t) - rlen_total);
+    if (rlen <= 0) {
+
+      // TODO: Handle EINTR?
+      DBG("Got short response from broker via TCP");
+      close(connfd);
+      goto error;
+
+    }
+
+    rlen_total += rlen;
+
+  }
+
+  close(connfd);
+
+  if (!llmp_client_attach_broker(client_state, &broker_map_msg)) {
+
+    goto error;
+
+  }
+
+  return client_state;
+
+error:
+  llmp_client_destroy(client_state);
+  return NULL;
+
+}
+
+/* Creates a new client process that will connect to the unix socket at path */
+llmp_client_state_t *llmp_client_new_unix(char *path) {
+
+  struct sockaddr_un      addr = {0};
+  llmp_payload_new_page_t client_map_msg = {0}, broker_map_msg = {0};
+  int                     connfd, broker_fd = -1, out_fd = -1;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+
+    DBG("Unix socket path %s is too long", path);
+    return NULL;
+
+  }
+
+  llmp_client_state_t *client_state = llmp_client_new_unconnected();
+  if (!client_state) { return NULL; }
+
+  connfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (connfd == -1) {
+
+    DBG("Unable to create unix socket");
+    goto error;
+
+  }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (connect(connfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+
+    DBG("Unable to connect to broker at %s, make sure it's running and has a "
+        "unix server registered",
+        path);
+    close(connfd);
+    goto error;
+
+  }
+
+  client_map_msg.map_size = client_state->out_maps[0].map_size;
+  memcpy(client_map_msg.shm_str, client_state->out_maps[0].shm_str,
+         AFL_SHMEM_STRLEN_MAX);
+#ifdef USEMEMFD
+  out_fd = client_state->out_maps[0].g_shm_fd;
+#endif
+
+  if (!llmp_unix_recv_page(connfd, &broker_map_msg, &broker_fd) ||
+      !llmp_unix_send_page(connfd, &client_map_msg, out_fd)) {
+
+    DBG("Unix socket handshake with the broker failed");
+    close(connfd);
+    if (broker_fd != -1) { close(broker_fd); }
+    goto error;
+
+  }
+
+  close(connfd);
+
+  bool attached = llmp_client_attach_broker(client_state, &broker_map_msg);
+  /* Once mapped, the passed fd did its job */
+  if (broker_fd != -1) { close(broker_fd); }
+  if (!attached) { goto error; }
+
+  return client_state;
+
+error:
+  llmp_client_destroy(client_state);
+  return NULL;
+
+}
+
+/* Client thread will be called with llmp_client_state_t client, containing
+the data in ->data. This will register a client to be spawned up as soon as
+broker_loop() starts. Clients can also added later via
+llmp_broker_register_remote(..) or the local_tcp_client
+*/
+bool llmp_broker_register_threaded_clientloop(llmp_broker_state_t *broker,
+                                              llmp_clientloop_func clientloop,
+                                              void *               data) {
+
+  /* We do a little dance with two sharedmaps, as the threaded clients
+    reuse the client_state struct as they share the heap. If we were to
+    treat threads and processes differently, it'd get too complex, so
+    let's just map the sharedmem twice into this process, and be done */
+  afl_shmem_t client_map = {0};
+
+  if (!llmp_new_page_shmem(&client_map, broker->llmp_client_count,
+                           LLMP_INITIAL_MAP_SIZE)) {
+
+    DBG("Failed to set up shmem for new client.");
+    return false;
+
+  }
+
+  pthread_t *pthread = calloc(1, sizeof(pthread_t));
+  if (!pthread) {
+
+    DBG("Failed to alloc pthread struct");
+    afl_shmem_deinit(&client_map);
+    return false;
+
+  }
+
+  llmp_broker_client_metadata_t *client = llmp_broker_register_client(
+      broker, client_map.shm_str, client_map.map_size);
+  if (!client) {
+
+    DBG("Could not register threaded client");
+    afl_shmem_deinit(&client_map);
+    free(pthread);
+    return false;
+
+  }
+
+  client->clientloop = clientloop;
+  client->data = data;
+  client->pthread = pthread;
+
+  /* Copy the already allocated shmem to the client state */
+  if (!afl_realloc((void *)&client->client_state->out_maps,
+                   sizeof(afl_shmem_t))) {
+
+    DBG("Could not alloc mem for client map");
+    afl_shmem_deinit(&client_map);
+    afl_shmem_deinit(client->cur_client_map);
+    free(pthread);
+    /* "Unregister" by subtracting the client from count */
+    broker->llmp_client_count--;
+    return false;
+
+  }
+
+  memcpy(client->client_state->out_maps, &client_map, sizeof(afl_shmem_t));
+  client->client_state->out_map_count = 1;
+
+  /* Each client starts with the very first map of each lane, mapped on first
+  recv. They should then iterate through all maps once and work on all old
+  messages. The broker may realloc its broadcast maps, so the client maps them
+  again. */
+  afl_shmem_t *first_map = &broker->lanes[0].broadcast_maps[0];
+  if (!llmp_client_map_broker_doorbell(client->client_state,
+                                       first_map->shm_str,
+                                       first_map->map_size)) {
+
+    DBG("Could not map broadcast map for threaded client");
+    afl_shmem_deinit(&client_map);
+    afl_shmem_deinit(client->cur_client_map);
+    free(pthread);
+    broker->llmp_client_count--;
+    return false;
+
+  }
+
+  DBG("Registered threaded client with id %d (loop func at %p)",
+      client->client_state->id, client->clientloop);
+
+  return true;
+
+}
+
+/* Register a simple tcp client that will listen for new shard map clients via
+ * tcp */
+bool llmp_broker_register_local_server(llmp_broker_state_t *broker, int port) {
+
+  if (!llmp_broker_register_threaded_clientloop(
+          broker, llmp_clientloop_process_server, (void *)(size_t)port)) {
+
+    DBG("Error registering new threaded client");
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Lets the unix server clientloop return soon */
+void llmp_unix_server_stop(llmp_unix_server_t *server) {
+
+  server->stop = true;
+
+}
+
+/* Frees the unix server, and removes its socket */
+static void llmp_unix_server_free(llmp_unix_server_t *server) {
+
+  if (server->listen_fd != -1) { close(server->listen_fd); }
+  if (server->page_fd != -1) { close(server->page_fd); }
+  if (server->path) { unlink(server->path); }
+  free(server->path);
+  free(server);
+
+}
+
+/* Registers a threaded client listening for new client processes on a unix
+ * socket */
+llmp_unix_server_t *llmp_broker_register_unix_server(
+    llmp_broker_state_t *broker, char *path) {
+
+  struct sockaddr_un addr = {0};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+
+    DBG("Unix socket path %s is too long", path);
+    return NULL;
+
+  }
+
+  llmp_unix_server_t *server = calloc(1, sizeof(llmp_unix_server_t));
+  if (!server) { return NULL; }
+
+  server->listen_fd = -1;
+  server->page_fd = -1;
+
+  server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (server->listen_fd == -1) { goto error; }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* A socket left behind by an earlier broker */
+  unlink(path);
+
+  if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+
+    DBG("Could not bind to %s", path);
+    goto error;
+
+  }
+
+  /* Only unlink the path once it is ours */
+  server->path = strdup(path);
+  if (!server->path) { goto error; }
+
+  /* A whole fleet may start at once */
+  if (listen(server->listen_fd, SOMAXCONN) == -1) { goto error; }
+
+#ifdef USEMEMFD
+  /* The first page of lane 0 leads to all others */
+  server->page_fd =
+      fcntl(broker->lanes[0].broadcast_maps[0].g_shm_fd, F_DUPFD_CLOEXEC, 0);
+  if (server->page_fd == -1) { goto error; }
+#endif
+
+  if (!llmp_broker_register_threaded_clientloop(
+          broker, llmp_clientloop_unix_server, server)) {
+
+    DBG("Error registering unix server client");
+    goto error;
+
+  }
+
+  return server;
+
+error:
+  llmp_unix_server_free(server);
+  return NULL;
+
+}
+
+/* The sender of a bridged msg */
+static inline u32 llmp_bridge_sender(u32 origin, u32 hops) {
+
+  return LLMP_SENDER_BRIDGED | (hops << 24) | (origin & LLMP_NODE_ID_MASK);
+
+}
+
+/* Checks if the bridge should send a local broadcast to the other end */
+static bool llmp_bridge_wants(llmp_bridge_t *bridge, llmp_message_t *msg) {
+
+  size_t i;
+
+  if (msg->buf_len > LLMP_BRIDGE_MAX_MSG_LEN) { return false; }
+
+  /* Never send msgs back to where they came from */
+  if ((msg->sender & LLMP_SENDER_BRIDGED) &&
+      (LLMP_SENDER_ORIGIN(msg->sender) == bridge->remote_node_id ||
+       LLMP_SENDER_HOPS(msg->sender) >= LLMP_BRIDGE_MAX_HOPS)) {
+
+    return false;
+
+  }
+
+  for (i = 0; i < bridge->tag_count; i++) {
+
+    if (bridge->tags[i] == msg->tag) { return true; }
+
+  }
+
+  return false;
+
+}
+
+/* Writes the header of the frame at frame_start of out_buf, ending at end */
+static inline void llmp_bridge_close_frame(llmp_bridge_t *bridge,
+                                           size_t frame_start, size_t end,
+                                           u32 msg_count) {
+
+  llmp_bridge_frame_t frame;
+
+  frame.msg_count = htonl(msg_count);
+  frame.len = htonl(end - frame_start - sizeof(llmp_bridge_frame_t));
+  memcpy(bridge->out_buf + frame_start, &frame, sizeof(llmp_bridge_frame_t));
+
+}
+
+/* Packs the next batch of local broadcasts the other end wants into new
+ * frames, each at most LLMP_BRIDGE_MAX_FRAME_LEN long. Returns how many
+ * broadcasts were read. */
+static size_t llmp_bridge_fill_frame(llmp_bridge_t *bridge) {
+
+  llmp_message_t *  msgs[LLMP_BRIDGE_BATCH];
+  llmp_bridge_msg_t hdr;
+  size_t            frame_start = 0;
+  size_t            len = sizeof(llmp_bridge_frame_t);
+  u32               frame_msg_count = 0;
+  u32               msg_count = 0;
+  size_t            i;
+
+  size_t count =
+      llmp_client_recv_batch(bridge->client, msgs, LLMP_BRIDGE_BATCH);
+
+  for (i = 0; i < count; i++) {
+
+    if (!llmp_bridge_wants(bridge, msgs[i])) { continue; }
+
+    size_t msg_len = sizeof(llmp_bridge_msg_t) + msgs[i]->buf_len;
+    size_t frame_len = len - frame_start - sizeof(llmp_bridge_frame_t);
+
+    /* Full frame: start the next one */
+    if (frame_msg_count && frame_len + msg_len > LLMP_BRIDGE_MAX_FRAME_LEN) {
+
+      llmp_bridge_close_frame(bridge, frame_start, len, frame_msg_count);
+      frame_start = len;
+      len += sizeof(llmp_bridge_frame_t);
+      frame_msg_count = 0;
+
+    }
+
+    if (!afl_realloc((void **)&bridge->out_buf, len + msg_len)) {
+
+      FATAL("Could not allocate bridge frame");
+
+    }
+
+    /* Local msgs originate from us */
+    hdr.tag = htonl(msgs[i]->tag);
+    hdr.sender = htonl((msgs[i]->sender & LLMP_SENDER_BRIDGED)
+                           ? msgs[i]->sender
+                           : llmp_bridge_sender(bridge->node_id, 0));
+    hdr.buf_len = htonl(msgs[i]->buf_len);
+
+    memcpy(bridge->out_buf + len, &hdr, sizeof(llmp_bridge_msg_t));
+    len += sizeof(llmp_bridge_msg_t);
+    memcpy(bridge->out_buf + len, msgs[i]->buf, msgs[i]->buf_len);
+    len += msgs[i]->buf_len;
+    frame_msg_count++;
+    msg_count++;
+
+  }
+
+  if (!msg_count) { return count; }
+
+  llmp_bridge_close_frame(bridge, frame_start, len, frame_msg_count);
+
+  bridge->out_len = len;
+  bridge->out_pos = 0;
+  bridge->msgs_out += msg_count;
+
+  return count;
+
+}
+
+/* Sends the msgs of all complete frames in in_buf to the local broker.
+ * Returns false if the other end sent garbage. */
+static bool llmp_bridge_handle_frames(llmp_bridge_t *bridge) {
+
+  llmp_bridge_frame_t frame;
+  llmp_bridge_msg_t   hdr;
+  size_t              pos = 0;
+  u32                 i;
+
+  while (bridge->in_len - pos >= sizeof(llmp_bridge_frame_t)) {
+
+    memcpy(&frame, bridge->in_buf + pos, sizeof(llmp_bridge_frame_t));
+    u32 msg_count = ntohl(frame.msg_count);
+    u32 frame_len = ntohl(frame.len);
+
+    /* Never buffer more than one maximum frame for a peer */
+    if (msg_count > LLMP_BRIDGE_BATCH ||
+        frame_len > LLMP_BRIDGE_MAX_FRAME_LEN) {
+
+      WARNF("Bridge got an invalid frame from node %u", bridge->remote_node_id);
+      return false;
+
+    }
+
+    /* Wait for the rest of the frame */
+    if (bridge->in_len - pos - sizeof(llmp_bridge_frame_t) < frame_len) {
+
+      break;
+
+    }
+
+    u8 *cur = bridge->in_buf + pos + sizeof(llmp_bridge_frame_t);
+    u8 *end = cur + frame_len;
+
+    for (i = 0; i < msg_count; i++) {
+
+      if ((size_t)(end - cur) < sizeof(llmp_bridge_msg_t)) { return false; }
+      memcpy(&hdr, cur, sizeof(llmp_bridge_msg_t));
+      cur += sizeof(llmp_bridge_msg_t);
+
+      u32 sender = ntohl(hdr.sender);
+      u32 buf_len = ntohl(hdr.buf_len);
+      if (buf_len > LLMP_BRIDGE_MAX_MSG_LEN ||
+          buf_len > (size_t)(end - cur)) {
+
+        WARNF("Bridge got an invalid msg from node %u", bridge->remote_node_id);
+        return false;
+
+      }
+
+      /* Msgs that went around in a circle (or for too long) die here */
+      if (LLMP_SENDER_ORIGIN(sender) != bridge->node_id &&
+          LLMP_SENDER_HOPS(sender) < LLMP_BRIDGE_MAX_HOPS) {
+
+        llmp_message_t *msg = llmp_client_alloc_next(bridge->client, buf_len);
+        if (!msg) { FATAL("Error allocating bridged msg"); }
+
+        msg->tag = ntohl(hdr.tag);
+        msg->sender = llmp_bridge_sender(LLMP_SENDER_ORIGIN(sender),
+                                         LLMP_SENDER_HOPS(sender) + 1);
+        memcpy(msg->buf, cur, buf_len);
+
+        if (!llmp_client_send(bridge->client, msg)) {
+
+          FATAL("BUG: Error sending bridged msg to broker");
+
+        }
+
+        bridge->msgs_in++;
+
+      }
+
+      cur += buf_len;
+
+    }
+
+    if (cur != end) { return false; }
+    pos += sizeof(llmp_bridge_frame_t) + frame_len;
+
+  }
+
+  memmove(bridge->in_buf, bridge->in_buf + pos, bridge->in_len - pos);
+  bridge->in_len -= pos;
+
+  return true;
+
+}
+
+/* Reads what the other end sent, without blocking. Returns false if the
+ * connection is gone. */
+static bool llmp_bridge_read(llmp_bridge_t *bridge) {
+
+  /* Frames may be larger, they get read in a few chunks */
+  size_t chunk = 1 << 16;
+
+  if (!afl_realloc((void **)&bridge->in_buf, bridge->in_len + chunk)) {
+
+    FATAL("Could not allocate bridge buf");
+
+  }
+
+  ssize_t rlen = recv(bridge->fd, bridge->in_buf + bridge->in_len, chunk,
+                      MSG_DONTWAIT);
+  if (rlen < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+
+    return true;
+
+  }
+
+  if (rlen <= 0) { return false; }
+
+  bridge->in_len += rlen;
+  return llmp_bridge_handle_frames(bridge);
+
+}
+
+/* Writes as much of the current frame as the socket takes, without blocking.
+ * Returns false if the connection is gone. */
+static bool llmp_bridge_write(llmp_bridge_t *bridge) {
+
+  ssize_t wlen =
+      send(bridge->fd, bridge->out_buf + bridge->out_pos,
+           bridge->out_len - bridge->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (wlen < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+
+    return true;
+
+  }
+
+  if (wlen <= 0) { return false; }
+
+  bridge->out_pos += wlen;
+  if (bridge->out_pos == bridge->out_len) {
+
+    bridge->out_len = 0;
+    bridge->out_pos = 0;
+
+  }
+
+  return true;
+
+}
+
+/* Connects to host:port of the bridge. Returns the socket, or -1. */
+static int llmp_bridge_dial(llmp_bridge_t *bridge) {
+
+  struct addrinfo  hints = {0};
+  struct addrinfo *addrs, *addr;
+  char             port_str[16];
+  int              fd = -1;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port_str, sizeof(port_str), "%d", bridge->port);
+
+  if (getaddrinfo(bridge->host, port_str, &hints, &addrs)) { return -1; }
+
+  for (addr = addrs; addr; addr = addr->ai_next) {
+
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd == -1) { continue; }
+    if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) { break; }
+    close(fd);
+    fd = -1;
+
+  }
+
+  freeaddrinfo(addrs);
+  return fd;
 
 }
 
-/* A simple client that, on connect, reads the new client's shmap str and
- * writes the broker's initial map str */
-void llmp_clientloop_process_server(llmp_client_state_t *client_state,
-                                    void *               data) {
+/* Exchanges node ids with the other end */
+static bool llmp_bridge_handshake(llmp_bridge_t *bridge) {
 
-  int port = (int)(size_t)data;
+  llmp_bridge_hello_t hello = {0};
+  struct timeval      timeout = {0};
+  int                 one = 1;
+  size_t              pos = 0;
 
-  llmp_payload_new_page_t initial_broadcast_map = {0};
-  initial_broadcast_map.map_size =
-      client_state->current_broadcast_map->map_size;
-  memcpy(initial_broadcast_map.shm_str,
-         client_state->current_broadcast_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+  /* We batch ourselves */
+  setsockopt(bridge->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  /* Don't hang forever on a peer that's no bridge */
+  timeout.tv_sec = 1;
+  setsockopt(bridge->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  hello.magic = htonl(LLMP_BRIDGE_MAGIC);
+  hello.node_id = htonl(bridge->node_id);
+  if (send(bridge->fd, &hello, sizeof(hello), MSG_NOSIGNAL) !=
+      sizeof(hello)) {
+
+    return false;
+
+  }
+
+  while (pos < sizeof(hello)) {
+
+    ssize_t rlen = recv(bridge->fd, (u8 *)&hello + pos, sizeof(hello) - pos, 0);
+    if (rlen < 0 && errno == EINTR) { continue; }
+    if (rlen <= 0) { return false; }
+    pos += rlen;
+
+  }
+
+  if (ntohl(hello.magic) != LLMP_BRIDGE_MAGIC) {
+
+    WARNF("Bridge got an unknown hello (%08x)", ntohl(hello.magic));
+    return false;
+
+  }
+
+  bridge->remote_node_id = ntohl(hello.node_id);
+  if (bridge->remote_node_id == bridge->node_id) {
+
+    WARNF("Bridge peer has our own node id %u", bridge->node_id);
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Connects to (or accepts) the other end. Returns false once the bridge got
+ * stopped. */
+static bool llmp_bridge_connect(llmp_bridge_t *bridge) {
+
+  /* Don't pin broadcast pages while there's no one to send them to. The next
+   * recv starts over at the first page, followed by the oldest page around. */
+  llmp_client_ignore_broadcasts(bridge->client);
+
+  while (!bridge->stop) {
+
+    if (bridge->host) {
+
+      bridge->fd = llmp_bridge_dial(bridge);
+
+    } else {
+
+      struct pollfd pfd = {bridge->listen_fd, POLLIN, 0};
+      if (poll(&pfd, 1, LLMP_BRIDGE_RECONNECT_MS) <= 0) { continue; }
+      bridge->fd = accept(bridge->listen_fd, NULL, NULL);
+
+    }
+
+    if (bridge->fd != -1 && llmp_bridge_handshake(bridge)) {
+
+      DBG("Bridge from node %u to node %u is up", bridge->node_id,
+          bridge->remote_node_id);
+      return true;
+
+    }
+
+    if (bridge->fd != -1) {
+
+      close(bridge->fd);
+      bridge->fd = -1;
+
+    }
+
+    if (bridge->host) { usleep(LLMP_BRIDGE_RECONNECT_MS * 1000); }
+
+  }
+
+  return false;
+
+}
+
+/* Drops the connection and everything still in flight */
+static void llmp_bridge_disconnect(llmp_bridge_t *bridge) {
+
+  if (bridge->fd != -1) { close(bridge->fd); }
+  bridge->fd = -1;
+  bridge->out_len = 0;
+  bridge->out_pos = 0;
+  bridge->in_len = 0;
+
+}
+
+/* Forwards broadcasts to the other end, and msgs from there to our broker */
+void llmp_clientloop_bridge(llmp_client_state_t *client_state, void *data) {
+
+  llmp_bridge_t *bridge = (llmp_bridge_t *)data;
+  bridge->client = client_state;
+
+  while (llmp_bridge_connect(bridge)) {
+
+    while (!bridge->stop) {
+
+      size_t recvd = 0;
+
+      /* Only read on once the last frame is out, tcp pushes back on us */
+      if (!bridge->out_len) { recvd = llmp_bridge_fill_frame(bridge); }
+
+      struct pollfd pfd = {bridge->fd, POLLIN, 0};
+      if (bridge->out_len) { pfd.events |= POLLOUT; }
+
+      if (poll(&pfd, 1, recvd ? 0 : LLMP_BRIDGE_POLL_MS) < 0 &&
+          errno != EINTR) {
+
+        break;
+
+      }
+
+      if ((pfd.revents & (POLLIN | POLLHUP)) && !llmp_bridge_read(bridge)) {
+
+        break;
+
+      }
+
+      if ((pfd.revents & POLLOUT) && !llmp_bridge_write(bridge)) { break; }
+      if (pfd.revents & (POLLERR | POLLNVAL)) { break; }
+
+    }
+
+    if (!bridge->stop) {
+
+      WARNF("Bridge to node %u lost, reconnecting", bridge->remote_node_id);
+
+    }
+
+    llmp_bridge_disconnect(bridge);
+
+  }
+
+}
+
+/* Lets the bridge clientloop return soon */
+void llmp_bridge_stop(llmp_bridge_t *bridge) {
+
+  bridge->stop = true;
+
+}
+
+/* Binds the listening socket of a bridge, on all interfaces */
+static bool llmp_bridge_listen(llmp_bridge_t *bridge) {
 
   struct sockaddr_in serv_addr = {0};
+  socklen_t          addr_len = sizeof(serv_addr);
+  int                one = 1;
 
-  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  bridge->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (bridge->listen_fd == -1) { return false; }
+
+  setsockopt(bridge->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
   serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  /* port 2801 */
-  serv_addr.sin_port = htons(port);
+  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serv_addr.sin_port = htons(bridge->port);
 
-  if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+  if (bind(bridge->listen_fd, (struct sockaddr *)&serv_addr,
+           sizeof(serv_addr)) == -1 ||
+      listen(bridge->listen_fd, 1) == -1 ||
+      getsockname(bridge->listen_fd, (struct sockaddr *)&serv_addr,
+                  &addr_len) == -1) {
 
-    PFATAL("Could not bind to %d", port);
+    WARNF("Bridge could not listen on port %d", bridge->port);
+    return false;
 
   }
 
-  if (listen(listenfd, 10) == -1) { PFATAL("Coult not listen to %d", port); }
+  /* In case the OS picked the port */
+  bridge->port = ntohs(serv_addr.sin_port);
+  return true;
 
-  llmp_message_t *msg =
-      llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+}
 
-  while (1) {
+static void llmp_bridge_free(llmp_bridge_t *bridge) {
 
-    if (!msg) { FATAL("Error allocating new client msg in tcp client!"); }
+  if (bridge->fd != -1) { close(bridge->fd); }
+  if (bridge->listen_fd != -1) { close(bridge->listen_fd); }
+  afl_free(bridge->out_buf);
+  afl_free(bridge->in_buf);
+  free(bridge->host);
+  free(bridge->tags);
+  free(bridge);
 
-    msg->tag = LLMP_TAG_CLIENT_ADDED_V1;
-    llmp_payload_new_page_t *payload = (llmp_payload_new_page_t *)msg->buf;
+}
 
-    int connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
-    if (connfd == -1) {
+/* Registers a bridge to the broker of another node, as threaded client */
+llmp_bridge_t *llmp_broker_register_bridge(llmp_broker_state_t *broker,
+                                           char *host, int port, u32 *tags,
+                                           size_t tag_count) {
 
-      WARNF("Error on accept");
-      continue;
+  llmp_bridge_t *bridge = calloc(1, sizeof(llmp_bridge_t));
+  if (!bridge) { return NULL; }
+
+  bridge->node_id = broker->node_id;
+  bridge->port = port;
+  bridge->fd = -1;
+  bridge->listen_fd = -1;
+
+  bridge->tags = calloc(tag_count ? tag_count : 1, sizeof(u32));
+  if (!bridge->tags) { goto error; }
+  memcpy(bridge->tags, tags, tag_count * sizeof(u32));
+  bridge->tag_count = tag_count;
+
+  if (host) {
+
+    bridge->host = strdup(host);
+    if (!bridge->host) { goto error; }
+
+  } else if (!llmp_bridge_listen(bridge)) {
+
+    goto error;
+
+  }
+
+  if (!llmp_broker_register_threaded_clientloop(broker, llmp_clientloop_bridge,
+                                                bridge)) {
+
+    DBG("Error registering bridge client");
+    goto error;
+
+  }
+
+  return bridge;
+
+error:
+  llmp_bridge_free(bridge);
+  return NULL;
+
+}
+
+/* Sets the node id of this broker, unique among all bridged brokers */
+void llmp_broker_set_node_id(llmp_broker_state_t *broker, u32 node_id) {
+
+  broker->node_id = node_id & LLMP_NODE_ID_MASK;
+
+}
+
+/* Clients more than max_lag pages behind don't keep pages around, 0 for no
+ * limit */
+void llmp_broker_set_gc_max_lag(llmp_broker_state_t *broker, u32 max_lag) {
+
+  broker->gc_max_lag = max_lag;
+
+}
+
+/* Adds a hook that gets called for each new message the broker touches.
+if the callback returns false, the message is not forwarded to the clients. */
+afl_ret_t llmp_broker_add_message_hook(llmp_broker_state_t *   broker,
+                                       llmp_message_hook_func *hook,
+                                       void *                  data) {
+
+  if (!afl_realloc(
+          (void **)&broker->msg_hooks,
+          (broker->msg_hook_count + 1) * sizeof(llmp_message_hook_data_t))) {
+
+    DBG("realloc for msg hooks failed");
+    return AFL_RET_ALLOC;
+
+  }
+
+  broker->msg_hooks[broker->msg_hook_count].func = hook;
+  broker->msg_hooks[broker->msg_hook_count].data = data;
+  broker->msg_hook_count++;
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Starts the threads running async hooks */
+static afl_ret_t llmp_broker_start_hook_workers(llmp_broker_state_t *broker) {
+
+  u32 i;
+
+  broker->hook_workers = calloc(LLMP_HOOK_WORKERS, sizeof(llmp_hook_worker_t));
+  if (!broker->hook_workers) { return AFL_RET_ALLOC; }
+
+  for (i = 0; i < LLMP_HOOK_WORKERS; i++) {
+
+    llmp_hook_worker_t *worker = &broker->hook_workers[i];
+    worker->broker = broker;
+    if (pthread_create(&worker->thread, NULL, llmp_hook_worker_loop, worker)) {
+
+      FATAL("Could not start hook worker %d", i);
 
     }
 
-    DBG("New clientprocess connected");
+  }
 
-    if (write(connfd, &initial_broadcast_map,
-              sizeof(llmp_payload_new_page_t)) !=
-        sizeof(llmp_payload_new_page_t)) {
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Lets the workers finish their jobs, then stops them */
+static void llmp_broker_stop_hook_workers(llmp_broker_state_t *broker) {
+
+  u32 i;
+
+  if (!broker->hook_workers) { return; }
+
+  llmp_broker_drain_hooks(broker);
+
+  for (i = 0; i < LLMP_HOOK_WORKERS; i++) {
+
+    llmp_hook_worker_t *worker = &broker->hook_workers[i];
+    __atomic_store_n(&worker->stop, true, __ATOMIC_RELEASE);
+    llmp_doorbell_ring(&worker->doorbell);
+    pthread_join(worker->thread, NULL);
+
+  }
+
+  free(broker->hook_workers);
+  broker->hook_workers = NULL;
+
+}
+
+/* Adds a hook that runs on the hook workers, see llmp.h */
+afl_ret_t llmp_broker_add_async_message_hook(llmp_broker_state_t *   broker,
+                                             llmp_message_hook_func *hook,
+                                             void *data, u32 verdict_us) {
+
+  if (broker->async_hook_count >= LLMP_ASYNC_HOOKS_MAX) {
+
+    WARNF("Too many async msg hooks (max %d)", LLMP_ASYNC_HOOKS_MAX);
+    return AFL_RET_ARRAY_END;
+
+  }
+
+  if (!broker->hook_workers) {
+
+    afl_ret_t ret = llmp_broker_start_hook_workers(broker);
+    if (ret != AFL_RET_SUCCESS) { return ret; }
+
+  }
+
+  llmp_async_hook_t *async_hook =
+      &broker->async_hooks[broker->async_hook_count];
+  async_hook->func = hook;
+  async_hook->data = data;
+  async_hook->verdict_us = verdict_us;
+  broker->async_hook_count++;
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Makes the broker write forwarded msgs to a journal, see llmp.h */
+afl_ret_t llmp_broker_enable_journal(llmp_broker_state_t *broker, char *path,
+                                     size_t size) {
+
+  if (broker->journal) { return AFL_RET_SUCCESS; }
+
+  llmp_journal_t *journal = calloc(1, sizeof(llmp_journal_t));
+  if (!journal) { return AFL_RET_ALLOC; }
+
+  if (!size) { size = LLMP_JOURNAL_DEFAULT_SIZE; }
+
+  afl_ret_t ret = llmp_journal_map(journal, path, size, true);
+  if (ret != AFL_RET_SUCCESS) {
+
+    free(journal);
+    return ret;
+
+  }
+
+  journal->path = strdup(path);
+  if (!journal->path) {
+
+    llmp_journal_unmap(journal);
+    free(journal);
+    return AFL_RET_ALLOC;
+
+  }
+
+  /* Warm restart: what the last broker forwarded goes out again. The msgs are
+   * in the journal already, so it's enabled only afterwards. */
+  llmp_message_t *msg = NULL;
+  while ((msg = llmp_journal_next(journal, msg))) {
+
+    u32             lane_id = llmp_broker_lane_of(broker, msg->tag);
+    llmp_message_t *out = llmp_broker_alloc_next(broker, lane_id, msg->buf_len);
+    out->tag = msg->tag;
+    out->sender = msg->sender;
+    memcpy(out->buf, msg->buf, msg->buf_len);
+    llmp_broker_send(broker, lane_id, out);
+
+  }
+
+  DBG("Journal %s enabled, replayed %llu msgs", path,
+      journal->header->msg_count);
+
+  journal->synced_us = llmp_time_us();
+  broker->journal = journal;
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Maps a journal read-only */
+afl_ret_t llmp_journal_open(llmp_journal_t *journal, char *path) {
+
+  afl_ret_t ret = llmp_journal_map(journal, path, 0, false);
+  if (ret != AFL_RET_SUCCESS) { return ret; }
+
+  journal->path = strdup(path);
+  if (!journal->path) {
+
+    llmp_journal_unmap(journal);
+    return AFL_RET_ALLOC;
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* The next msg of the journal, or NULL */
+llmp_message_t *llmp_journal_next(llmp_journal_t *journal,
+                                  llmp_message_t *last) {
+
+  llmp_journal_header_t *header = journal->header;
+  u64 used = MIN(__atomic_load_n(&header->used, __ATOMIC_ACQUIRE),
+                 (u64)llmp_journal_capacity(journal));
+  size_t offset = last ? (size_t)((u8 *)last - header->data) +
+                             LLMP_MSG_SIZE(last->buf_len)
+                       : 0;
+
+  if (offset + sizeof(llmp_message_t) > used) { return NULL; }
+
+  llmp_message_t *msg = (llmp_message_t *)(header->data + offset);
+  if (offset + LLMP_MSG_SIZE(msg->buf_len) > used) {
+
+    WARNF("Truncated msg in journal %s", journal->path);
+    return NULL;
+
+  }
+
+  return msg;
+
+}
+
+/* Syncs and unmaps the journal */
+void llmp_journal_close(llmp_journal_t *journal) {
+
+  if (!journal->header) { return; }
+
+  if (journal->writable) { llmp_journal_sync(journal); }
+  llmp_journal_unmap(journal);
+  free(journal->path);
+  journal->path = NULL;
+
+}
 
-      WARNF("Socket_client: TCP client disconnected immediately");
-      close(connfd);
-      continue;
+/* Adds the hash to the set, lock-free. Returns false if it was in already. */
+static bool llmp_dedup_insert(llmp_dedup_t *dedup, u64 hash) {
 
-    }
+  size_t mask = dedup->slot_count - 1;
+  u32    i;
 
-    size_t rlen_total = 0;
+  /* 0 marks free slots */
+  if (!hash) { hash = 1; }
 
-    while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+  for (i = 0; i < LLMP_DEDUP_PROBES; i++) {
 
-      ssize_t rlen = read(connfd, payload + rlen_total,
-                          sizeof(llmp_payload_new_page_t) - rlen_total);
-      if (rlen < 0) {
+    u64 *slot = &dedup->slots[(hash + i) & mask];
+    u64  cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
 
-        // TODO: Handle EINTR?
-        WARNF("No complete map str receved from TCP client");
-        close(connfd);
-        continue;
+    if (cur == hash) { return false; }
+    if (cur) { continue; }
 
-      }
+    if (__atomic_compare_exchange_n(slot, &cur, hash, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
 
-      rlen_total += rlen;
+      return true;
 
     }
 
-    close(connfd);
+    /* Someone else took the slot, maybe for the same hash */
+    if (cur == hash) { return false; }
 
-    DBG("Got new client with map id %s and size %ld", payload->shm_str,
-        payload->map_size);
+  }
 
-    if (!llmp_client_send(client_state, msg)) {
+  /* All taken: forget one of them. Slots never get free again, so the probe
+   * sequences of the others stay intact. */
+  __atomic_store_n(&dedup->slots[(hash + (hash >> 61)) & mask], hash,
+                   __ATOMIC_RELEASE);
+  return true;
 
-      FATAL("BUG: Error sending incoming tcp msg to broker");
+}
 
-    }
+/* Drops queue entries with a payload we saw before */
+static bool llmp_dedup_hook(llmp_broker_state_t *broker, llmp_message_t *msg,
+                            void *data) {
 
-    msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+  llmp_dedup_t *dedup = (llmp_dedup_t *)data;
+
+  if (msg->tag != LLMP_TAG_NEW_QUEUE_ENTRY) { return true; }
+
+  llmp_stats_page_t *stats = llmp_broker_stats(broker);
+  llmp_stats_add(&stats->dedup_msgs, 1);
+
+  if (llmp_dedup_insert(dedup, XXH3_64bits(msg->buf, msg->buf_len))) {
+
+    return true;
 
   }
 
+  DBG("Dropping duplicate queue entry from client %d", msg->sender);
+  llmp_stats_add(&stats->dedup_drops, 1);
+  return false;
+
 }
 
-/* Creates a new, unconnected, client state */
-llmp_client_state_t *llmp_client_new_unconnected() {
+/* add_message_hook wants a pointer to the hook */
+static llmp_message_hook_func llmp_dedup_hook_func = llmp_dedup_hook;
 
-  llmp_client_state_t *client_state = calloc(1, sizeof(llmp_client_state_t));
+/* Adds a hook that drops queue entries with a payload seen before */
+afl_ret_t llmp_broker_enable_dedup(llmp_broker_state_t *broker,
+                                   size_t               slot_count) {
 
-  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
-  if (!client_state->current_broadcast_map) {
+  if (broker->dedup) { return AFL_RET_SUCCESS; }
 
-    DBG("Could not allocate mem");
-    return NULL;
+  slot_count = next_pow2(slot_count ? slot_count : LLMP_DEDUP_DEFAULT_SLOTS);
+  if (slot_count < LLMP_DEDUP_PROBES) { slot_count = LLMP_DEDUP_PROBES; }
 
-  }
+  llmp_dedup_t *dedup = calloc(1, sizeof(llmp_dedup_t));
+  if (!dedup) { return AFL_RET_ALLOC; }
 
-  if (!afl_realloc((void **)&client_state->out_maps, 1 * sizeof(afl_shmem_t))) {
+  dedup->slots = calloc(slot_count, sizeof(u64));
+  if (!dedup->slots) {
 
-    DBG("Could not allocate memory");
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    free(dedup);
+    return AFL_RET_ALLOC;
 
   }
 
-  client_state->out_map_count = 1;
+  dedup->slot_count = slot_count;
 
-  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id,
-                           LLMP_INITIAL_MAP_SIZE)) {
+  afl_ret_t ret =
+      llmp_broker_add_message_hook(broker, &llmp_dedup_hook_func, dedup);
+  if (ret != AFL_RET_SUCCESS) {
 
-    DBG("Could not create sharedmem");
-    afl_free(client_state->out_maps);
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    free(dedup->slots);
+    free(dedup);
+    return ret;
 
   }
 
-  return client_state;
+  broker->dedup = dedup;
+  return AFL_RET_SUCCESS;
 
 }
 
-/* Destroys the given cient state */
-void llmp_client_destroy(llmp_client_state_t *client_state) {
+/* In zero copy mode, the broker broadcasts references to the messages in the
+client pages instead of copying them over. */
+void llmp_broker_set_zero_copy(llmp_broker_state_t *broker, bool zero_copy) {
 
-  size_t i;
-  for (i = 0; i < client_state->out_map_count; i++) {
+  broker->zero_copy = zero_copy;
 
-    afl_shmem_deinit(&client_state->out_maps[i]);
+}
 
-  }
+/* The shared memory (in bytes) the broker currently keeps mapped */
+size_t llmp_broker_shm_usage(llmp_broker_state_t *broker) {
 
-  afl_free(client_state->out_maps);
+  size_t usage = 0;
+  size_t i;
+  u32    lane_id;
 
-  afl_shmem_deinit(client_state->current_broadcast_map);
-  free(client_state->current_broadcast_map);
-  free(client_state);
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-}
+    llmp_broker_lane_t *lane = &broker->lanes[lane_id];
+    for (i = 0; i < lane->broadcast_map_count; i++) {
 
-/* Creates a new client process that will connect to the given port */
-llmp_client_state_t *llmp_client_new(int port) {
+      usage += lane->broadcast_maps[i].map_size;
 
-  int                connfd = 0;
-  struct sockaddr_in servaddr = {0};
+    }
 
-  llmp_client_state_t *client_state = llmp_client_new_unconnected();
+  }
+
+  for (i = 0; i < broker->llmp_client_count; i++) {
 
-  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
-  if (!client_state->current_broadcast_map) {
+    usage += broker->llmp_clients[i].cur_client_map->map_size;
+    if (broker->llmp_clients[i].cur_priority_map.map) {
 
-    llmp_client_destroy(client_state);
-    DBG("Could not allocate mem");
-    return NULL;
+      usage += broker->llmp_clients[i].cur_priority_map.map_size;
+
+    }
 
   }
 
-  if (!afl_realloc((void **)&client_state->out_maps, 1 * sizeof(afl_shmem_t))) {
+  for (i = 0; i < broker->retained_map_count; i++) {
 
-    DBG("Could not allocate memory");
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    usage += broker->retained_maps[i].map.map_size;
 
   }
 
-  client_state->out_map_count = 1;
-
-  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id,
-                           LLMP_INITIAL_MAP_SIZE)) {
+  for (i = 0; i < broker->oob_segment_count; i++) {
 
-    DBG("Could not create sharedmem");
-    goto error;
+    usage += broker->oob_segments[i].map.map_size;
 
   }
 
-  // socket create and varification
-  connfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (connfd == -1) { PFATAL("Unable to create socket"); }
+  return usage;
 
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  servaddr.sin_port = htons(port);
+}
 
-  if (connect(connfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+/* The shm_str of the broker's stats page */
+char *llmp_broker_stats_shm_str(llmp_broker_state_t *broker) {
 
-    DBG("Unable to connect to broker at localhost:%d, make sure it's running "
-        "and has a port exposed",
-        port);
-    goto error;
+  return broker->stats_map.shm_str;
 
-  }
+}
 
-  llmp_payload_new_page_t client_map_msg, broker_map_msg = {0};
-  client_map_msg.map_size = client_state->out_maps[0].map_size;
-  memcpy(client_map_msg.shm_str, client_state->out_maps[0].shm_str,
-         AFL_SHMEM_STRLEN_MAX);
+/* Maps a broker's stats page read-only */
+llmp_stats_page_t *llmp_stats_map(afl_shmem_t *shm, char *shm_str) {
 
-  if (write(connfd, &client_map_msg, sizeof(llmp_payload_new_page_t)) !=
-      sizeof(llmp_payload_new_page_t)) {
+  llmp_stats_page_t *stats = (llmp_stats_page_t *)afl_shmem_by_str_readonly(
+      shm, shm_str, sizeof(llmp_stats_page_t));
+  if (!stats) { return NULL; }
 
-    afl_shmem_deinit(&client_state->out_maps[0]);
-    free(client_state);
-    close(connfd);
+  if (stats->layout_version != (LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION)) {
+
+    WARNF("Stats page %s has llmp layout 0x%X, expected 0x%X", shm_str,
+          stats->layout_version, LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION);
+    afl_shmem_unmap(shm);
     return NULL;
-    FATAL("Socket_client: TCP server disconnected immediately");
 
   }
 
-  size_t rlen_total = 0;
-
-  while (rlen_total < sizeof(llmp_payload_new_page_t)) {
-
-    ssize_t rlen = read(connfd, &broker_map_msg + rlen_total,
-                        sizeof(llmp_payload_new_page_t) - rlen_total);
-    if (rlen < 0) {
+  return stats;
 
-      // TODO: Handle EINTR?
-      DBG("Got short response from broker via TCP");
-      close(connfd);
-      afl_shmem_deinit(&client_state->out_maps[0]);
-      goto error;
+}
 
-    }
+/* Sets how llmp_broker_loop waits for new messages */
+void llmp_broker_set_wakeup(llmp_broker_state_t *broker,
+                            llmp_broker_wakeup_t wakeup) {
 
-    rlen_total += rlen;
+  broker->wakeup = wakeup;
 
-  }
+}
 
-  close(connfd);
+/* Sets up the first page of each lane, and lists them on the first page of
+ * lane 0 */
+static bool llmp_broker_init_lanes(llmp_broker_state_t *broker) {
 
-  if (!afl_shmem_by_str(client_state->current_broadcast_map,
-                        broker_map_msg.shm_str, broker_map_msg.map_size)) {
+  u32 lane_id;
 
-    // TODO: Handle EINTR?
-    DBG("Could not allocate shmem");
-    afl_shmem_deinit(&client_state->out_maps[0]);
-    goto error;
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-  }
+    llmp_broker_lane_t *lane = &broker->lanes[lane_id];
 
-  return client_state;
+    if (!afl_realloc((void **)&lane->broadcast_maps, 1 * sizeof(afl_shmem_t))) {
 
-error:
-  llmp_client_destroy(client_state);
-  return NULL;
+      return false;
 
-}
+    }
 
-/* Client thread will be called with llmp_client_state_t client, containing
-the data in ->data. This will register a client to be spawned up as soon as
-broker_loop() starts. Clients can also added later via
-llmp_broker_register_remote(..) or the local_tcp_client
-*/
-bool llmp_broker_register_threaded_clientloop(llmp_broker_state_t *broker,
-                                              llmp_clientloop_func clientloop,
-                                              void *               data) {
+    if (!llmp_new_page_shmem(&lane->broadcast_maps[0], -1,
+                             LLMP_INITIAL_MAP_SIZE)) {
 
-  /* We do a little dance with two sharedmaps, as the threaded clients
-    reuse the client_state struct as they share the heap. If we were to
-    treat threads and processes differently, it'd get too complex, so
-    let's just map the sharedmem twice into this process, and be done */
-  afl_shmem_t client_map = {0};
+      return false;
 
-  if (!llmp_new_page_shmem(&client_map, broker->llmp_client_count,
-                           LLMP_INITIAL_MAP_SIZE)) {
+    }
 
-    DBG("Failed to set up shmem for new client.");
-    return false;
+    lane->broadcast_map_count = 1;
 
   }
 
-  pthread_t *pthread = calloc(1, sizeof(pthread_t));
-  if (!pthread) {
+  llmp_page_t *first_page = llmp_broker_first_page(broker);
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-    DBG("Failed to alloc pthread struct");
-    afl_shmem_deinit(&client_map);
-    return false;
+    afl_shmem_t *map = &broker->lanes[lane_id].broadcast_maps[0];
+    first_page->lanes[lane_id].map_size = map->map_size;
+    memcpy(first_page->lanes[lane_id].shm_str, map->shm_str,
+           AFL_SHMEM_STRLEN_MAX);
 
   }
 
-  llmp_broker_client_metadata_t *client = llmp_broker_register_client(
-      broker, client_map.shm_str, client_map.map_size);
-  if (!client) {
-
-    DBG("Could not register threaded client");
-    afl_shmem_deinit(&client_map);
-    free(pthread);
-    return false;
+  return true;
 
-  }
+}
 
-  client->clientloop = clientloop;
-  client->data = data;
-  client->pthread = pthread;
+/* Destroys the broadcast pages of all lanes */
+static void llmp_broker_deinit_lanes(llmp_broker_state_t *broker) {
 
-  /* Copy the already allocated shmem to the client state */
-  if (!afl_realloc((void *)&client->client_state->out_maps,
-                   sizeof(afl_shmem_t))) {
+  u32    lane_id;
+  size_t i;
 
-    DBG("Could not alloc mem for client map");
-    afl_shmem_deinit(&client_map);
-    afl_shmem_deinit(client->cur_client_map);
-    free(pthread);
-    /* "Unregister" by subtracting the client from count */
-    broker->llmp_client_count--;
-    return false;
+  for (lane_id = 0; lane_id < LLMP_LANE_COUNT; lane_id++) {
 
-  }
+    llmp_broker_lane_t *lane = &broker->lanes[lane_id];
+    for (i = 0; i < lane->broadcast_map_count; i++) {
 
-  memcpy(client->client_state->out_maps, &client_map, sizeof(afl_shmem_t));
-  client->client_state->out_map_count = 1;
+      afl_shmem_deinit(&lane->broadcast_maps[i]);
 
-  /* Each client starts with the very first map.
-  They should then iterate through all maps once and work on all old messages.
-  */
-  client->client_state->current_broadcast_map = &broker->broadcast_maps[0];
-  client->client_state->out_map_count = 1;
+    }
 
-  DBG("Registered threaded client with id %d (loop func at %p)",
-      client->client_state->id, client->clientloop);
+    afl_free(lane->broadcast_maps);
+    lane->broadcast_maps = NULL;
+    lane->broadcast_map_count = 0;
 
-  return true;
+  }
 
 }
 
-/* Register a simple tcp client that will listen for new shard map clients via
- * tcp */
-bool llmp_broker_register_local_server(llmp_broker_state_t *broker, int port) {
+/* Broadcasts msgs with this tag on the given lane */
+afl_ret_t llmp_broker_route_tag(llmp_broker_state_t *broker, u32 tag,
+                                u32 lane) {
 
-  if (!llmp_broker_register_threaded_clientloop(
-          broker, llmp_clientloop_process_server, (void *)(size_t)port)) {
+  size_t i;
 
-    DBG("Error registering new threaded client");
-    return false;
+  if (lane >= LLMP_LANE_COUNT) { return AFL_RET_ARRAY_END; }
 
-  }
+  for (i = 0; i < broker->tag_route_count; i++) {
 
-  return true;
+    if (broker->tag_routes[i].tag == tag) {
 
-}
+      broker->tag_routes[i].lane = lane;
+      return AFL_RET_SUCCESS;
 
-/* Adds a hook that gets called for each new message the broker touches.
-if the callback returns false, the message is not forwarded to the clients. */
-afl_ret_t llmp_broker_add_message_hook(llmp_broker_state_t *   broker,
-                                       llmp_message_hook_func *hook,
-                                       void *                  data) {
+    }
 
-  if (!afl_realloc(
-          (void **)&broker->msg_hooks,
-          (broker->msg_hook_count + 1) * sizeof(llmp_message_hook_data_t))) {
+  }
+
+  if (!afl_realloc((void **)&broker->tag_routes,
+                   (broker->tag_route_count + 1) * sizeof(llmp_tag_route_t))) {
 
-    DBG("realloc for msg hooks failed");
     return AFL_RET_ALLOC;
 
   }
 
-  broker->msg_hooks[broker->msg_hook_count].func = hook;
-  broker->msg_hooks[broker->msg_hook_count].data = data;
-  broker->msg_hook_count++;
+  broker->tag_routes[broker->tag_route_count].tag = tag;
+  broker->tag_routes[broker->tag_route_count].lane = lane;
+  broker->tag_route_count++;
+
   return AFL_RET_SUCCESS;
 
 }
@@ -1371,28 +5349,108 @@ llmp_broker_state_t *llmp_broker_new() {
   if (!broker) { FATAL("Could not allocate broker mem"); }
 
   /* let's create some space for outgoing maps */
-  if (!afl_realloc((void **)&broker->broadcast_maps, 1 * sizeof(afl_shmem_t))) {
+  if (!llmp_broker_init_lanes(broker)) {
 
+    llmp_broker_deinit_lanes(broker);
     free(broker);
     return NULL;
 
   }
 
-  broker->broadcast_map_count = 1;
-
-  if (!llmp_new_page_shmem(_llmp_broker_current_broadcast_map(broker), -1,
-                           LLMP_INITIAL_MAP_SIZE)) {
+  /* Tools can watch this, without ever slowing us down */
+  if (!llmp_shmem_init(&broker->stats_map, sizeof(llmp_stats_page_t))) {
 
-    afl_free(broker->broadcast_maps);
+    llmp_broker_deinit_lanes(broker);
     free(broker);
     return NULL;
 
   }
 
+  memset(broker->stats_map.map, 0, sizeof(llmp_stats_page_t));
+  llmp_broker_stats(broker)->layout_version =
+      LLMP_LAYOUT_MAGIC | LLMP_LAYOUT_VERSION;
+
+  broker->gc_max_lag = LLMP_GC_DEFAULT_MAX_LAG;
+
+  /* Good enough to tell a few nodes apart. Never 0. */
+  broker->node_id =
+      (llmp_time_us() ^ ((u64)getpid() << 20)) % LLMP_NODE_ID_MASK + 1;
+
   return broker;
 
 }
 
+/* Destroys the broker and the state of all its threaded clients */
+void llmp_broker_destroy(llmp_broker_state_t *broker) {
+
+  size_t i;
+
+  /* They may still look at client maps */
+  llmp_broker_stop_hook_workers(broker);
+
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    llmp_broker_client_metadata_t *client = &broker->llmp_clients[i];
+
+    afl_shmem_deinit(client->cur_client_map);
+    free(client->cur_client_map);
+    afl_shmem_unmap(&client->cur_priority_map);
+    llmp_pool_clear(&client->map_pool, false);
+    free(client->pthread);
+    if (client->clientloop == llmp_clientloop_bridge) {
+
+      llmp_bridge_free(client->data);
+
+    } else if (client->clientloop == llmp_clientloop_unix_server) {
+
+      llmp_unix_server_free(client->data);
+
+    }
+
+    /* For remote clients, this is just our metadata */
+    llmp_client_destroy(client->client_state);
+
+  }
+
+  for (i = 0; i < broker->retained_map_count; i++) {
+
+    afl_shmem_deinit(&broker->retained_maps[i].map);
+
+  }
+
+  for (i = 0; i < broker->oob_segment_count; i++) {
+
+    llmp_oob_release(&broker->oob_segments[i].map);
+
+  }
+
+  llmp_broker_deinit_lanes(broker);
+  llmp_pool_clear(&broker->broadcast_pool, true);
+  afl_shmem_deinit(&broker->stats_map);
+
+  afl_free(broker->llmp_clients);
+  afl_free(broker->retained_maps);
+  afl_free(broker->oob_segments);
+  afl_free(broker->tag_routes);
+  afl_free(broker->msg_hooks);
+  if (broker->dedup) {
+
+    free(broker->dedup->slots);
+    free(broker->dedup);
+
+  }
+
+  if (broker->journal) {
+
+    llmp_journal_close(broker->journal);
+    free(broker->journal);
+
+  }
+
+  free(broker);
+
+}
+
 /* Other files may dbg too */
 #undef DBG
 
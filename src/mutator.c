@@ -402,24 +402,37 @@ retry_splicing:
       // Grab a random entry from the random feedback queue
       feedback_queue_t *random_fbck_queue =
           global_queue->feedback_queues[random_queue_idx];
-      splice_input = (random_fbck_queue->base.size > 0)
-                         ? random_fbck_queue->base
-                               .queue_entries[afl_rand_below(
-                                   &engine->rnd, random_fbck_queue->base.size)]
-                               ->input
-                         : NULL;
+      if (random_fbck_queue->base.size > 0) {
+
+        queue_entry_t *entry = afl_base_queue_entry(
+            &random_fbck_queue->base,
+            afl_rand_below(&engine->rnd, random_fbck_queue->base.size));
+        splice_input = entry->funcs.get_input(entry);
+
+      } else {
+
+        splice_input = NULL;
+
+      }
 
       if (splice_input && !splice_input->bytes) { splice_input = NULL; }
 
     } else {
 
       // Grab a random entry from the global queue
-      splice_input = (global_queue->base.size > 0)
-                         ? global_queue->base
-                               .queue_entries[afl_rand_below(
-                                   &engine->rnd, global_queue->base.size)]
-                               ->input
-                         : NULL;
+      if (global_queue->base.size > 0) {
+
+        queue_entry_t *entry = afl_base_queue_entry(
+            &global_queue->base,
+            afl_rand_below(&engine->rnd, global_queue->base.size));
+        splice_input = entry->funcs.get_input(entry);
+
+      } else {
+
+        splice_input = NULL;
+
+      }
+
       if (splice_input && !splice_input->bytes) { splice_input = NULL; }
 
     }
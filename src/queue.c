@@ -35,11 +35,19 @@
 afl_ret_t afl_queue_entry_init(queue_entry_t *entry, raw_input_t *input) {
 
   entry->input = input;
+  entry->parent_idx = QUEUE_ENTRY_NO_PARENT;
+  entry->children = NULL;
+  entry->children_num = 0;
+  entry->from_wire = false;
+  entry->own_file = false;
+  entry->ram_size = 0;
 
   entry->funcs.get_input = afl_get_input_default;
+  entry->funcs.is_on_disk = afl_is_on_disk_default;
   entry->funcs.get_next = afl_get_next_default;
   entry->funcs.get_prev = afl_get_prev_default;
   entry->funcs.get_parent = afl_get_parent_default;
+  entry->funcs.get_child = afl_get_child_default;
 
   return AFL_RET_SUCCESS;
 
@@ -56,30 +64,185 @@ void afl_queue_entry_deinit(queue_entry_t *entry) {
   entry->next = NULL;
   entry->prev = NULL;
   entry->queue = NULL;
-  entry->parent = NULL;
-  entry->filename = NULL;
+  entry->parent_idx = QUEUE_ENTRY_NO_PARENT;
 
-  /* Clear all the children entries?? */
-  if (entry->children_num) {
+  /* The file stays, it's part of the corpus */
+  if (entry->own_file) {
 
-    LIST_FOREACH_CLEAR(&(entry->children), queue_entry_t,
-                       { afl_queue_entry_deinit(el); })
+    free(entry->filename);
+    entry->filename = NULL;
+    entry->own_file = false;
 
   }
 
+  entry->on_disk = false;
+
+  /* The children themselves belong to the queue */
+  afl_free(entry->children);
+  entry->children = NULL;
+  entry->children_num = 0;
+
   /* we also delete the input associated with it */
   afl_input_delete(entry->input);
   entry->input = NULL;
 
 }
 
+/* The bytes an input keeps in memory */
+static inline size_t afl_queue_input_size(raw_input_t *input) {
+
+  return input->bytes && !input->mapped ? input->len + 1 : 0;
+
+}
+
+/* Counts the input of the entry in the ram of the queue again, as it is now.
+ * Its len may have changed since, e.g. by clear or deserialize. */
+static inline void afl_queue_entry_account(base_queue_t * queue,
+                                           queue_entry_t *entry) {
+
+  queue->ram_used -= entry->ram_size;
+  entry->ram_size = afl_queue_input_size(entry->input);
+  queue->ram_used += entry->ram_size;
+
+}
+
+/* Writes the input of the entry to its file (once), and frees its bytes. Empty
+ * inputs stay in memory, without bytes. */
+static afl_ret_t afl_queue_entry_evict(base_queue_t *queue,
+                                       queue_entry_t *entry) {
+
+  raw_input_t *input = entry->input;
+  afl_ret_t    err;
+
+  /* Nothing to keep for empty inputs (and empty files don't load again) */
+  if (!input->len) {
+
+    afl_input_release_bytes(input);
+    afl_queue_entry_account(queue, entry);
+    return AFL_RET_SUCCESS;
+
+  }
+
+  if (!entry->filename) {
+
+    int len = snprintf(NULL, 0, "%s/queue_%06zu", queue->dirpath, entry->idx);
+    entry->filename = malloc(len + 1);
+    if (!entry->filename) { return AFL_RET_ALLOC; }
+    entry->own_file = true;
+    snprintf(entry->filename, len + 1, "%s/queue_%06zu", queue->dirpath,
+             entry->idx);
+
+    /* Left over from an earlier run, the directory is ours */
+    unlink(entry->filename);
+    err = input->funcs.save_to_file(input, entry->filename);
+    if (err != AFL_RET_SUCCESS) {
+
+      free(entry->filename);
+      entry->filename = NULL;
+      entry->own_file = false;
+      return err;
+
+    }
+
+  }
+
+  afl_input_release_bytes(input);
+  afl_queue_entry_account(queue, entry);
+  entry->on_disk = true;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Evicts inputs until the queue is within its ram budget again. CLOCK: the
+ * hand sweeps over the entries, giving those referenced since the last sweep
+ * a second chance. */
+static void afl_base_queue_evict(base_queue_t *queue) {
+
+  size_t steps;
+
+  if (!queue->ram_budget) { return; }
+
+  /* Two sweeps clear all referenced bits, whatever is left is pinned */
+  for (steps = 0;
+       queue->ram_used > queue->ram_budget && steps < 2 * queue->size;
+       steps++) {
+
+    if (queue->clock_hand >= queue->size) { queue->clock_hand = 0; }
+    queue_entry_t *entry = afl_base_queue_entry(queue, queue->clock_hand++);
+
+    /* Mapped inputs live in the page cache, not on our heap */
+    if (entry->on_disk || entry->pinned || !entry->input->bytes ||
+        entry->input->mapped) {
+
+      continue;
+
+    }
+
+    if (entry->referenced) {
+
+      entry->referenced = false;
+      continue;
+
+    }
+
+    afl_ret_t err = afl_queue_entry_evict(queue, entry);
+    if (err != AFL_RET_SUCCESS) {
+
+      WARNF("Could not evict queue entry %zu: %s", entry->idx,
+            afl_ret_stringify(err));
+      return;
+
+    }
+
+  }
+
+}
+
 // Default implementations for the queue entry vtable functions
 raw_input_t *afl_get_input_default(queue_entry_t *entry) {
 
+  base_queue_t *queue = entry->queue;
+
+  if (entry->on_disk) {
+
+    afl_ret_t err =
+        entry->input->funcs.load_from_file(entry->input, entry->filename);
+    if (err != AFL_RET_SUCCESS) {
+
+      WARNF("Could not reload queue entry from %s: %s", entry->filename,
+            afl_ret_stringify(err));
+      return NULL;
+
+    }
+
+    entry->on_disk = false;
+
+  }
+
+  entry->referenced = true;
+  if (queue) { afl_queue_entry_account(queue, entry); }
+
+  if (queue && queue->ram_budget && queue->ram_used > queue->ram_budget) {
+
+    /* Don't evict what we just got */
+    bool pinned = entry->pinned;
+    entry->pinned = true;
+    afl_base_queue_evict(queue);
+    entry->pinned = pinned;
+
+  }
+
   return entry->input;
 
 }
 
+bool afl_is_on_disk_default(queue_entry_t *entry) {
+
+  return entry->on_disk;
+
+}
+
 queue_entry_t *afl_get_next_default(queue_entry_t *entry) {
 
   return entry->next;
@@ -94,7 +257,121 @@ queue_entry_t *afl_get_prev_default(queue_entry_t *entry) {
 
 queue_entry_t *afl_get_parent_default(queue_entry_t *entry) {
 
-  return entry->parent;
+  if (!entry->queue || entry->parent_idx == QUEUE_ENTRY_NO_PARENT) {
+
+    return NULL;
+
+  }
+
+  return afl_base_queue_entry(entry->queue, entry->parent_idx);
+
+}
+
+queue_entry_t *afl_get_child_default(queue_entry_t *entry, size_t nth) {
+
+  if (!entry->queue || nth >= entry->children_num) { return NULL; }
+
+  return afl_base_queue_entry(entry->queue, entry->children[nth]);
+
+}
+
+afl_ret_t afl_queue_entry_add_child(queue_entry_t *parent,
+                                    queue_entry_t *child) {
+
+  if (!parent->queue || parent->queue != child->queue) {
+
+    return AFL_RET_NULL_QUEUE_ENTRY;
+
+  }
+
+  if (!afl_realloc((void **)&parent->children,
+                   (parent->children_num + 1) * sizeof(size_t))) {
+
+    return AFL_RET_ALLOC;
+
+  }
+
+  parent->children[parent->children_num++] = child->idx;
+  child->parent_idx = parent->idx;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_queue_entry_to_wire(queue_entry_t *entry, queue_entry_wire_t *wire) {
+
+  wire->version = QUEUE_WIRE_VERSION;
+  wire->flags = 0;
+  wire->len = entry->input->len;
+  wire->exec_us = 0;
+  memcpy(wire->buf, entry->input->bytes, entry->input->len);
+
+}
+
+afl_ret_t afl_queue_entry_from_wire(queue_entry_wire_t *wire, size_t len,
+                                    raw_input_t *input) {
+
+  if (len < sizeof(queue_entry_wire_t) ||
+      wire->version != QUEUE_WIRE_VERSION ||
+      wire->len > len - sizeof(queue_entry_wire_t)) {
+
+    return AFL_RET_MALFORMED_MSG;
+
+  }
+
+  /* Same as load_from_file, keep a 0 byte after the input */
+  if (input->mapped) { afl_input_release_bytes(input); }
+  u8 *bytes = realloc(input->bytes, wire->len + 1);
+  if (!bytes) { return AFL_RET_ALLOC; }
+
+  memcpy(bytes, wire->buf, wire->len);
+  bytes[wire->len] = 0;
+  input->bytes = bytes;
+  input->len = wire->len;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+afl_ret_t afl_queue_index_set(queue_index_t *index, size_t idx,
+                              queue_entry_t *entry) {
+
+  size_t chunk = 63 - __builtin_clzll(idx + QUEUE_INDEX_FIRST_CHUNK) -
+                 QUEUE_INDEX_FIRST_CHUNK_POW2;
+
+  if (chunk >= index->chunk_count) {
+
+    /* Only ever appended to, so this is the next chunk */
+    if (chunk != index->chunk_count || chunk >= QUEUE_INDEX_CHUNKS) {
+
+      return AFL_RET_ARRAY_END;
+
+    }
+
+    index->chunks[chunk] = calloc((size_t)QUEUE_INDEX_FIRST_CHUNK << chunk,
+                                  sizeof(queue_entry_t *));
+    if (!index->chunks[chunk]) { return AFL_RET_ALLOC; }
+    index->chunk_count++;
+
+  }
+
+  *afl_queue_index_slot(index, idx) = entry;
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_queue_index_clear(queue_index_t *index) {
+
+  size_t i;
+
+  for (i = 0; i < index->chunk_count; i++) {
+
+    free(index->chunks[i]);
+    index->chunks[i] = NULL;
+
+  }
+
+  index->chunk_count = 0;
 
 }
 
@@ -108,6 +385,10 @@ afl_ret_t afl_base_queue_init(base_queue_t *queue) {
   queue->size = 0;
   queue->base = NULL;
   queue->current = 0;
+  queue->ram_budget = 0;
+  queue->ram_used = 0;
+  queue->clock_hand = 0;
+  queue->corpus = NULL;
 
   queue->funcs.add_to_queue = afl_add_to_queue_default;
   queue->funcs.get_queue_base = afl_get_queue_base_default;
@@ -118,17 +399,9 @@ afl_ret_t afl_base_queue_init(base_queue_t *queue) {
   queue->funcs.set_directory = afl_set_directory_default;
   queue->funcs.set_engine = afl_set_engine_base_queue_default;
   queue->funcs.get_next_in_queue = afl_get_next_base_queue_default;
-  queue->shared_mem = calloc(1, sizeof(afl_shmem_t));
-  if (!queue->shared_mem) { return AFL_RET_ALLOC; }
 
-  queue->queue_entries =
-      (queue_entry_t **)afl_shmem_init(queue->shared_mem, MAP_SIZE);
-  if (!queue->queue_entries) {
-
-    free(queue->shared_mem);
-    return AFL_RET_ALLOC;
-
-  }
+  /* Chunks get allocated as the queue grows */
+  memset(&queue->entries, 0, sizeof(queue_index_t));
 
   return AFL_RET_SUCCESS;
 
@@ -159,8 +432,27 @@ void afl_base_queue_deinit(base_queue_t *queue) {
   queue->dirpath = NULL;
   queue->fuzz_started = false;
 
-  afl_shmem_deinit(queue->shared_mem);
-  free(queue->shared_mem);
+  afl_queue_index_clear(&queue->entries);
+  queue->ram_budget = 0;
+  queue->ram_used = 0;
+  queue->clock_hand = 0;
+
+}
+
+void afl_base_queue_set_corpus(base_queue_t *queue, afl_corpus_t *corpus) {
+
+  queue->corpus = corpus;
+
+}
+
+afl_ret_t afl_base_queue_set_ram_budget(base_queue_t *queue, size_t budget) {
+
+  if (budget && !queue->save_to_files) { return AFL_RET_FILE_OPEN_ERROR; }
+
+  queue->ram_budget = budget;
+  afl_base_queue_evict(queue);
+
+  return AFL_RET_SUCCESS;
 
 }
 
@@ -204,19 +496,72 @@ void afl_add_to_queue_default(base_queue_t *queue, queue_entry_t *entry) {
 
   }
 
-  queue->queue_entries[queue->size] = entry;
+  afl_ret_t err = afl_queue_index_set(&queue->entries, queue->size, entry);
+  if (err != AFL_RET_SUCCESS) {
 
-  /* We broadcast a message when new entry found */
+    WARNF("Could not add entry to queue: %s", afl_ret_stringify(err));
+    return;
+
+  }
+
+  /* Inputs in the corpus store are shared by all processes mapping it */
+  raw_input_t *input = entry->input;
+  if (queue->corpus && !input->mapped) {
+
+    size_t id;
+    err = afl_corpus_append(queue->corpus, input->bytes, input->len, &id);
+    if (err == AFL_RET_SUCCESS) {
+
+      err = afl_corpus_input(queue->corpus, id, input);
+
+    }
+
+    if (err != AFL_RET_SUCCESS) {
+
+      WARNF("Could not append input to corpus: %s", afl_ret_stringify(err));
+
+    }
+
+  }
+
+  entry->queue = queue;
+  entry->idx = queue->size;
+  entry->referenced = true;
+  afl_queue_entry_account(queue, entry);
+
+  /* We broadcast a message when new entry found, unless others sent it to us
+   * in the first place */
 
   llmp_client_state_t *llmp_client = queue->engine->llmp_client;
-  llmp_message_t *     msg =
-      llmp_client_alloc_next(llmp_client, sizeof(queue_entry_t));
-  msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY;
-  ((queue_entry_t *)msg->buf)[0] = *entry;
-  llmp_client_send(llmp_client, msg);
+  if (llmp_client && !entry->from_wire) {
+
+    llmp_message_t *msg =
+        llmp_client_alloc_next(llmp_client, afl_queue_entry_wire_len(entry));
+    if (msg) {
+
+      queue_entry_wire_t *wire = (queue_entry_wire_t *)msg->buf;
+      msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY;
+      afl_queue_entry_to_wire(entry, wire);
+
+      /* New entries get added right after they ran */
+      if (queue->engine->last_exec_us) {
+
+        wire->exec_us = queue->engine->last_exec_us;
+        wire->flags |= QUEUE_WIRE_EXEC_US;
+
+      }
+
+      llmp_client_send(llmp_client, msg);
+
+    }
+
+  }
 
   queue->size++;
 
+  /* The new entry was just used */
+  afl_base_queue_evict(queue);
+
 }
 
 queue_entry_t *afl_get_queue_base_default(base_queue_t *queue) {
@@ -279,7 +624,7 @@ queue_entry_t *afl_get_next_base_queue_default(base_queue_t *queue,
 
   if (queue->size) {
 
-    queue_entry_t *current = queue->queue_entries[queue->current];
+    queue_entry_t *current = afl_base_queue_entry(queue, queue->current);
 
     if (engine_id != queue->engine_id) {
 
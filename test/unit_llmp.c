@@ -6,6 +6,10 @@
 #include <cmocka.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 /* cmocka < 1.0 didn't support these features we need */
 #ifndef assert_ptr_equal
   #define assert_ptr_equal(a, b)                                      \
@@ -50,19 +54,1483 @@ int        __wrap_printf(const char *format, ...) {
 static void test_llmp_client(void **state) {
 
   llmp_client_state_t *client = llmp_client_new_unconnected();
-  llmp_client_alloc_next(client, LLMP_INITIAL_MAP_SIZE + 10);
+  llmp_message_t *     msg =
+      llmp_client_alloc_next(client, LLMP_INITIAL_MAP_SIZE + 10);
 
-  // Make sure larger allocations work and create a new map :)
-  assert_int_equal(client->out_map_count, 2);
+  // Make sure larger allocations work, out of band, without a new map :)
+  assert_non_null(msg);
+  assert_int_equal(msg->buf_len, LLMP_INITIAL_MAP_SIZE + 10);
+  assert_int_equal(client->out_map_count, 1);
+  assert_int_equal(client->oob_segment_count, 1);
   llmp_client_destroy(client);
 
 }
 
+/* Fields written by different parties must not share a cache line */
+static void test_llmp_page_layout(void **state) {
+
+  (void)state;
+
+  size_t line = LLMP_CACHE_LINE_SIZE;
+
+  assert_int_equal(offsetof(llmp_page_t, size_total) / line, 0);
+  assert_int_equal(offsetof(llmp_page_t, current_msg_id) / line, 1);
+  assert_int_equal(offsetof(llmp_page_t, new_msg_doorbell) / line, 1);
+  assert_int_equal(offsetof(llmp_page_t, size_used) / line, 2);
+  assert_int_equal(offsetof(llmp_page_t, max_alloc_size) / line, 2);
+  assert_int_equal(offsetof(llmp_page_t, save_to_unmap) / line, 3);
+  assert_int_equal(offsetof(llmp_page_t, bytes_consumed) / line, 3);
+  assert_int_equal(offsetof(llmp_page_t, link_seq) / line, 4);
+  assert_int_equal(offsetof(llmp_page_t, priority_map) / line, 4);
+  assert_int_equal(offsetof(llmp_page_t, broker_doorbell) / line, 5);
+  assert_int_equal(offsetof(llmp_page_t, lanes_doorbell) / line, 5);
+  assert_int_equal(offsetof(llmp_page_t, msgs_recvd) / line, 6);
+  assert_int_equal(offsetof(llmp_page_t, recv_msg_ids) / line, 6);
+  assert_int_equal(offsetof(llmp_page_t, flow_drops) / line, 6);
+  assert_int_equal(offsetof(llmp_page_t, lanes) % line, 0);
+  assert_int_equal(offsetof(llmp_page_t, messages) % line, 0);
+  assert_int_equal(offsetof(llmp_message_t, buf) % LLMP_MSG_ALIGNMENT, 0);
+
+  /* Odd sizes must not misalign the msgs behind them */
+  llmp_client_state_t *client = llmp_client_new_unconnected();
+  llmp_message_t *     msg;
+  size_t               i;
+  for (i = 1; i < 100; i += 7) {
+
+    msg = llmp_client_alloc_next(client, i);
+    assert_non_null(msg);
+    assert_int_equal((size_t)msg % LLMP_MSG_ALIGNMENT, 0);
+    assert_int_equal((size_t)msg->buf % LLMP_MSG_ALIGNMENT, 0);
+    msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY;
+    assert_true(llmp_client_send(client, msg));
+
+  }
+
+  llmp_client_destroy(client);
+
+}
+
+/* Just a u32 counter in a msg, for testing purposes */
+#define LLMP_TAG_TEST_COUNTER_V1 (0x7E57C0)
+
+/* Checks a msg sent by llmp_test_forward */
+static void llmp_test_check_msg(llmp_message_t *msg, u32 sender_id,
+                                size_t msg_len, u32 i) {
+
+  assert_non_null(msg);
+  assert_int_equal((size_t)msg->buf % LLMP_MSG_ALIGNMENT, 0);
+  assert_int_equal(msg->tag, LLMP_TAG_TEST_COUNTER_V1);
+  assert_int_equal(msg->sender, sender_id);
+  assert_int_equal(msg->buf_len, msg_len);
+  assert_int_equal(((u32 *)msg->buf)[0], i);
+  assert_int_equal(msg->buf[msg_len - 1], 0x41);
+
+}
+
+/* Sends msgs from one threaded client to another through the broker, spanning
+ * multiple pages. In batch mode, the receiver reads them in batches. */
+static void llmp_test_forward(bool zero_copy, bool batch) {
+
+  /* Large enough to fill up a few pages */
+  size_t msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  u32    msg_count = 50;
+  u32    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  llmp_broker_set_zero_copy(broker, zero_copy);
+
+  /* We never launch the clientloops, but drive the clients ourselves */
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+
+  for (i = 0; i < msg_count; i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(sender, msg_len);
+    assert_non_null(msg);
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+    llmp_broker_once(broker);
+
+  }
+
+  assert_true(sender->out_map_count > 1);
+  /* Zero copy only broadcasts small references, fitting in the first page,
+  but needs to keep old client maps around */
+  assert_int_equal(broker->lanes[0].broadcast_map_count > 1, !zero_copy);
+  assert_int_equal(broker->retained_map_count > 0, zero_copy);
+
+  if (batch) {
+
+    /* Batches span EOPs, all msgs of a batch need to stay readable */
+    llmp_message_t *msgs[16];
+    size_t          count;
+    size_t          j;
+
+    for (i = 0; i < msg_count; i += count) {
+
+      count = llmp_client_recv_batch(receiver, msgs, 16);
+      assert_int_equal(count, MIN((u32)16, msg_count - i));
+      for (j = 0; j < count; j++) {
+
+        llmp_test_check_msg(msgs[j], sender->id, msg_len, i + j);
+
+      }
+
+    }
+
+    assert_int_equal(llmp_client_recv_batch(receiver, msgs, 16), 0);
+
+  } else {
+
+    for (i = 0; i < msg_count; i++) {
+
+      llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+    }
+
+    assert_null(llmp_client_recv(receiver));
+
+  }
+
+  llmp_broker_destroy(broker);
+
+}
+
+static void test_llmp_broker_forward(void **state) {
+
+  llmp_test_forward(false, false);
+
+}
+
+static void test_llmp_broker_forward_zero_copy(void **state) {
+
+  llmp_test_forward(true, false);
+
+}
+
+static void test_llmp_client_recv_batch(void **state) {
+
+  llmp_test_forward(false, true);
+
+}
+
+static void test_llmp_client_recv_batch_zero_copy(void **state) {
+
+  llmp_test_forward(true, true);
+
+}
+
+/* Many small msgs pending at once get forwarded in spans, across pages */
+static void test_llmp_broker_forward_span(void **state) {
+
+  size_t msg_len = 61;
+  u32    msg_count = 3 * LLMP_INITIAL_MAP_SIZE / 64;
+  u32    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+
+  for (i = 0; i < msg_count; i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(sender, msg_len);
+    assert_non_null(msg);
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_broker_once(broker);
+  assert_true(broker->lanes[0].broadcast_map_count > 1);
+
+  for (i = 0; i < msg_count; i++) {
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+
+  llmp_broker_destroy(broker);
+
+}
+
+/* Sends a msg through the broker and has the receiver read it right away */
+static void llmp_test_send_recv(llmp_broker_state_t *broker,
+                                llmp_client_state_t *sender,
+                                llmp_client_state_t *receiver, size_t msg_len,
+                                u32 i) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(sender, msg_len);
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  memset(msg->buf, 0x41, msg_len);
+  ((u32 *)msg->buf)[0] = i;
+  assert_true(llmp_client_send(sender, msg));
+
+  llmp_broker_once(broker);
+
+  llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+}
+
+/* Broadcast pages get freed once all clients read past them */
+static void test_llmp_broker_gc(void **state) {
+
+  size_t msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  u32    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  llmp_client_state_t *lagging = broker->llmp_clients[2].client_state;
+
+  llmp_client_ignore_broadcasts(sender);
+
+  for (i = 0; i < 100; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  /* The lagging client never read anything, so all pages stay */
+  assert_true(broker->lanes[0].broadcast_map_count > 4);
+  size_t pinned_usage = llmp_broker_shm_usage(broker);
+
+  llmp_client_ignore_broadcasts(lagging);
+
+  for (; i < 200; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  /* The first page, the page the receiver was on at the last EOP, and the
+   * current page */
+  assert_true(broker->lanes[0].broadcast_map_count <= 3);
+  assert_true(llmp_broker_shm_usage(broker) < pinned_usage);
+
+  /* A new client reads the first page, then continues at the oldest page */
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *late = broker->llmp_clients[3].client_state;
+
+  llmp_message_t *msg;
+  u32             last_counter = 0;
+  u32             count = 0;
+  while ((msg = llmp_client_recv(late))) {
+
+    u32 counter = ((u32 *)msg->buf)[0];
+    if (count) { assert_true(counter > last_counter); }
+    last_counter = counter;
+    count++;
+
+  }
+
+  assert_int_equal(last_counter, 199);
+  assert_true(count < 200);
+
+  llmp_broker_destroy(broker);
+
+}
+
+/* Clients that are gone, or too far behind, don't keep pages around. The
+ * lagging one starts over once it reads again. */
+static void test_llmp_broker_gc_liveness(void **state) {
+
+  size_t             msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  afl_shmem_t        stats_map = {0};
+  llmp_stats_page_t *stats;
+  llmp_message_t *   msg;
+  u32                last_counter = 0;
+  u32                count = 0;
+  u32                i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  llmp_broker_set_gc_max_lag(broker, 2);
+
+  for (i = 0; i < 4; i++) {
+
+    assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+
+  }
+
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  llmp_client_state_t *lagging = broker->llmp_clients[2].client_state;
+
+  llmp_client_ignore_broadcasts(sender);
+
+  /* The last client pretends to live in a process that's gone */
+  pid_t pid = fork();
+  assert_true(pid >= 0);
+  if (!pid) { _exit(0); }
+  assert_int_equal(waitpid(pid, NULL, 0), pid);
+  ((llmp_page_t *)broker->llmp_clients[3].cur_client_map->map)->pid = pid;
+
+  /* Get the lagging client past the first page */
+  for (i = 0; i < 20; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  while (llmp_client_recv(lagging)) {}
+
+  for (; i < 200; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  assert_true(broker->lanes[0].broadcast_map_count <= 4);
+
+  stats = llmp_stats_map(&stats_map, llmp_broker_stats_shm_str(broker));
+  assert_non_null(stats);
+  assert_int_equal(stats->gc_dead_clients, 1);
+  assert_int_equal(stats->gc_lagging_clients, 1);
+  afl_shmem_unmap(&stats_map);
+
+  /* Its page got reused, it gets the msgs still around instead */
+  while ((msg = llmp_client_recv(lagging))) {
+
+    u32 counter = ((u32 *)msg->buf)[0];
+    assert_int_equal(msg->tag, LLMP_TAG_TEST_COUNTER_V1);
+    assert_int_equal(msg->buf_len, msg_len);
+    assert_int_equal(msg->buf[msg_len - 1], 0x41);
+    if (count) { assert_true(counter > last_counter); }
+    last_counter = counter;
+    count++;
+
+  }
+
+  assert_int_equal(last_counter, 199);
+  assert_true(count < 180);
+
+  llmp_broker_destroy(broker);
+
+}
+
+/* Drops all msgs with a counter of 1000 or more */
+static bool llmp_test_drop_hook(llmp_broker_state_t *broker,
+                                llmp_message_t *msg, void *data) {
+
+  (void)broker;
+  (void)data;
+  return ((u32 *)msg->buf)[0] < 1000;
+
+}
+
+/* The broker keeps per client counters in a stats page others can map */
+static void test_llmp_broker_stats(void **state) {
+
+  (void)state;
+
+  size_t                 msg_len = LLMP_INITIAL_MAP_SIZE / 4;
+  llmp_message_hook_func drop_hook = llmp_test_drop_hook;
+  afl_shmem_t            stats_map = {0};
+  u32                    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(
+      llmp_broker_add_message_hook(broker, &drop_hook, NULL),
+      AFL_RET_SUCCESS);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+
+  llmp_client_ignore_broadcasts(sender);
+
+  /* Enough to fill a few pages */
+  for (i = 0; i < 10; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  llmp_message_t *msg = llmp_client_alloc_next(sender, sizeof(u32));
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  ((u32 *)msg->buf)[0] = 1000;
+  assert_true(llmp_client_send(sender, msg));
+  llmp_broker_once(broker);
+  assert_null(llmp_client_recv(receiver));
+
+  llmp_broker_update_stats(broker);
+
+  llmp_stats_page_t *stats =
+      llmp_stats_map(&stats_map, llmp_broker_stats_shm_str(broker));
+  assert_non_null(stats);
+
+  assert_int_equal(stats->client_count, 3);
+  assert_int_equal(stats->msgs_broadcast, 10);
+  assert_int_equal(stats->bytes_broadcast, 10 * msg_len);
+  assert_true(stats->eops > 0);
+
+  assert_int_equal(stats->clients[0].msgs_sent, 11);
+  assert_int_equal(stats->clients[0].bytes_sent, 10 * msg_len + sizeof(u32));
+  assert_int_equal(stats->clients[0].hook_drops, 1);
+  assert_true(stats->clients[0].eops > 0);
+  assert_int_equal(stats->clients[0].lag, 0);
+
+  assert_int_equal(stats->clients[1].msgs_recvd, 10);
+  assert_int_equal(stats->clients[1].bytes_recvd, 10 * msg_len);
+  assert_int_equal(stats->clients[1].lag, 0);
+
+  /* The third client never read anything */
+  assert_int_equal(stats->clients[2].msgs_recvd, 0);
+  assert_int_equal(stats->clients[2].lag, 10);
+
+  afl_shmem_unmap(&stats_map);
+  llmp_broker_destroy(broker);
+
+}
+
+/* Sends a queue entry msg with the given value */
+static void llmp_test_send_entry(llmp_client_state_t *sender, u32 tag, u32 i) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(sender, 64);
+  assert_non_null(msg);
+  msg->tag = tag;
+  memset(msg->buf, 0x41, 64);
+  ((u32 *)msg->buf)[0] = i;
+  assert_true(llmp_client_send(sender, msg));
+
+}
+
+/* The dedup hook only lets the first of equal queue entries through */
+static void test_llmp_dedup(void **state) {
+
+  (void)state;
+
+  afl_shmem_t     stats_map = {0};
+  llmp_message_t *msg;
+  u32             count;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(llmp_broker_enable_dedup(broker, 0), AFL_RET_SUCCESS);
+  assert_int_equal(broker->dedup->slot_count, LLMP_DEDUP_DEFAULT_SLOTS);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender_a = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *sender_b = broker->llmp_clients[1].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[2].client_state;
+
+  llmp_test_send_entry(sender_a, LLMP_TAG_NEW_QUEUE_ENTRY, 1);
+  llmp_test_send_entry(sender_b, LLMP_TAG_NEW_QUEUE_ENTRY, 1);
+  llmp_test_send_entry(sender_b, LLMP_TAG_NEW_QUEUE_ENTRY, 2);
+  /* Other tags pass, even with the same payload */
+  llmp_test_send_entry(sender_a, LLMP_TAG_TEST_COUNTER_V1, 1);
+  llmp_broker_once(broker);
+  llmp_test_send_entry(sender_a, LLMP_TAG_NEW_QUEUE_ENTRY, 2);
+  llmp_broker_once(broker);
+
+  count = 0;
+  while ((msg = llmp_client_recv(receiver))) {
+
+    if (msg->tag == LLMP_TAG_NEW_QUEUE_ENTRY) {
+
+      assert_int_equal(((u32 *)msg->buf)[0], count + 1);
+      count++;
+
+    }
+
+  }
+
+  assert_int_equal(count, 2);
+
+  llmp_stats_page_t *stats =
+      llmp_stats_map(&stats_map, llmp_broker_stats_shm_str(broker));
+  assert_non_null(stats);
+  assert_int_equal(stats->dedup_msgs, 4);
+  assert_int_equal(stats->dedup_drops, 2);
+
+  afl_shmem_unmap(&stats_map);
+  llmp_broker_destroy(broker);
+
+}
+
+/* Drops odd values, after a while */
+static bool llmp_test_async_odd_hook(llmp_broker_state_t *broker,
+                                     llmp_message_t *msg, void *data) {
+
+  (void)broker;
+  (void)data;
+  usleep(100);
+  return !(((u32 *)msg->buf)[0] % 2);
+
+}
+
+/* Counts msgs, slowly */
+static bool llmp_test_async_count_hook(llmp_broker_state_t *broker,
+                                       llmp_message_t *msg, void *data) {
+
+  (void)broker;
+  (void)msg;
+  usleep(1000);
+  __atomic_add_fetch((u32 *)data, 1, __ATOMIC_SEQ_CST);
+  return false;
+
+}
+
+/* Would drop everything, but takes too long to say so */
+static bool llmp_test_async_late_hook(llmp_broker_state_t *broker,
+                                      llmp_message_t *msg, void *data) {
+
+  (void)broker;
+  (void)msg;
+  (void)data;
+  usleep(2000);
+  return false;
+
+}
+
+/* Async hooks run on the workers, the broker only waits for verdicts in time
+ */
+static void test_llmp_async_hooks(void **state) {
+
+  (void)state;
+
+  llmp_message_hook_func odd_hook = llmp_test_async_odd_hook;
+  llmp_message_hook_func count_hook = llmp_test_async_count_hook;
+  llmp_message_hook_func late_hook = llmp_test_async_late_hook;
+  afl_shmem_t            stats_map = {0};
+  llmp_message_t *       msg;
+  u32                    count = 0, recvd = 0;
+  u32                    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(
+      llmp_broker_add_async_message_hook(broker, &odd_hook, NULL, 1000000),
+      AFL_RET_SUCCESS);
+  assert_int_equal(
+      llmp_broker_add_async_message_hook(broker, &count_hook, &count, 0),
+      AFL_RET_SUCCESS);
+  assert_int_equal(
+      llmp_broker_add_async_message_hook(broker, &late_hook, NULL, 1),
+      AFL_RET_SUCCESS);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+
+  for (i = 0; i < 20; i++) {
+
+    msg = llmp_client_alloc_next(sender, sizeof(u32));
+    assert_non_null(msg);
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_broker_once(broker);
+
+  while ((msg = llmp_client_recv(receiver))) {
+
+    if (msg->sender != sender->id) { continue; }
+    assert_int_equal(((u32 *)msg->buf)[0], recvd * 2);
+    recvd++;
+
+  }
+
+  assert_int_equal(recvd, 10);
+
+  llmp_stats_page_t *stats =
+      llmp_stats_map(&stats_map, llmp_broker_stats_shm_str(broker));
+  assert_non_null(stats);
+  assert_int_equal(stats->hook_timeouts, 20);
+  afl_shmem_unmap(&stats_map);
+
+  /* Waits for the remaining jobs */
+  llmp_broker_destroy(broker);
+  assert_int_equal(count, 20);
+
+}
+
+#define LLMP_TEST_JOURNAL "/tmp/llmp_test_journal"
+
+/* Forwarded msgs end up in the journal, a restarted broker sends them again */
+static void test_llmp_journal(void **state) {
+
+  (void)state;
+
+  size_t          msg_len = 64;
+  llmp_journal_t  journal = {0};
+  llmp_message_t *msg = NULL;
+  u32             i;
+
+  unlink(LLMP_TEST_JOURNAL);
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(llmp_broker_enable_journal(broker, LLMP_TEST_JOURNAL, 0),
+                   AFL_RET_SUCCESS);
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  u32                  sender_id = sender->id;
+
+  for (i = 0; i < 10; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  llmp_broker_destroy(broker);
+
+  /* Late clients can read it on their own */
+  assert_int_equal(llmp_journal_open(&journal, LLMP_TEST_JOURNAL),
+                   AFL_RET_SUCCESS);
+  assert_int_equal(journal.header->msg_count, 10);
+  for (i = 0; i < 10; i++) {
+
+    msg = llmp_journal_next(&journal, msg);
+    llmp_test_check_msg(msg, sender_id, msg_len, i);
+
+  }
+
+  assert_null(llmp_journal_next(&journal, msg));
+  llmp_journal_close(&journal);
+
+  /* Warm restart */
+  broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(llmp_broker_enable_journal(broker, LLMP_TEST_JOURNAL, 0),
+                   AFL_RET_SUCCESS);
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  receiver = broker->llmp_clients[0].client_state;
+
+  for (i = 0; i < 10; i++) {
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender_id, msg_len, i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+  llmp_broker_destroy(broker);
+  unlink(LLMP_TEST_JOURNAL);
+
+  /* Room for 10 msgs (no padding at this msg_len): once full, only the newer
+   * half stays */
+  broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(
+      llmp_broker_enable_journal(broker, LLMP_TEST_JOURNAL,
+                                 sizeof(llmp_journal_header_t) +
+                                     10 * (sizeof(llmp_message_t) + msg_len)),
+      AFL_RET_SUCCESS);
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  sender = broker->llmp_clients[0].client_state;
+  receiver = broker->llmp_clients[1].client_state;
+
+  for (i = 0; i < 23; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, msg_len, i);
+
+  }
+
+  /* Compacted on msgs 10, 15 and 20, down to 5 msgs each time */
+  assert_int_equal(broker->journal->header->msg_count, 8);
+  msg = NULL;
+  for (i = 15; i < 23; i++) {
+
+    msg = llmp_journal_next(broker->journal, msg);
+    llmp_test_check_msg(msg, sender->id, msg_len, i);
+
+  }
+
+  assert_null(llmp_journal_next(broker->journal, msg));
+
+  llmp_broker_destroy(broker);
+  unlink(LLMP_TEST_JOURNAL);
+
+}
+
+/* Msgs on their own lane, for testing purposes */
+#define LLMP_TAG_TEST_LANE_V1 (0x7E57A1)
+
+/* Clients only see (and pin) the lanes they subscribed to */
+static void test_llmp_broker_lanes(void **state) {
+
+  (void)state;
+
+  size_t          msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  llmp_message_t *msg;
+  u32             i, count;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(llmp_broker_route_tag(broker, LLMP_TAG_TEST_LANE_V1, 1),
+                   AFL_RET_SUCCESS);
+  assert_int_not_equal(
+      llmp_broker_route_tag(broker, LLMP_TAG_TEST_LANE_V1, LLMP_LANE_COUNT),
+      AFL_RET_SUCCESS);
+
+  for (i = 0; i < 4; i++) {
+
+    assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+
+  }
+
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *default_reader = broker->llmp_clients[1].client_state;
+  llmp_client_state_t *lane_reader = broker->llmp_clients[2].client_state;
+  llmp_client_state_t *all_reader = broker->llmp_clients[3].client_state;
+
+  llmp_client_ignore_broadcasts(sender);
+  llmp_client_subscribe(default_reader, LLMP_LANE_MASK(LLMP_LANE_DEFAULT));
+  llmp_client_subscribe(lane_reader, LLMP_LANE_MASK(1));
+
+  /* Fills a few pages of lane 1, nobody reads lane 0 for now */
+  for (i = 0; i < 100; i++) {
+
+    msg = llmp_client_alloc_next(sender, msg_len);
+    assert_non_null(msg);
+    msg->tag = i % 10 ? LLMP_TAG_TEST_LANE_V1 : LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+    llmp_broker_once(broker);
+
+    while ((msg = llmp_client_recv(lane_reader))) {
+
+      assert_int_equal(msg->tag, LLMP_TAG_TEST_LANE_V1);
+
+    }
+
+    while ((msg = llmp_client_recv(all_reader))) {}
+
+  }
+
+  /* The default reader never read lane 1, it doesn't pin its pages */
+  assert_true(broker->lanes[1].broadcast_map_count <= 3);
+  assert_null(default_reader->lanes[1].current_broadcast_map.map);
+  assert_null(lane_reader->lanes[LLMP_LANE_DEFAULT].current_broadcast_map.map);
+
+  count = 0;
+  while ((msg = llmp_client_recv(default_reader))) {
+
+    llmp_test_check_msg(msg, sender->id, msg_len, count * 10);
+    count++;
+
+  }
+
+  assert_int_equal(count, 10);
+
+  llmp_broker_destroy(broker);
+
+}
+
+/* Sends a bulk msg and a priority msg with the given value */
+static void llmp_test_send_both(llmp_client_state_t *sender, size_t msg_len,
+                                u32 i) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(sender, msg_len);
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  memset(msg->buf, 0x41, msg_len);
+  ((u32 *)msg->buf)[0] = i;
+  assert_true(llmp_client_send(sender, msg));
+
+  msg = llmp_client_alloc_next_priority(sender, msg_len);
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  memset(msg->buf, 0x41, msg_len);
+  ((u32 *)msg->buf)[0] = i + 1000;
+  assert_true(llmp_client_send(sender, msg));
+
+}
+
+/* Priority msgs overtake the bulk msgs sent before them */
+static void test_llmp_priority(void **state) {
+
+  (void)state;
+
+  size_t          msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  llmp_message_t *msg;
+  u32             i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  llmp_client_ignore_broadcasts(sender);
+
+  /* No priority maps until the first priority msg */
+  assert_int_equal(sender->priority_map_count, 0);
+
+  /* Queues up a few pages of bulk msgs first */
+  for (i = 0; i < 20; i++) {
+
+    msg = llmp_client_alloc_next(sender, msg_len);
+    assert_non_null(msg);
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  msg = llmp_client_alloc_next_priority(sender, msg_len);
+  assert_non_null(msg);
+  assert_int_equal(sender->priority_map_count, 1);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  memset(msg->buf, 0x41, msg_len);
+  ((u32 *)msg->buf)[0] = 1000;
+  assert_true(llmp_client_send(sender, msg));
+
+  llmp_broker_once(broker);
+
+  llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, 1000);
+  for (i = 0; i < 20; i++) {
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+
+  /* Both chains of out pages fill up and get reused */
+  for (i = 20; i < 100; i++) {
+
+    llmp_test_send_both(sender, msg_len, i);
+    llmp_broker_once(broker);
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len,
+                        i + 1000);
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+  }
+
+  assert_true(sender->priority_map_count <= 3);
+  assert_true(broker->lanes[LLMP_LANE_PRIORITY].broadcast_map_count <= 3);
+
+  llmp_broker_destroy(broker);
+
+}
+
+/* Large msgs go out of band and don't grow the pages. Their segments go away
+ * once the broadcast page with their descriptor is gone. */
+static void test_llmp_oob(void **state) {
+
+  (void)state;
+
+  size_t small_len = LLMP_INITIAL_MAP_SIZE / 16;
+  size_t large_len = 4 * LLMP_INITIAL_MAP_SIZE;
+  u32    i;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  llmp_client_ignore_broadcasts(sender);
+
+  /* Descriptors on the first broadcast page would be kept forever */
+  for (i = 0; i < 20; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, small_len, i);
+
+  }
+
+  for (i = 20; i < 23; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, large_len, i);
+
+  }
+
+  assert_int_equal(sender->oob_segment_count, 3);
+  assert_int_equal(broker->oob_segment_count, 3);
+
+  /* Nothing grew */
+  for (i = 0; i < sender->out_map_count; i++) {
+
+    assert_int_equal(sender->out_maps[i].map_size, LLMP_INITIAL_MAP_SIZE);
+
+  }
+
+  for (i = 0; i < broker->lanes[0].broadcast_map_count; i++) {
+
+    assert_int_equal(broker->lanes[0].broadcast_maps[i].map_size,
+                     LLMP_INITIAL_MAP_SIZE);
+
+  }
+
+  /* Reading past the page with the descriptors releases the segments */
+  for (i = 23; i < 60; i++) {
+
+    llmp_test_send_recv(broker, sender, receiver, small_len, i);
+
+  }
+
+  assert_int_equal(broker->oob_segment_count, 0);
+
+  /* The sender frees them on its next out of band msg */
+  llmp_test_send_recv(broker, sender, receiver, large_len, 60);
+  assert_int_equal(sender->oob_segment_count, 1);
+
+  llmp_broker_destroy(broker);
+
+}
+
+static volatile bool llmp_test_broker_stop;
+
+/* A broker thread that takes its time */
+static void *llmp_test_slow_broker(void *data) {
+
+  llmp_broker_state_t *broker = (llmp_broker_state_t *)data;
+
+  while (!llmp_test_broker_stop) {
+
+    llmp_broker_once(broker);
+    usleep(1000);
+
+  }
+
+  llmp_broker_once(broker);
+  return NULL;
+
+}
+
+/* A client the broker can't keep up with drops or waits, as told */
+static void test_llmp_flow_control(void **state) {
+
+  (void)state;
+
+  size_t             msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  size_t             limit = LLMP_INITIAL_MAP_SIZE / 2;
+  afl_shmem_t        stats_map = {0};
+  llmp_stats_page_t *stats;
+  llmp_message_t *   msg;
+  pthread_t          broker_thread;
+  u32                i, sent;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *sender = broker->llmp_clients[0].client_state;
+  llmp_client_state_t *receiver = broker->llmp_clients[1].client_state;
+  llmp_client_ignore_broadcasts(sender);
+
+  assert_int_equal(llmp_client_flow_credit(sender), LLMP_FLOW_DEFAULT_LIMIT);
+
+  /* Without the broker reading, the first page is all we get */
+  llmp_client_set_flow_control(sender, LLMP_FLOW_DROP, limit);
+  for (sent = 0; (msg = llmp_client_alloc_next(sender, msg_len)); sent++) {
+
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = sent;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  assert_true(sent > 1 && sent < 16);
+  assert_int_equal(sender->out_map_count, 1);
+  assert_int_equal(llmp_client_flow_credit(sender), 0);
+  assert_null(llmp_client_alloc_next(sender, msg_len));
+
+  /* Priority msgs are never dropped */
+  msg = llmp_client_alloc_next_priority(sender, msg_len);
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+  memset(msg->buf, 0x41, msg_len);
+  ((u32 *)msg->buf)[0] = 1000;
+  assert_true(llmp_client_send(sender, msg));
+
+  llmp_broker_once(broker);
+  assert_int_equal(llmp_client_flow_credit(sender), limit);
+
+  llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, 1000);
+  for (i = 0; i < sent; i++) {
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+  }
+
+  /* Blocked, nothing gets lost */
+  llmp_client_set_flow_control(sender, LLMP_FLOW_BLOCK, limit);
+  llmp_test_broker_stop = false;
+  assert_int_equal(
+      pthread_create(&broker_thread, NULL, llmp_test_slow_broker, broker), 0);
+
+  for (i = sent; i < sent + 50; i++) {
+
+    msg = llmp_client_alloc_next(sender, msg_len);
+    assert_non_null(msg);
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    memset(msg->buf, 0x41, msg_len);
+    ((u32 *)msg->buf)[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_test_broker_stop = true;
+  pthread_join(broker_thread, NULL);
+
+  for (i = sent; i < sent + 50; i++) {
+
+    llmp_test_check_msg(llmp_client_recv(receiver), sender->id, msg_len, i);
+
+  }
+
+  llmp_broker_update_stats(broker);
+  stats = llmp_stats_map(&stats_map, llmp_broker_stats_shm_str(broker));
+  assert_non_null(stats);
+  assert_int_equal(stats->clients[0].flow_drops, 2);
+  assert_true(stats->clients[0].flow_stalls > 0);
+  assert_int_equal(stats->clients[0].flow_grows, 0);
+
+  afl_shmem_unmap(&stats_map);
+  llmp_broker_destroy(broker);
+
+}
+
+/* Sends a single u32 with the given tag */
+static void llmp_test_send_u32(llmp_client_state_t *client, u32 tag, u32 val) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(client, sizeof(u32));
+  assert_non_null(msg);
+  msg->tag = tag;
+  ((u32 *)msg->buf)[0] = val;
+  assert_true(llmp_client_send(client, msg));
+
+}
+
+/* Drives both bridged brokers once, counting what the receivers get */
+static void llmp_test_pump_bridged(llmp_broker_state_t **brokers,
+                                   llmp_client_state_t **receivers,
+                                   u32 *bridged, u32 *local) {
+
+  llmp_message_t *msg;
+  u32             i;
+
+  for (i = 0; i < 2; i++) {
+
+    llmp_broker_once(brokers[i]);
+
+    while ((msg = llmp_client_recv(receivers[i]))) {
+
+      if (!(msg->sender & LLMP_SENDER_BRIDGED)) {
+
+        local[i]++;
+        continue;
+
+      }
+
+      /* Only queue entries of the other node cross the bridge */
+      assert_int_equal(msg->tag, LLMP_TAG_NEW_QUEUE_ENTRY);
+      assert_int_equal(LLMP_SENDER_ORIGIN(msg->sender), 2 - i);
+      assert_int_equal(LLMP_SENDER_HOPS(msg->sender), 1);
+      assert_int_equal(((u32 *)msg->buf)[0], 2 - i);
+      bridged[i]++;
+
+    }
+
+  }
+
+  usleep(1000);
+
+}
+
+/* Two brokers, bridged over loopback, share their queue entries */
+static void test_llmp_bridge(void **state) {
+
+  (void)state;
+
+  u32                  tags[] = {LLMP_TAG_NEW_QUEUE_ENTRY};
+  llmp_broker_state_t *brokers[2];
+  llmp_bridge_t *      bridges[2];
+  llmp_client_state_t *senders[2];
+  llmp_client_state_t *receivers[2];
+  u32                  bridged[2] = {0};
+  u32                  local[2] = {0};
+  u32                  i, round;
+
+  for (i = 0; i < 2; i++) {
+
+    brokers[i] = llmp_broker_new();
+    assert_non_null(brokers[i]);
+    llmp_broker_set_node_id(brokers[i], i + 1);
+
+    assert_true(
+        llmp_broker_register_threaded_clientloop(brokers[i], NULL, NULL));
+    assert_true(
+        llmp_broker_register_threaded_clientloop(brokers[i], NULL, NULL));
+    senders[i] = brokers[i]->llmp_clients[0].client_state;
+    receivers[i] = brokers[i]->llmp_clients[1].client_state;
+    llmp_client_ignore_broadcasts(senders[i]);
+
+  }
+
+  /* The first bridge listens on a free port, the second one connects */
+  bridges[0] = llmp_broker_register_bridge(brokers[0], NULL, 0, tags, 1);
+  assert_non_null(bridges[0]);
+  bridges[1] = llmp_broker_register_bridge(brokers[1], "127.0.0.1",
+                                           bridges[0]->port, tags, 1);
+  assert_non_null(bridges[1]);
+
+  for (i = 0; i < 2; i++) {
+
+    /* Only starts the bridges, we drive the rest */
+    assert_true(llmp_broker_launch_clientloops(brokers[i]));
+    llmp_test_send_u32(senders[i], LLMP_TAG_NEW_QUEUE_ENTRY, i + 1);
+    llmp_test_send_u32(senders[i], LLMP_TAG_TEST_COUNTER_V1, i + 1);
+
+  }
+
+  for (round = 0; round < 5000 && !(bridged[0] && bridged[1]); round++) {
+
+    llmp_test_pump_bridged(brokers, receivers, bridged, local);
+
+  }
+
+  /* Give msgs the chance to bounce back and forth */
+  for (round = 0; round < 100; round++) {
+
+    llmp_test_pump_bridged(brokers, receivers, bridged, local);
+
+  }
+
+  for (i = 0; i < 2; i++) {
+
+    assert_int_equal(bridged[i], 1);
+    assert_int_equal(local[i], 2);
+    assert_int_equal(bridges[i]->msgs_out, 1);
+    assert_int_equal(bridges[i]->msgs_in, 1);
+
+  }
+
+  for (i = 0; i < 2; i++) {
+
+    llmp_bridge_stop(bridges[i]);
+    pthread_join(*brokers[i]->llmp_clients[2].pthread, NULL);
+    llmp_broker_destroy(brokers[i]);
+
+  }
+
+}
+
+/* The broadcast watermark the bridge of the broker publishes on lane 0 */
+static u32 llmp_test_bridge_watermark(llmp_broker_state_t *broker) {
+
+  return __atomic_load_n(
+      &((llmp_page_t *)broker->llmp_clients[2].cur_client_map->map)
+           ->watermarks[0],
+      __ATOMIC_ACQUIRE);
+
+}
+
+/* Sends a msg of len bytes, filled with val, and drives the broker */
+static void llmp_test_send_fill(llmp_broker_state_t *broker,
+                                llmp_client_state_t *sender,
+                                llmp_client_state_t *receiver, u32 tag,
+                                size_t len, u8 val) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(sender, len);
+  assert_non_null(msg);
+  msg->tag = tag;
+  memset(msg->buf, val, len);
+  assert_true(llmp_client_send(sender, msg));
+
+  llmp_broker_once(broker);
+  while (llmp_client_recv(receiver)) {}
+
+}
+
+/* While the bridge is down, the broker frees and reuses the page the bridge
+ * was at. After the reconnect, it must not read on from there. */
+static void test_llmp_bridge_reconnect(void **state) {
+
+  (void)state;
+
+  u32                  tags[] = {LLMP_TAG_NEW_QUEUE_ENTRY};
+  size_t               msg_len = LLMP_INITIAL_MAP_SIZE / 16;
+  llmp_broker_state_t *brokers[2];
+  llmp_bridge_t *      bridges[2];
+  llmp_client_state_t *senders[2];
+  llmp_client_state_t *receivers[2];
+  struct sockaddr_in   addr = {0};
+  llmp_message_t *     msg;
+  u32                  bridged = 0;
+  u32                  watermark = 0;
+  u32                  i, round;
+
+  for (i = 0; i < 2; i++) {
+
+    brokers[i] = llmp_broker_new();
+    assert_non_null(brokers[i]);
+    llmp_broker_set_node_id(brokers[i], i + 1);
+
+    assert_true(
+        llmp_broker_register_threaded_clientloop(brokers[i], NULL, NULL));
+    assert_true(
+        llmp_broker_register_threaded_clientloop(brokers[i], NULL, NULL));
+    senders[i] = brokers[i]->llmp_clients[0].client_state;
+    receivers[i] = brokers[i]->llmp_clients[1].client_state;
+    llmp_client_ignore_broadcasts(senders[i]);
+
+  }
+
+  bridges[0] = llmp_broker_register_bridge(brokers[0], NULL, 0, tags, 1);
+  assert_non_null(bridges[0]);
+  bridges[1] = llmp_broker_register_bridge(brokers[1], "127.0.0.1",
+                                           bridges[0]->port, tags, 1);
+  assert_non_null(bridges[1]);
+
+  for (i = 0; i < 2; i++) {
+
+    assert_true(llmp_broker_launch_clientloops(brokers[i]));
+
+  }
+
+  /* Move the bridge of node 1 past the first page, which never gets freed */
+  for (i = 0; i < 32; i++) {
+
+    llmp_test_send_fill(brokers[0], senders[0], receivers[0],
+                        LLMP_TAG_TEST_COUNTER_V1, msg_len, 0x41);
+
+  }
+
+  for (round = 0; round < 5000; round++) {
+
+    watermark = llmp_test_bridge_watermark(brokers[0]);
+    if (watermark && watermark != LLMP_WATERMARK_NO_RECV) { break; }
+    llmp_broker_once(brokers[0]);
+    usleep(1000);
+
+  }
+
+  assert_true(round < 5000);
+
+  /* Queue a peer that never says hello before dropping the connection, so
+   * the bridge stays down until we close it */
+  int fake_fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(fake_fd != -1);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(bridges[0]->port);
+  assert_int_equal(connect(fake_fd, (struct sockaddr *)&addr, sizeof(addr)),
+                   0);
+  shutdown(bridges[0]->fd, SHUT_RDWR);
+
+  for (round = 0; round < 5000; round++) {
+
+    if (llmp_test_bridge_watermark(brokers[0]) == LLMP_WATERMARK_NO_RECV) {
+
+      break;
+
+    }
+
+    usleep(1000);
+
+  }
+
+  assert_true(round < 5000);
+
+  /* Fill a few pages, so the old ones get freed and reused */
+  llmp_broker_lane_t *lane = &brokers[0]->lanes[0];
+  for (i = 0; i < 128; i++) {
+
+    llmp_test_send_fill(brokers[0], senders[0], receivers[0],
+                        LLMP_TAG_TEST_COUNTER_V1, msg_len, 0x42);
+
+  }
+
+  assert_true(lane->broadcast_map_count < 4);
+  assert_true(((llmp_page_t *)lane->broadcast_maps[1].map)->generation >
+              watermark + LLMP_PAGE_POOL_SIZE);
+
+  close(fake_fd);
+
+  /* Sent after the reconnect, they have to make it across intact */
+  for (i = 0; i < 4; i++) {
+
+    llmp_test_send_fill(brokers[0], senders[0], receivers[0],
+                        LLMP_TAG_NEW_QUEUE_ENTRY, msg_len, 0x43);
+
+  }
+
+  for (round = 0; round < 5000 && bridged < 4; round++) {
+
+    llmp_broker_once(brokers[0]);
+    llmp_broker_once(brokers[1]);
+
+    while ((msg = llmp_client_recv(receivers[1]))) {
+
+      assert_int_equal(msg->tag, LLMP_TAG_NEW_QUEUE_ENTRY);
+      assert_int_equal(LLMP_SENDER_ORIGIN(msg->sender), 1);
+      assert_int_equal(msg->buf_len, msg_len);
+      assert_int_equal(msg->buf[0], 0x43);
+      assert_int_equal(msg->buf[msg_len - 1], 0x43);
+      bridged++;
+
+    }
+
+    usleep(1000);
+
+  }
+
+  assert_int_equal(bridged, 4);
+
+  for (i = 0; i < 2; i++) {
+
+    llmp_bridge_stop(bridges[i]);
+    pthread_join(*brokers[i]->llmp_clients[2].pthread, NULL);
+    llmp_broker_destroy(brokers[i]);
+
+  }
+
+}
+
+#define LLMP_TEST_UNIX_PATH "/tmp/llmp_test_unix.sock"
+
+/* A client process connects over the unix socket and sends a msg. With
+ * USEMEMFD, it dies before the broker got to map its page: the passed fd
+ * keeps the page around. Other maps die with their last user, the client
+ * waits for the broker there. */
+static void test_llmp_unix_server(void **state) {
+
+  (void)state;
+
+  llmp_message_t *msg = NULL;
+  int             status;
+  int             done[2];
+  u32             round;
+
+  llmp_broker_state_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_int_equal(pipe(done), 0);
+
+  assert_true(llmp_broker_register_threaded_clientloop(broker, NULL, NULL));
+  llmp_client_state_t *receiver = broker->llmp_clients[0].client_state;
+
+  assert_null(llmp_broker_register_unix_server(
+      broker, "/tmp/this/path/is/much/too/long/for/a/unix/socket/so/it/should/"
+              "get/refused/right/away/by/the/broker/llmp.sock"));
+
+  llmp_unix_server_t *server =
+      llmp_broker_register_unix_server(broker, LLMP_TEST_UNIX_PATH);
+  assert_non_null(server);
+  assert_true(llmp_broker_launch_clientloops(broker));
+
+  pid_t pid = fork();
+  assert_int_not_equal(pid, -1);
+  if (!pid) {
+
+    close(done[1]);
+    llmp_client_state_t *client = llmp_client_new_unix(LLMP_TEST_UNIX_PATH);
+    if (!client) { _exit(1); }
+    msg = llmp_client_alloc_next(client, sizeof(u32));
+    if (!msg) { _exit(1); }
+    msg->tag = LLMP_TAG_TEST_COUNTER_V1;
+    ((u32 *)msg->buf)[0] = 0x1337;
+    if (!llmp_client_send(client, msg)) { _exit(1); }
+#ifndef USEMEMFD
+    /* Returns once the parent closed its end */
+    if (read(done[0], &status, 1)) { _exit(1); }
+#endif
+    _exit(0);
+
+  }
+
+  close(done[0]);
+#ifdef USEMEMFD
+  assert_int_equal(waitpid(pid, &status, 0), pid);
+#endif
+
+  for (round = 0; round < 1000 && !msg; round++) {
+
+    llmp_broker_once(broker);
+    msg = llmp_client_recv(receiver);
+    if (!msg) { usleep(1000); }
+
+  }
+
+  close(done[1]);
+#ifndef USEMEMFD
+  assert_int_equal(waitpid(pid, &status, 0), pid);
+#endif
+  assert_true(WIFEXITED(status));
+  assert_int_equal(WEXITSTATUS(status), 0);
+
+  assert_non_null(msg);
+  assert_int_equal(msg->tag, LLMP_TAG_TEST_COUNTER_V1);
+  assert_int_equal(((u32 *)msg->buf)[0], 0x1337);
+  assert_int_equal(server->clients_added, 1);
+  assert_int_equal(broker->llmp_client_count, 3);
+
+  llmp_unix_server_stop(server);
+  pthread_join(*broker->llmp_clients[1].pthread, NULL);
+  llmp_broker_destroy(broker);
+
+  /* The socket goes away with the broker */
+  assert_int_not_equal(access(LLMP_TEST_UNIX_PATH, F_OK), 0);
+
+}
+
 int main(int argc, char **argv) {
 
   const struct CMUnitTest tests[] = {
 
       cmocka_unit_test(test_llmp_client),
+      cmocka_unit_test(test_llmp_page_layout),
+      cmocka_unit_test(test_llmp_broker_forward),
+      cmocka_unit_test(test_llmp_broker_forward_zero_copy),
+      cmocka_unit_test(test_llmp_broker_forward_span),
+      cmocka_unit_test(test_llmp_broker_gc),
+      cmocka_unit_test(test_llmp_broker_gc_liveness),
+      cmocka_unit_test(test_llmp_broker_stats),
+      cmocka_unit_test(test_llmp_dedup),
+      cmocka_unit_test(test_llmp_async_hooks),
+      cmocka_unit_test(test_llmp_journal),
+      cmocka_unit_test(test_llmp_broker_lanes),
+      cmocka_unit_test(test_llmp_priority),
+      cmocka_unit_test(test_llmp_oob),
+      cmocka_unit_test(test_llmp_flow_control),
+      cmocka_unit_test(test_llmp_bridge),
+      cmocka_unit_test(test_llmp_bridge_reconnect),
+      cmocka_unit_test(test_llmp_unix_server),
+      cmocka_unit_test(test_llmp_client_recv_batch),
+      cmocka_unit_test(test_llmp_client_recv_batch_zero_copy),
 
   };
 
@@ -98,6 +98,49 @@ static void test_erase_bytes(void **state) {
 
 }
 
+/* Testing shared maps, they have to be reachable from other processes */
+
+#include <sys/wait.h>
+#include "afl-shmem.h"
+
+static void test_shmem_by_str(void **state) {
+
+  (void)state;
+
+  afl_shmem_t shm = {0}, other = {0};
+  int         status = -1;
+  pid_t       pid;
+
+  assert_non_null(afl_shmem_init(&shm, 12345));
+  assert_int_equal(shm.map_size, 12345);
+  assert_true(shm.shm_str[0] != '\0');
+
+  pid = fork();
+  assert_true(pid >= 0);
+  if (!pid) {
+
+    if (!afl_shmem_by_str(&other, shm.shm_str, 12345)) { _exit(1); }
+    memcpy(other.map + 12340, "hi", 3);
+    afl_shmem_unmap(&other);
+    _exit(0);
+
+  }
+
+  waitpid(pid, &status, 0);
+  assert_int_equal(status, 0);
+  assert_string_equal(shm.map + 12340, "hi");
+
+  /* read-only maps see the same memory */
+  assert_non_null(afl_shmem_by_str_readonly(&other, shm.shm_str, 12345));
+  assert_string_equal(other.map + 12340, "hi");
+  afl_shmem_unmap(&other);
+  assert_null(other.map);
+
+  afl_shmem_deinit(&shm);
+  assert_null(shm.map);
+
+}
+
 /* Unittests for libinput based default functions */
 
 #include "input.h"
@@ -392,8 +435,7 @@ void test_queue_set_directory(void **state) {
 
   assert_string_equal(queue.dirpath, new_dirpath);
 
-  afl_shmem_deinit(queue.shared_mem);
-  free(queue.shared_mem);
+  afl_base_queue_deinit(&queue);
 
 }
 
@@ -437,6 +479,437 @@ void test_base_queue_get_next(void **state) {
 
 }
 
+/* The queue grows way past the old 8192 entries, without moving entries */
+void test_base_queue_grow(void **state) {
+
+  (void)state;
+
+  engine_t engine;
+  afl_engine_init(&engine, NULL, NULL, NULL);
+
+  base_queue_t queue;
+  afl_base_queue_init(&queue);
+  queue.engine = &engine;
+  queue.engine_id = engine.id;
+
+  /* The entries share one empty input, only the index is under test */
+  raw_input_t    input;
+  size_t         i, count = 100000;
+  queue_entry_t *entries = calloc(count, sizeof(queue_entry_t));
+  assert_non_null(entries);
+  afl_input_init(&input);
+
+  for (i = 0; i < count; i++) {
+
+    afl_queue_entry_init(&entries[i], &input);
+
+  }
+
+  queue.funcs.add_to_queue(&queue, &entries[0]);
+  queue_entry_t **first_slot = afl_queue_index_slot(&queue.entries, 0);
+
+  for (i = 1; i < count; i++) {
+
+    queue.funcs.add_to_queue(&queue, &entries[i]);
+
+  }
+
+  assert_int_equal(queue.size, count);
+  assert_ptr_equal(afl_queue_index_slot(&queue.entries, 0), first_slot);
+
+  for (i = 0; i < queue.size; i++) {
+
+    assert_ptr_equal(afl_base_queue_entry(&queue, i), &entries[i]);
+    assert_int_equal(entries[i].idx, i);
+
+  }
+
+  /* Never more than twice the slots needed */
+  size_t slots = 0;
+  for (i = 0; i < queue.entries.chunk_count; i++) {
+
+    slots += (size_t)QUEUE_INDEX_FIRST_CHUNK << i;
+
+  }
+
+  assert_true(slots >= queue.size && slots < 2 * queue.size);
+
+  /* What each entry costs, before its input: itself, and its share of the
+   * index. With 64 list boxes embedded in each entry, it was over 2 KB. */
+  size_t footprint =
+      sizeof(queue_entry_t) + slots * sizeof(queue_entry_t *) / queue.size;
+  assert_true(footprint <= 160);
+
+  afl_base_queue_deinit(&queue);
+  assert_int_equal(queue.entries.chunk_count, 0);
+
+  free(entries);
+  afl_input_deinit(&input);
+
+}
+
+/* Parents and children, by index in their queue */
+void test_queue_entry_lineage(void **state) {
+
+  (void)state;
+
+  engine_t engine;
+  afl_engine_init(&engine, NULL, NULL, NULL);
+
+  base_queue_t queue;
+  afl_base_queue_init(&queue);
+  queue.engine = &engine;
+  queue.engine_id = engine.id;
+
+  queue_entry_t *entries[4];
+  size_t         i;
+
+  for (i = 0; i < 4; i++) {
+
+    entries[i] = afl_queue_entry_create(afl_input_create());
+    assert_non_null(entries[i]);
+    assert_null(entries[i]->funcs.get_parent(entries[i]));
+    queue.funcs.add_to_queue(&queue, entries[i]);
+
+  }
+
+  assert_int_equal(afl_queue_entry_add_child(entries[0], entries[2]),
+                   AFL_RET_SUCCESS);
+  assert_int_equal(afl_queue_entry_add_child(entries[0], entries[3]),
+                   AFL_RET_SUCCESS);
+
+  assert_int_equal(entries[0]->children_num, 2);
+  assert_ptr_equal(entries[0]->funcs.get_child(entries[0], 0), entries[2]);
+  assert_ptr_equal(entries[0]->funcs.get_child(entries[0], 1), entries[3]);
+  assert_null(entries[0]->funcs.get_child(entries[0], 2));
+  assert_ptr_equal(entries[3]->funcs.get_parent(entries[3]), entries[0]);
+  assert_null(entries[1]->funcs.get_parent(entries[1]));
+  assert_null(entries[1]->children);
+
+  for (i = 0; i < 4; i++) {
+
+    afl_queue_entry_delete(entries[i]);
+
+  }
+
+  afl_base_queue_deinit(&queue);
+
+}
+
+/* Inputs beyond the ram budget get evicted to disk, and come back on use */
+void test_base_queue_ram_budget(void **state) {
+
+  (void)state;
+
+  char *         dir = "/tmp/afl_queue_test_evict";
+  queue_entry_t *entries[16];
+  size_t         i, evicted = 0;
+
+  engine_t engine;
+  afl_engine_init(&engine, NULL, NULL, NULL);
+
+  base_queue_t queue;
+  afl_base_queue_init(&queue);
+  queue.engine = &engine;
+  queue.engine_id = engine.id;
+
+  /* Evicted inputs need somewhere to go */
+  assert_int_not_equal(afl_base_queue_set_ram_budget(&queue, 4 * 65),
+                       AFL_RET_SUCCESS);
+
+  mkdir(dir, 0700);
+  queue.funcs.set_directory(&queue, dir);
+  assert_int_equal(afl_base_queue_set_ram_budget(&queue, 4 * 65),
+                   AFL_RET_SUCCESS);
+
+  for (i = 0; i < 16; i++) {
+
+    raw_input_t *input = afl_input_create();
+    input->bytes = calloc(65, 1);
+    memset(input->bytes, 'a' + i, 64);
+    input->len = 64;
+    entries[i] = afl_queue_entry_create(input);
+    queue.funcs.add_to_queue(&queue, entries[i]);
+    assert_true(queue.ram_used <= 4 * 65);
+
+  }
+
+  for (i = 0; i < 16; i++) {
+
+    if (entries[i]->funcs.is_on_disk(entries[i])) { evicted++; }
+
+  }
+
+  assert_int_equal(evicted, 12);
+
+  /* Pinned entries stay, whatever else gets used */
+  u8 *pinned_bytes = entries[3]->funcs.get_input(entries[3])->bytes;
+  entries[3]->pinned = true;
+
+  for (i = 0; i < 16; i++) {
+
+    raw_input_t *input = entries[i]->funcs.get_input(entries[i]);
+    assert_non_null(input);
+    assert_int_equal(input->len, 64);
+    assert_int_equal(input->bytes[0], 'a' + i);
+    assert_int_equal(input->bytes[63], 'a' + i);
+    assert_false(entries[i]->on_disk);
+    assert_true(queue.ram_used <= 4 * 65);
+
+  }
+
+  assert_false(entries[3]->on_disk);
+  assert_ptr_equal(entries[3]->input->bytes, pinned_bytes);
+
+  /* Inputs changed while queued get counted as they are now */
+  entries[3]->input->funcs.clear(entries[3]->input);
+  entries[3]->funcs.get_input(entries[3]);
+  size_t ram_used = 0;
+  for (i = 0; i < 16; i++) {
+
+    ram_used += entries[i]->ram_size;
+
+  }
+
+  assert_int_equal(entries[3]->ram_size, 1);
+  assert_int_equal(queue.ram_used, ram_used);
+
+  /* Empty inputs don't go to disk, they can't be loaded from there */
+  entries[3]->pinned = false;
+  afl_base_queue_set_ram_budget(&queue, 1);
+  entries[0]->funcs.get_input(entries[0]);
+  assert_false(entries[3]->on_disk);
+  assert_null(entries[3]->input->bytes);
+  assert_non_null(entries[3]->funcs.get_input(entries[3]));
+  assert_int_equal(entries[3]->input->len, 0);
+
+  for (i = 0; i < 16; i++) {
+
+    if (entries[i]->filename) { unlink(entries[i]->filename); }
+    afl_queue_entry_delete(entries[i]);
+
+  }
+
+  rmdir(dir);
+  afl_base_queue_deinit(&queue);
+
+}
+
+void test_queue_entry_wire(void **state) {
+
+  (void)state;
+
+  u8  wire_buf[sizeof(queue_entry_wire_t) + 16];
+  u8  bytes[] = "wire test input";
+  u64 wire_len;
+
+  raw_input_t input;
+  afl_input_init(&input);
+  input.bytes = bytes;
+  input.len = sizeof(bytes);
+
+  queue_entry_t entry;
+  afl_queue_entry_init(&entry, &input);
+
+  wire_len = afl_queue_entry_wire_len(&entry);
+  assert_int_equal(wire_len, sizeof(queue_entry_wire_t) + sizeof(bytes));
+
+  queue_entry_wire_t *wire = (queue_entry_wire_t *)wire_buf;
+  afl_queue_entry_to_wire(&entry, wire);
+  assert_int_equal(wire->flags, 0);
+
+  raw_input_t *copy = afl_input_create();
+  assert_non_null(copy);
+  assert_int_equal(afl_queue_entry_from_wire(wire, wire_len, copy),
+                   AFL_RET_SUCCESS);
+  assert_int_equal(copy->len, sizeof(bytes));
+  assert_memory_equal(copy->bytes, bytes, sizeof(bytes));
+
+  /* Truncated msgs and other versions are refused */
+  assert_int_equal(afl_queue_entry_from_wire(wire, wire_len - 1, copy),
+                   AFL_RET_MALFORMED_MSG);
+  wire->version++;
+  assert_int_equal(afl_queue_entry_from_wire(wire, wire_len, copy),
+                   AFL_RET_MALFORMED_MSG);
+
+  afl_input_delete(copy);
+
+}
+
+void test_corpus_store(void **state) {
+
+  (void)state;
+
+  char *       path = "/tmp/afl_corpus_test_store";
+  afl_corpus_t corpus;
+  size_t       id;
+
+  unlink(path);
+
+  /* Nothing to read yet */
+  assert_int_not_equal(afl_corpus_open(&corpus, path, false), AFL_RET_SUCCESS);
+
+  assert_int_equal(afl_corpus_open(&corpus, path, true), AFL_RET_SUCCESS);
+  assert_int_equal(afl_corpus_count(&corpus), 0);
+
+  /* There is only one writer */
+  afl_corpus_t other;
+  assert_int_equal(afl_corpus_open(&other, path, true), AFL_RET_IN_USE);
+  assert_int_equal(afl_corpus_append(&corpus, (u8 *)"first", 5, &id),
+                   AFL_RET_SUCCESS);
+  assert_int_equal(id, 0);
+
+  /* Inputs added to a queue with a store end up in it */
+  engine_t engine;
+  afl_engine_init(&engine, NULL, NULL, NULL);
+
+  base_queue_t queue;
+  afl_base_queue_init(&queue);
+  queue.engine = &engine;
+  queue.engine_id = engine.id;
+  afl_base_queue_set_corpus(&queue, &corpus);
+
+  raw_input_t *input = afl_input_create();
+  input->bytes = calloc(7, 1);
+  memcpy(input->bytes, "second", 6);
+  input->len = 6;
+  queue_entry_t *entry = afl_queue_entry_create(input);
+  queue.funcs.add_to_queue(&queue, entry);
+
+  assert_int_equal(afl_corpus_count(&corpus), 2);
+  assert_true(input->mapped);
+  assert_memory_equal(input->bytes, "second", 6);
+
+  afl_queue_entry_delete(entry);
+  afl_base_queue_deinit(&queue);
+  afl_corpus_close(&corpus);
+
+  /* Reopened, the inputs point right into the map */
+  assert_int_equal(afl_corpus_open(&corpus, path, false), AFL_RET_SUCCESS);
+  assert_int_equal(afl_corpus_count(&corpus), 2);
+  assert_int_not_equal(afl_corpus_append(&corpus, (u8 *)"x", 1, NULL),
+                       AFL_RET_SUCCESS);
+
+  input = afl_input_create();
+  assert_int_equal(afl_corpus_input(&corpus, 0, input), AFL_RET_SUCCESS);
+  assert_int_equal(input->len, 5);
+  assert_memory_equal(input->bytes, "first", 6);
+  assert_ptr_equal(input->bytes, corpus.data);
+  assert_int_equal(afl_corpus_input(&corpus, 1, input), AFL_RET_SUCCESS);
+  assert_int_equal(input->len, 6);
+  assert_memory_equal(input->bytes, "second", 7);
+  assert_int_equal(afl_corpus_input(&corpus, 2, input), AFL_RET_ARRAY_END);
+
+  /* Loading the store runs each testcase, and queues it without a copy */
+  executor_t       executor;
+  feedback_t       feedback;
+  feedback_queue_t feedback_queue;
+  afl_executor_init(&executor);
+  afl_engine_init(&engine, &executor, NULL, NULL);
+  engine.funcs.execute = engine_mock_execute;
+  afl_feedback_init(&feedback, NULL);
+  afl_feedback_queue_init(&feedback_queue, &feedback, "corpus");
+  feedback_queue.base.engine = &engine;
+  engine.funcs.add_feedback(&engine, &feedback);
+
+  assert_int_equal(engine.funcs.load_testcases_from_corpus(&engine, &corpus),
+                   AFL_RET_SUCCESS);
+  assert_int_equal(feedback_queue.base.size, 2);
+  for (id = 0; id < 2; id++) {
+
+    entry = afl_base_queue_entry(&feedback_queue.base, id);
+    assert_true(entry->input->mapped);
+    assert_ptr_equal(entry->input->bytes,
+                     corpus.data + corpus.index[id].offset);
+    afl_queue_entry_delete(entry);
+
+  }
+
+  afl_feedback_queue_deinit(&feedback_queue);
+
+  /* Copies are ours to change */
+  raw_input_t *copy = input->funcs.copy(input);
+  assert_false(copy->mapped);
+  copy->bytes[0] = 'S';
+
+  /* Restored from a mapped input, an input doesn't own its bytes either */
+  raw_input_t *restored = afl_input_create();
+  restored->funcs.restore(restored, input);
+  assert_true(restored->mapped);
+  assert_int_equal(restored->len, 6);
+  afl_input_delete(restored);
+
+  afl_input_delete(copy);
+  afl_corpus_close(&corpus);
+
+  /* Slices pointing past the data are refused */
+  assert_int_equal(afl_corpus_open(&corpus, path, true), AFL_RET_SUCCESS);
+  corpus.index[1].len = 1 << 20;
+  assert_int_equal(afl_corpus_input(&corpus, 1, input), AFL_RET_MALFORMED_MSG);
+  corpus.index[1].offset = (u64)-2;
+  corpus.index[1].len = 1;
+  assert_int_equal(afl_corpus_input(&corpus, 1, input), AFL_RET_MALFORMED_MSG);
+
+  afl_input_delete(input);
+  afl_corpus_close(&corpus);
+  unlink(path);
+
+}
+
+/* Entries of others get queued, our own broadcasts coming back don't */
+void test_engine_handle_own_entries(void **state) {
+
+  (void)state;
+
+  u8 bytes[] = "shared entry";
+
+  global_queue_t   global_queue;
+  feedback_queue_t feedback_queue;
+  engine_t         engine;
+  afl_global_queue_init(&global_queue);
+  afl_engine_init(&engine, NULL, NULL, &global_queue);
+  afl_feedback_queue_init(&feedback_queue, NULL, "shared");
+  global_queue.extra_funcs.add_feedback_queue(&global_queue, &feedback_queue);
+
+  llmp_client_state_t *llmp_client = calloc(1, sizeof(llmp_client_state_t));
+  assert_non_null(llmp_client);
+  llmp_client->id = 1;
+  engine.llmp_client = llmp_client;
+
+  raw_input_t input;
+  afl_input_init(&input);
+  input.bytes = bytes;
+  input.len = sizeof(bytes);
+  queue_entry_t entry;
+  afl_queue_entry_init(&entry, &input);
+
+  llmp_message_t *msg =
+      calloc(1, sizeof(llmp_message_t) + afl_queue_entry_wire_len(&entry));
+  assert_non_null(msg);
+  msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY;
+  msg->buf_len = afl_queue_entry_wire_len(&entry);
+  afl_queue_entry_to_wire(&entry, (queue_entry_wire_t *)msg->buf);
+
+  msg->sender = llmp_client->id;
+  engine.funcs.handle_new_message(&engine, msg);
+  assert_int_equal(feedback_queue.base.size, 0);
+
+  msg->sender = llmp_client->id + 1;
+  engine.funcs.handle_new_message(&engine, msg);
+  assert_int_equal(feedback_queue.base.size, 1);
+
+  queue_entry_t *shared = afl_base_queue_entry(&feedback_queue.base, 0);
+  assert_true(shared->from_wire);
+  assert_memory_equal(shared->input->bytes, bytes, sizeof(bytes));
+
+  afl_queue_entry_delete(shared);
+  afl_feedback_queue_deinit(&feedback_queue);
+  afl_global_queue_deinit(&global_queue);
+  free(msg);
+  free(llmp_client);
+
+}
+
 int main(int argc, char **argv) {
 
   const struct CMUnitTest tests[] = {
@@ -445,6 +918,8 @@ int main(int argc, char **argv) {
       cmocka_unit_test(test_insert_bytes),
       cmocka_unit_test(test_erase_bytes),
 
+      cmocka_unit_test(test_shmem_by_str),
+
       cmocka_unit_test(test_input_load_from_file),
       cmocka_unit_test(test_input_save_to_file),
       cmocka_unit_test(test_input_copy),
@@ -455,6 +930,12 @@ int main(int argc, char **argv) {
 
       cmocka_unit_test(test_queue_set_directory),
       cmocka_unit_test(test_base_queue_get_next),
+      cmocka_unit_test(test_base_queue_grow),
+      cmocka_unit_test(test_queue_entry_lineage),
+      cmocka_unit_test(test_base_queue_ram_budget),
+      cmocka_unit_test(test_queue_entry_wire),
+      cmocka_unit_test(test_engine_handle_own_entries),
+      cmocka_unit_test(test_corpus_store),
 
   };
 